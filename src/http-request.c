@@ -99,7 +99,7 @@ _http_insert(unsigned char** r_hdr, size_t start, size_t end, size_t header_leng
 
 
 static size_t is_eol(const void* hdr, size_t offset, size_t header_length) {
-    const unsigned* chdr = (const unsigned*)hdr;
+    const unsigned char* chdr = (const unsigned char*)hdr;
 
     while (offset < header_length && chdr[offset] == '\r')
         offset++;
@@ -127,7 +127,7 @@ http_edit_request(
     offset = _skip(spaces, *hdr, offset, header_length);
 
     /* Method */
-    if (offset == header_length || is_eol(hdr, offset, header_length))
+    if (offset == header_length || is_eol(*hdr, offset, header_length))
         header_length = _http_insert(hdr, offset, offset, header_length, "GET", 3);
     next = _skip(notspaces, *hdr, offset, header_length);
     if (is_equal(name, name_length, "method", 6)) {
@@ -138,12 +138,12 @@ http_edit_request(
 
 
     /* Method space */
-    if (offset == header_length || is_eol(hdr, offset, header_length))
+    if (offset == header_length || is_eol(*hdr, offset, header_length))
         header_length = _http_insert(hdr, offset, offset, header_length, " ", 1);
     offset = _skip(spaces, *hdr, offset, header_length);
 
     /* URL */
-    if (offset == header_length || is_eol(hdr, offset, header_length))
+    if (offset == header_length || is_eol(*hdr, offset, header_length))
         header_length = _http_insert(hdr, offset, offset, header_length, "/", 1);
     next = _skip(notspaces, *hdr, offset, header_length);
     if (is_equal(name, name_length, "url", 3)) {
@@ -153,12 +153,12 @@ http_edit_request(
     offset = _skip(notspaces, *hdr, offset, header_length);
 
     /* Space after URL */
-    if (offset == header_length || is_eol(hdr, offset, header_length))
+    if (offset == header_length || is_eol(*hdr, offset, header_length))
         header_length = _http_insert(hdr, offset, offset, header_length, " ", 1);
     offset = _skip(spaces, *hdr, offset, header_length);
 
     /* version */
-    if (offset == header_length || is_eol(hdr, offset, header_length))
+    if (offset == header_length || is_eol(*hdr, offset, header_length))
         header_length = _http_insert(hdr, offset, offset, header_length, "HTTP/1.1", 8);
     next = _skip(notspaces, *hdr, offset, header_length);
     if (is_equal(name, name_length, "version", 7)) {
@@ -178,7 +178,7 @@ http_edit_request(
         header_length = _http_insert(hdr, offset, offset, header_length, "\r\n", 2);
 
     /* emumerate all header fields */
-    while (!is_eol(hdr, offset, header_length)) {
+    while (!is_eol(*hdr, offset, header_length)) {
         next = _skip(end_of_name, *hdr, offset, header_length);
         if (offset == next)
             break;
@@ -222,6 +222,8 @@ int http_edit_request_selftest(void) {
         {"", "version", "HTTP/1.1", "GET / HTTP/1.1\r\n\r\n"},
         {"", "", "", "GET / HTTP/1.1\r\n\r\n"},
         {"", "url", "/index.html", "GET /index.html HTTP/1.1\r\n\r\n"},
+        {"GET / HTTP/1.1\r\nHost: a\r\nAccept: */*\r\n\r\n", "Cookie", "x=1", "GET / HTTP/1.1\r\nHost: a\r\nAccept: */*\r\nCookie: x=1\r\n\r\n"},
+        {"GET / HTTP/1.1\r\nHost: a\r\nAccept: */*\r\n\r\n", "method", "POST", "POST / HTTP/1.1\r\nHost: a\r\nAccept: */*\r\n\r\n"},
         {0, 0, 0, 0}
     };
     size_t i;
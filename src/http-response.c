@@ -27,6 +27,7 @@ enum {
     HTTPFIELD_CONTENT_TYPE,
     HTTPFIELD_VIA,
     HTTPFIELD_LOCATION,
+    HTTPFIELD_TRANSFER_ENCODING,
     HTTPFIELD_UNKNOWN,
     HTTPFIELD_NEWLINE,
 };
@@ -36,6 +37,7 @@ static struct Patterns http_field_names[] = {
     {"Content-Type:",   13, HTTPFIELD_CONTENT_TYPE,     SMACK_ANCHOR_BEGIN},
     {"Via:",             4, HTTPFIELD_VIA,              SMACK_ANCHOR_BEGIN},
     {"Location:",        9, HTTPFIELD_LOCATION,         SMACK_ANCHOR_BEGIN},
+    {"Transfer-Encoding:",18, HTTPFIELD_TRANSFER_ENCODING, SMACK_ANCHOR_BEGIN},
     {":",                1, HTTPFIELD_UNKNOWN, 0},
     {"\n",               1, HTTPFIELD_NEWLINE, 0},
     {0,0,0,0}
@@ -88,6 +90,36 @@ http_rsp_init(void) {
 
 
 
+/***************************************************************************
+ * Look for "chunked" in the Transfer-Encoding: field, one byte at a time,
+ * remembering how much of it we've matched so far.
+ ***************************************************************************/
+static void
+_transfer_encoding(struct http_response_t *http, unsigned char c) {
+    static const char chunked[] = "chunked";
+
+    c = (unsigned char)tolower(c);
+    if (c == chunked[http->chunked_matched]) {
+        http->chunked_matched++;
+        if (http->chunked_matched == sizeof(chunked) - 1) {
+            http->is_chunked = true;
+            http->chunked_matched = 0;
+        }
+    } else
+        http->chunked_matched = (c == 'c');
+}
+
+static int
+_hexval(unsigned char c) {
+    if ('0' <= c && c <= '9')
+        return c - '0';
+    if ('a' <= c && c <= 'f')
+        return c - 'a' + 10;
+    if ('A' <= c && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
 /***************************************************************************
  * BIZARRE CODE ALERT!
  *
@@ -130,6 +162,12 @@ http_rsp_parse(struct http_response_t *http,
         CONTENT,
         CONTENT_TAG,
         CONTENT_FIELD,
+        CHUNK_SIZE,
+        CHUNK_EXTENSION,
+        CHUNK_DATA,
+        CHUNK_DATA_END,
+        CHUNK_TRAILER_START,
+        CHUNK_TRAILER,
 
         DONE_PARSING
     };
@@ -150,6 +188,8 @@ http_rsp_parse(struct http_response_t *http,
                 http->minor = 0;
                 http->is_error = false;
                 http->content_length = 0;
+                http->is_chunked = false;
+                http->chunked_matched = 0;
                 state++;
             }
             break;
@@ -215,6 +255,28 @@ http_rsp_parse(struct http_response_t *http,
                 state2 = 0;
                 state = CONTENT;
                 http->content_seen = 0;
+
+                if (http->response_code >= 100 && http->response_code < 200
+                    && http->response_code != 101) {
+                    /* An interim response (like "100 Continue"), the
+                     * real one follows */
+                    state = 0;
+                    http->is_content_length_seen = false;
+                } else if (http->is_head
+                    || http->response_code == 204 || http->response_code == 304) {
+                    /* These never have any content, whatever
+                     * the header says */
+                    http->is_content_length_seen = true;
+                    http->content_length = 0;
+                    http->is_chunked = false;
+                } else if (http->is_chunked) {
+                    /* Chunked encoding takes priority over any
+                     * Content-Length: field */
+                    state = CHUNK_SIZE;
+                    http->is_content_length_seen = false;
+                    http->content_length = 0;
+                    http->chunk_remaining = 0;
+                }
                 break;
             } else {
                 state2 = 0;
@@ -284,6 +346,10 @@ http_rsp_parse(struct http_response_t *http,
                     state = FIELD_VALUE_END;
                 }
                 break;
+            case HTTPFIELD_TRANSFER_ENCODING:
+                http->chunked_matched = 0;
+                _transfer_encoding(http, px[i]);
+                break;
             }
             break;
         case FIELD_VALUE_CONTENTS:
@@ -300,6 +366,9 @@ http_rsp_parse(struct http_response_t *http,
                     state = FIELD_VALUE_END;
                 }
                 break;
+            case HTTPFIELD_TRANSFER_ENCODING:
+                _transfer_encoding(http, px[i]);
+                break;
             }
             break;
         case FIELD_VALUE_END:
@@ -325,8 +394,84 @@ end_header:
     if (state < CONTENT)
         goto end;
     offset = i;
- 
-    
+
+    /*
+     * Chunked encoding: each chunk is its size in hex (and maybe some
+     * extensions we ignore), the data, and a CRLF. A chunk of size zero
+     * is followed by optional trailer fields, then an empty line.
+     */
+    if (state >= CHUNK_SIZE && state < DONE_PARSING) {
+        for (i = (unsigned)offset; i < length && state != DONE_PARSING; i++) {
+            switch (state) {
+            case CHUNK_SIZE:
+                if (_hexval(px[i]) >= 0) {
+                    if (http->chunk_remaining >> 60) {
+                        /* too big to be real */
+                        http->is_error = true;
+                        state = DONE_PARSING;
+                        break;
+                    }
+                    http->chunk_remaining *= 16;
+                    http->chunk_remaining += _hexval(px[i]);
+                    break;
+                } else if (px[i] == ';' || px[i] == ' ' || px[i] == '\t' || px[i] == '\r') {
+                    state = CHUNK_EXTENSION;
+                    break;
+                } else if (px[i] != '\n') {
+                    http->is_error = true;
+                    state = DONE_PARSING;
+                    break;
+                }
+                /* fall through */
+            case CHUNK_EXTENSION:
+                if (px[i] != '\n')
+                    break;
+                if (http->chunk_remaining == 0)
+                    state = CHUNK_TRAILER_START;
+                else
+                    state = CHUNK_DATA;
+                break;
+            case CHUNK_DATA:
+            {
+                /* Skip over as much of the chunk as we have */
+                size_t n = length - i;
+                if (n > http->chunk_remaining)
+                    n = (size_t)http->chunk_remaining;
+                http->chunk_remaining -= n;
+                http->content_seen += n;
+                i += (unsigned)n - 1;
+                if (http->chunk_remaining == 0)
+                    state = CHUNK_DATA_END;
+                break;
+            }
+            case CHUNK_DATA_END:
+                if (px[i] == '\n')
+                    state = CHUNK_SIZE;
+                else if (px[i] != '\r') {
+                    http->is_error = true;
+                    state = DONE_PARSING;
+                }
+                break;
+            case CHUNK_TRAILER_START:
+                if (px[i] == '\n')
+                    state = DONE_PARSING;
+                else if (px[i] != '\r')
+                    state = CHUNK_TRAILER;
+                break;
+            case CHUNK_TRAILER:
+                if (px[i] == '\n')
+                    state = CHUNK_TRAILER_START;
+                break;
+            }
+        }
+
+        /* Don't consume anything past the end */
+        length = i;
+        if (state == DONE_PARSING)
+            *is_done = true;
+        goto end;
+    }
+
 
     /* Only process to the end of "content", not past the end. */
     if (http->is_content_length_seen && length > offset + http->content_length - http->content_seen)
@@ -419,6 +564,15 @@ static struct {
     {200, 0, true, "HTTP/1.0 200 OK\r\nContent-Length: 0\r\n\r\n"},
     {200, 10, false, "HTTP/1.0 200 OK\r\nContent-Length: 10\r\n\r\nABCD"},
     {200, 10, true, "HTTP/1.0 200 OK\r\nContent-Length: 10\r\n\r\nABCDEFGHIJKLMNOP"},
+    {200, 0, true, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                   "5;name=value\r\nhello\r\n7\r\n world\n\r\n0\r\nX-Trailer: 1\r\n\r\n"},
+    {200, 0, true, "HTTP/1.1 200 OK\r\ntransfer-encoding: gzip, Chunked\r\nContent-Length: 3\r\n\r\n"
+                   "1a\r\nabcdefghijklmnopqrstuvwxyz\r\n0\r\n\r\nHTTP/1.1"},
+    {200, 0, false, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n0\r\n"},
+    {200, 0, false, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n10\r\nhello\r\n0\r\n\r\n"},
+    {204, 0, true, "HTTP/1.1 204 No Content\r\nContent-Length: 10\r\n\r\n"},
+    {304, 0, true, "HTTP/1.1 304 Not Modified\r\nTransfer-Encoding: chunked\r\n\r\n"},
+    {200, 2, true, "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nOK"},
     {0,0,0,0}
 };
 
@@ -441,6 +595,66 @@ http_rsp_selftest(void) {
         }
     }
 
+    /* The same again, but one byte at a time, as the server might
+     * send it, which must give the same results */
+    for (i = 0; rsptests[i].test; i++) {
+        int is_finished = 0;
+        struct http_response_t http = { 0 };
+        const unsigned char *px = (const unsigned char *)rsptests[i].test;
+        size_t length = strlen(rsptests[i].test);
+        size_t j;
+
+        for (j = 0; j < length && !is_finished; j++)
+            http_rsp_parse(&http, px + j, 1, &is_finished);
+
+        if (rsptests[i].response_code != http.response_code
+            || rsptests[i].is_finished != is_finished) {
+            fprintf(stderr, "[-] [%d] HTTP response parsing error (byte-by-byte)\n", i);
+            return 1;
+        }
+    }
+
+    /* A response to HEAD ends with the header, even though it has the
+     * Content-Length: of what a GET would have got */
+    {
+        static const char head[] =
+            "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nHTTP/1.1";
+        int is_finished = 0;
+        struct http_response_t http = { 0 };
+        size_t count;
+
+        http.is_head = true;
+        count = http_rsp_parse(&http, (const unsigned char *)head, sizeof(head) - 1, &is_finished);
+        if (!is_finished || memcmp(head + count, "HTTP/1.1", 8) != 0) {
+            fprintf(stderr, "[-] HTTP response parsing error (HEAD)\n");
+            return 1;
+        }
+    }
+
+    /* Back-to-back responses: the parser must stop at the end of the
+     * first one, leaving the second */
+    {
+        static const char two[] =
+            "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n0\r\n\r\n"
+            "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\nx";
+        int is_finished = 0;
+        struct http_response_t http = { 0 };
+        size_t count;
+
+        count = http_rsp_parse(&http, (const unsigned char *)two, sizeof(two) - 1, &is_finished);
+        if (!is_finished || memcmp(two + count, "HTTP/1.1", 8) != 0) {
+            fprintf(stderr, "[-] HTTP response parsing error (pipelined)\n");
+            return 1;
+        }
+        memset(&http, 0, sizeof(http));
+        is_finished = 0;
+        count += http_rsp_parse(&http, (const unsigned char *)two + count, sizeof(two) - 1 - count, &is_finished);
+        if (!is_finished || count != sizeof(two) - 1) {
+            fprintf(stderr, "[-] HTTP response parsing error (pipelined)\n");
+            return 1;
+        }
+    }
+
     {
         int is_finished = 0;
         struct http_response_t http = { 0 };
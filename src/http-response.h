@@ -10,8 +10,15 @@ typedef struct http_response_t {
     unsigned short response_code;
     unsigned long long content_length;
     unsigned long long content_seen;
+    unsigned long long chunk_remaining;
+    unsigned char chunked_matched;
     bool is_error : 1;
     bool is_content_length_seen : 1;
+    bool is_chunked : 1;
+
+    /* Set by the caller before parsing, when the response is to a
+     * HEAD request, which has no content whatever the header says */
+    bool is_head : 1;
 } http_response_t;
 
 void
@@ -1,9 +1,18 @@
 #include "main-conf.h"
 #include "http-request.h"
+#include "main-requests.h"
+#include "main-replay.h"
+#include "main-template.h"
+#include "main-schedule.h"
+#include "main-findmax.h"
+#include "util-time.h"
+#include "util-rand.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
+#include <math.h>
 
 #ifdef _WIN32
 #include "win-sockets.h"
@@ -158,6 +167,48 @@ _add_sources(main_conf_t* conf, const char* value) {
     return 0;
 }
 
+/*
+ * Parse a list of CPUs like "0,2,4-7"
+ */
+static int
+_add_affinity(main_conf_t *conf, const char *value) {
+    size_t offset = 0;
+
+    while (value[offset]) {
+        char *end;
+        unsigned long first;
+        unsigned long last;
+        unsigned long cpu;
+
+        if (!isdigit(value[offset] & 0xFF))
+            return -1;
+        first = strtoul(value + offset, &end, 0);
+        last = first;
+        offset = end - value;
+        if (value[offset] == '-') {
+            offset++;
+            if (!isdigit(value[offset] & 0xFF))
+                return -1;
+            last = strtoul(value + offset, &end, 0);
+            offset = end - value;
+        }
+        if (last < first || last - first > 65536)
+            return -1;
+
+        for (cpu = first; cpu <= last; cpu++) {
+            conf->affinity_count++;
+            conf->affinity = realloc(conf->affinity, conf->affinity_count * sizeof(*conf->affinity));
+            conf->affinity[conf->affinity_count - 1] = (unsigned)cpu;
+        }
+
+        if (value[offset] == ',')
+            offset++;
+        else if (value[offset] != '\0')
+            return -1;
+    }
+    return 0;
+}
+
 static int
 conf_file(main_conf_t* conf, const char* filename) {
 
@@ -290,7 +341,121 @@ _set_parm(main_conf_t *conf, const char *name, const char *value) {
             fprintf(stderr, "[-] concurrency: bad value: %s\n", value);
             exit(1);
         }
-        return 0;
+        return 1;
+    }
+
+    if (is_equal(name, "threads")) {
+        conf->thread_count = _parse_number(value);
+        if (conf->thread_count < 1) {
+            fprintf(stderr, "[-] threads: bad value: %s\n", value);
+            exit(1);
+        }
+        return 1;
+    }
+
+    if (is_equal(name, "engine")) {
+        if (is_equal(value, "epoll"))
+            conf->engine = ENGINE_EPOLL;
+        else if (is_equal(value, "uring") || is_equal(value, "io_uring"))
+            conf->engine = ENGINE_URING;
+        else {
+            fprintf(stderr, "[-] engine: unknown: %s (expected 'epoll' or 'uring')\n", value);
+            exit(1);
+        }
+        return 1;
+    }
+
+    if (is_equal(name, "prng")) {
+        if (is_equal(value, "chacha20"))
+            conf->prng = UTIL_RAND_CHACHA20;
+        else if (is_equal(value, "xoshiro") || is_equal(value, "xoshiro256"))
+            conf->prng = UTIL_RAND_XOSHIRO256;
+        else {
+            fprintf(stderr, "[-] prng: unknown: %s (expected 'chacha20' or 'xoshiro')\n", value);
+            exit(1);
+        }
+        return 1;
+    }
+
+    if (is_equal(name, "seed")) {
+        char *end = NULL;
+
+        /* Always decimal, as it's written in the manifest, so that
+         * a seed like "010" isn't taken as octal */
+        errno = 0;
+        conf->seed = strtoull(value, &end, 10);
+        if (!isdigit((unsigned char)value[0]) || end == NULL || *end != '\0' || errno == ERANGE) {
+            fprintf(stderr, "[-] seed: bad value: %s (expected a number)\n", value);
+            exit(1);
+        }
+        conf->is_seed = 1;
+        return 1;
+    }
+
+    if (is_equal(name, "affinity")) {
+        err = _add_affinity(conf, value);
+        if (err || conf->affinity_count == 0) {
+            fprintf(stderr, "[-] affinity: bad CPU list: %s\n", value);
+            exit(1);
+        }
+        return 1;
+    }
+
+    if (is_equal(name, "rate")) {
+        char *end = NULL;
+        conf->rate = strtod(value, &end);
+        if (end == value || *end != '\0' || !(conf->rate > 0.0)) {
+            fprintf(stderr, "[-] rate: bad value: %s\n", value);
+            exit(1);
+        }
+        return 1;
+    }
+
+    if (is_equal(name, "connect-rate")) {
+        char *end = NULL;
+        conf->connect_rate = strtod(value, &end);
+        if (end == value || *end != '\0' || !(conf->connect_rate > 0.0)) {
+            fprintf(stderr, "[-] connect-rate: bad value: %s\n", value);
+            exit(1);
+        }
+        return 1;
+    }
+
+    if (is_equal(name, "schedule")) {
+        if (conf->schedule == NULL)
+            conf->schedule = calloc(1, sizeof(*conf->schedule));
+        if (schedule_parse(conf->schedule, value) != 0)
+            exit(1);
+        return 1;
+    }
+
+    if (is_equal(name, "slo")) {
+        if (conf->slo == NULL)
+            conf->slo = calloc(1, sizeof(*conf->slo));
+        if (slo_parse(conf->slo, value) != 0)
+            exit(1);
+        return 1;
+    }
+
+    if (is_equal(name, "probe-time")) {
+        conf->probe_time = util_parse_seconds(value);
+        if (!(conf->probe_time > 0.0)) {
+            fprintf(stderr, "[-] probe-time: bad value: %s\n", value);
+            exit(1);
+        }
+        return 1;
+    }
+
+    if (is_equal(name, "arrival")) {
+        if (is_equal(value, "fixed"))
+            conf->arrival = ARRIVAL_FIXED;
+        else if (is_equal(value, "poisson"))
+            conf->arrival = ARRIVAL_POISSON;
+        else {
+            fprintf(stderr, "[-] arrival: unknown: %s (expected 'fixed' or 'poisson')\n", value);
+            exit(1);
+        }
+        return 1;
     }
 
     if (is_equal(name, "count")) {
@@ -299,7 +464,61 @@ _set_parm(main_conf_t *conf, const char *name, const char *value) {
             fprintf(stderr, "[-] request count: bad value: %s\n", value);
             exit(1);
         }
-        return 0;
+        return 1;
+    }
+
+    if (is_equal(name, "pipeline")) {
+        conf->pipeline = _parse_number(value);
+        if (conf->pipeline < 1 || conf->pipeline > 1024) {
+            fprintf(stderr, "[-] pipeline: bad value: %s (expected 1 to 1024)\n", value);
+            exit(1);
+        }
+        return 1;
+    }
+
+    if (is_equal(name, "duration")) {
+        conf->duration = util_parse_seconds(value);
+        if (conf->duration <= 0.0) {
+            fprintf(stderr, "[-] duration: bad value: %s\n", value);
+            exit(1);
+        }
+        return 1;
+    }
+
+    if (is_equal(name, "connect-timeout")) {
+        conf->timeout_connect = util_parse_seconds(value);
+        if (conf->timeout_connect < 0.0) {
+            fprintf(stderr, "[-] connect-timeout: bad value: %s\n", value);
+            exit(1);
+        }
+        return 1;
+    }
+
+    if (is_equal(name, "first-byte-timeout")) {
+        conf->timeout_first_byte = util_parse_seconds(value);
+        if (conf->timeout_first_byte < 0.0) {
+            fprintf(stderr, "[-] first-byte-timeout: bad value: %s\n", value);
+            exit(1);
+        }
+        return 1;
+    }
+
+    if (is_equal(name, "response-timeout")) {
+        conf->timeout_response = util_parse_seconds(value);
+        if (conf->timeout_response < 0.0) {
+            fprintf(stderr, "[-] response-timeout: bad value: %s\n", value);
+            exit(1);
+        }
+        return 1;
+    }
+
+    if (is_equal(name, "drain")) {
+        conf->drain_timeout = util_parse_seconds(value);
+        if (conf->drain_timeout < 0.0) {
+            fprintf(stderr, "[-] drain: bad value: %s\n", value);
+            exit(1);
+        }
+        return 1;
     }
 
     if (is_equal(name, "targetip")) {
@@ -320,11 +539,108 @@ _set_parm(main_conf_t *conf, const char *name, const char *value) {
         return 1;
     }
 
+    if (is_equal(name, "source-ports")) {
+        char *end = NULL;
+        unsigned long first = strtoul(value, &end, 10);
+        unsigned long last = first;
+
+        if (end && *end == '-')
+            last = strtoul(end + 1, &end, 10);
+        if (end == NULL || *end != '\0' || first < 1 || last > 65535 || first > last) {
+            fprintf(stderr, "[-] source-ports: bad value: %s (expected range like 10000-60000)\n", value);
+            exit(1);
+        }
+        conf->source_port_first = (unsigned)first;
+        conf->source_port_count = (unsigned)(last - first + 1);
+        return 1;
+    }
+
     if (is_equal(name, "shutdown")) {
         conf->is_shutdown = 1;
         return 0;
     }
 
+    if (is_equal(name, "edge")) {
+#ifdef _WIN32
+        fprintf(stderr, "[-] edge: edge-triggered mode not supported on Windows\n");
+        exit(1);
+#endif
+        conf->is_edge_triggered = 1;
+        return 0;
+    }
+
+    if (is_equal(name, "output-json")) {
+        free(conf->output_json);
+        conf->output_json = strdup(value);
+        return 1;
+    }
+
+    if (is_equal(name, "output-csv")) {
+        free(conf->output_csv);
+        conf->output_csv = strdup(value);
+        return 1;
+    }
+
+    if (is_equal(name, "manifest")) {
+        free(conf->manifest);
+        conf->manifest = strdup(value);
+        return 1;
+    }
+
+    if (is_equal(name, "requests")) {
+        free(conf->requests_file);
+        conf->requests_file = strdup(value);
+        return 1;
+    }
+
+    if (is_equal(name, "replay")) {
+        free(conf->replay_file);
+        conf->replay_file = strdup(value);
+        return 1;
+    }
+
+    if (is_equal(name, "replay-speed")) {
+        char *end = NULL;
+
+        if (is_equal(value, "max")) {
+            conf->is_replay_max = 1;
+            return 1;
+        }
+        conf->replay_speed = strtod(value, &end);
+        if (end == value || *end != '\0' || !(conf->replay_speed > 0.0)) {
+            fprintf(stderr, "[-] replay-speed: bad value: %s (expected like 2.5 or max)\n", value);
+            exit(1);
+        }
+        conf->is_replay_max = 0;
+        return 1;
+    }
+
+    if (is_equal(name, "metrics")) {
+        free(conf->metrics);
+        conf->metrics = strdup(value);
+        return 1;
+    }
+
+    if (is_equal(name, "find-max")) {
+        conf->is_find_max = 1;
+        return 0;
+    }
+
+    if (is_equal(name, "new-conn-per-request")) {
+        conf->is_new_conn = 1;
+        return 0;
+    }
+
+    if (is_equal(name, "linger0")) {
+        conf->is_linger0 = 1;
+        return 0;
+    }
+
+    if (is_equal(name, "selftest")) {
+        conf->is_selftest = 1;
+        return 0;
+    }
+
     if (is_equal(name, "conf")) {
         conf_file(conf, value);
         return 1;
@@ -363,6 +679,7 @@ main_conf_read(int argc, char *argv[]) {
 
     conf = calloc(1, sizeof(*conf));
     conf->server_port = 80;
+    conf->drain_timeout = 5.0;
 
     for (i=1; i<argc; i++) {
         const char *parm = argv[i];
@@ -377,7 +694,14 @@ main_conf_read(int argc, char *argv[]) {
             }
         } else switch (parm[1]) {
             case '-':
-                if (i + 1 < argc)
+                if (strchr(parm, '=')) {
+                    /* --name=value */
+                    char *name = strdup(parm+2);
+                    char *value = strchr(name, '=');
+                    *value++ = '\0';
+                    _set_parm(conf, name, value);
+                    free(name);
+                } else if (i + 1 < argc)
                     more = _set_parm(conf, parm+2, argv[i+1]);
                 else
                     more = _set_parm(conf, parm+2, "");
@@ -408,20 +732,136 @@ main_conf_read(int argc, char *argv[]) {
         }
     }
 
+    /* The selftests don't need a URL, or any of the rest */
+    if (conf->is_selftest)
+        return conf;
+
     if (conf->server_name == NULL) {
         fprintf(stderr, "[-] FATAL: no URL was specified\n");
         exit(1);
     }
 
+    /* With --schedule, we need enough connections for its peak (or
+     * the peak rate), and by default, run until it's over */
+    if (conf->schedule) {
+        if (conf->schedule->kind == SCHEDULE_CONNECTIONS) {
+            if (conf->concurrent_connections < (unsigned)ceil(conf->schedule->max))
+                conf->concurrent_connections = (unsigned)ceil(conf->schedule->max);
+        } else if (conf->schedule->max <= 0.0) {
+            fprintf(stderr, "[-] schedule: the rate is never above 0/s\n");
+            exit(1);
+        } else if (conf->rate == 0.0)
+            conf->rate = conf->schedule->max;
+        if (conf->duration == 0.0 && conf->request_count == 0)
+            conf->duration = conf->schedule->duration;
+    }
+
+    /* With --find-max, -c and --rate are the most we'll try, and
+     * we run until the search is over */
+    if (conf->is_find_max) {
+        if (conf->schedule) {
+            fprintf(stderr, "[-] find-max: can't be used with --schedule\n");
+            exit(1);
+        }
+        if (conf->slo == NULL) {
+            fprintf(stderr, "[-] find-max: needs an --slo, like --slo p99<50ms\n");
+            exit(1);
+        }
+        if (conf->probe_time == 0.0)
+            conf->probe_time = 5.0;
+        if (conf->concurrent_connections == 0)
+            conf->concurrent_connections = 1000;
+    }
+
     if (conf->concurrent_connections == 0)
         conf->concurrent_connections = 1;
 
-    if (conf->request_count <= 1)
+    /* Without --seed, one from the clock, which differs from run
+     * to run, but is known, so that the run can be repeated */
+    if (!conf->is_seed) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        conf->seed = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    }
+
+    /* Each worker thread needs at least one connection */
+    if (conf->thread_count == 0)
+        conf->thread_count = 1;
+    if (conf->thread_count > conf->concurrent_connections)
+        conf->thread_count = conf->concurrent_connections;
+
+    /* A replay runs to the end of the log, at the times it gives, or
+     * as fast as we can, rather than at a rate or load of its own */
+    if (conf->replay_file) {
+        if (conf->rate > 0.0 || conf->schedule || conf->is_find_max) {
+            fprintf(stderr, "[-] replay: can't be used with --rate, --schedule, or --find-max\n");
+            exit(1);
+        }
+        if (conf->requests_file || conf->pipeline > 1) {
+            fprintf(stderr, "[-] replay: can't be used with --requests or --pipeline\n");
+            exit(1);
+        }
+        if (conf->replay_speed == 0.0)
+            conf->replay_speed = 1.0;
+    }
+
+    /* Without -n or --duration, just send a few requests */
+    if (conf->request_count == 0 && conf->duration == 0.0 && !conf->is_find_max && !conf->replay_file)
         conf->request_count = 1000;
 
     if (conf->server_port == 0)
         conf->server_port = 80;
 
+    /* With --rate, a connection is only ever sending one request,
+     * as each one is started on its own schedule */
+    if (conf->pipeline == 0)
+        conf->pipeline = 1;
+    if (conf->pipeline > 1 && conf->rate > 0.0) {
+        fprintf(stderr, "[-] pipeline: can't be used with --rate\n");
+        exit(1);
+    }
+    if (conf->pipeline > 1 && conf->is_new_conn) {
+        fprintf(stderr, "[-] pipeline: can't be used with --new-conn-per-request\n");
+        exit(1);
+    }
+
+    /* The {{placeholders}} to fill in for each request, if any */
+    conf->request_template = template_compile(conf->request, conf->request_length);
+    if (conf->request_template && conf->replay_file) {
+        fprintf(stderr, "[-] replay: can't be used with {{placeholders}}\n");
+        exit(1);
+    }
+
+    /* Make the copies of the request to send back-to-back */
+    conf->pipeline_request = malloc(conf->pipeline * conf->request_length);
+    if (conf->pipeline_request == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    for (i=0; i<(int)conf->pipeline; i++)
+        memcpy(conf->pipeline_request + i * conf->request_length, conf->request, conf->request_length);
+
+    /* The other requests, built from this one */
+    if (conf->requests_file)
+        conf->requests = requests_read(conf->requests_file, conf->request, conf->request_length, conf->pipeline);
+
+    /* The room each connection needs to fill in the placeholders */
+    if (conf->request_template)
+        conf->template_max_length = conf->request_template->max_length;
+    for (i=0; conf->requests && i<(int)conf->requests->count; i++) {
+        const template_t *t = conf->requests->entries[i].template;
+        if (t && conf->template_max_length < t->max_length)
+            conf->template_max_length = t->max_length;
+    }
+    if (conf->replay_file)
+        conf->replay = replay_open(conf->replay_file);
+
+    /* Each worker needs at least one source port of its own */
+    if (conf->source_port_count && conf->source_port_count < conf->thread_count) {
+        fprintf(stderr, "[-] source-ports: need at least one port per thread\n");
+        exit(1);
+    }
+
     if (conf->targets_count == 0) {
         /* this is the norm, we do a DNS lookup on the server
          * name. We don't do this if we've been overridden by --targetip
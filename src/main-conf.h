@@ -1,17 +1,103 @@
 #ifndef MAIN_CONF_H
 #define MAIN_CONF_H
 #include <stdio.h>
+#include <stdint.h>
 struct sockaddr_storage;
+struct schedule_t;
+struct slo_t;
+
+/* The event loop used by the workers (--engine) */
+enum {ENGINE_EPOLL, ENGINE_URING};
+
+/* How requests are spaced apart with --rate (--arrival) */
+enum {ARRIVAL_FIXED, ARRIVAL_POISSON};
 
 typedef struct main_conf_t {
     unsigned concurrent_connections; /* -c */
-    unsigned long long request_count; /* -n */
+    unsigned thread_count; /* --threads */
+    unsigned engine; /* --engine */
+
+    /* The random number generator the workers use (--prng), one of
+     * the util_rand_kind_t */
+    unsigned prng;
+
+    /* Where all the workers' random numbers come from (--seed), each
+     * stirring in its own index, so that the same seed gives the same
+     * numbers run after run. Without --seed, it's taken from the clock,
+     * and shown at the end, so that the run can still be repeated. */
+    uint64_t seed;
+    int is_seed;
+
+    /* The list of CPUs that worker threads are pinned to (--affinity),
+     * the first worker to the first CPU, and so on. If there
+     * are more workers than CPUs, we wrap around. */
+    unsigned *affinity;
+    size_t affinity_count;
+    unsigned long long request_count; /* -n, or 0 for no limit */
+
+    /* How long to run (--duration), and how long to wait afterwards
+     * for outstanding responses (--drain), in seconds */
+    double duration;
+    double drain_timeout;
+
+    /* Close connections that take longer than this (seconds) to
+     * connect, to send the first byte of the response, or to finish
+     * the response, or 0 to wait forever */
+    double timeout_connect; /* --connect-timeout */
+    double timeout_first_byte; /* --first-byte-timeout */
+    double timeout_response; /* --response-timeout */
+
+    /* With --rate, requests are sent at a fixed rate (per second,
+     * across all the workers), rather than as soon as the previous
+     * response is received on a connection. */
+    double rate;
+    unsigned arrival; /* --arrival */
+
+    /* The rate (per second, across all the workers) at which new
+     * connections are opened (--connect-rate), or 0 for as fast as
+     * they are needed */
+    double connect_rate;
+
+    /* How the connections or rate change over the run (--schedule),
+     * or NULL if they stay the same */
+    struct schedule_t *schedule;
+
+    /* Search for the highest load that stays within the --slo
+     * (--find-max), running each load for --probe-time seconds */
+    int is_find_max;
+    struct slo_t *slo;
+    double probe_time;
+
     char *server_name;
     char *path;
     unsigned server_port;
     unsigned char *request;
     size_t request_length;
 
+    /* The number of requests outstanding on each connection (--pipeline),
+     * and that many copies of the request back-to-back */
+    unsigned pipeline;
+    unsigned char *pipeline_request;
+
+    /* If the request has {{placeholders}}, filled in anew for each one,
+     * and the most room that any request, including the --requests,
+     * needs once they're filled in */
+    struct template_t *request_template;
+    size_t template_max_length;
+
+    /* The weighted list of requests to choose from (--requests), or
+     * NULL to always send the one above */
+    char *requests_file;
+    struct request_set_t *requests;
+
+    /* The access log to replay (--replay), or NULL, and how fast,
+     * either a multiple of the original speed (--replay-speed), or
+     * as fast as we can (--replay-speed max) */
+    char *replay_file;
+    struct replay_log_t *replay;
+    double replay_speed;
+    int is_replay_max;
+
     /* The list of target IP addresses, often only a single
      * one. */
     struct sockaddr_storage *targets;
@@ -22,7 +108,34 @@ typedef struct main_conf_t {
     struct sockaddr_storage *sources;
     size_t sources_count;
 
+    /* The range of source ports we choose from ourselves (--source-ports),
+     * split between the workers, or 0 to let the system choose */
+    unsigned source_port_first;
+    unsigned source_port_count;
+
+    /* Where to write the statistics for programs to read, or NULL */
+    char *output_json; /* --output-json */
+    char *output_csv; /* --output-csv */
+
+    /* Where to record the seed, options, and build, so that the run
+     * can be repeated (--manifest), or NULL */
+    char *manifest;
+
+    /* The [ADDR:]PORT to serve Prometheus metrics on (--metrics), or NULL */
+    char *metrics;
+
     int is_shutdown;
+    int is_edge_triggered; /* --edge */
+
+    /* Close each connection after a single request, in order to
+     * measure the rate of connections rather than of requests
+     * (--new-conn-per-request), optionally with a reset rather than
+     * a FIN, so that we don't fill up with TIME_WAIT (--linger0) */
+    int is_new_conn;
+    int is_linger0;
+
+    /* Run the selftests that need the network, then exit (--selftest) */
+    int is_selftest;
 } main_conf_t;
 
 main_conf_t *
@@ -0,0 +1,256 @@
+#include "main-findmax.h"
+#include "util-time.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* Rates are close enough when within this fraction of each other */
+#define FINDMAX_RESOLUTION 0.05
+
+/*
+ * Parse one term of the SLO, like "p99<50ms" or "errors<1%"
+ */
+static int
+_slo_term(slo_t *slo, char *term) {
+    char *limit = strchr(term, '<');
+    char *end = NULL;
+
+    if (limit == NULL)
+        return -1;
+    *limit++ = '\0';
+
+    if (strcmp(term, "errors") == 0) {
+        slo->error_rate = strtod(limit, &end) / 100.0;
+        if (end == limit || !(strcmp(end, "%") == 0 || *end == '\0') || slo->error_rate < 0.0)
+            return -1;
+        return 0;
+    }
+
+    if (term[0] == 'p' && slo->count < SLO_MAX) {
+        double percentile = strtod(term + 1, &end);
+        double seconds = util_parse_seconds(limit);
+
+        if (end == term + 1 || *end != '\0' || !(percentile > 0.0 && percentile <= 100.0))
+            return -1;
+        if (!(seconds > 0.0))
+            return -1;
+        slo->percentiles[slo->count] = percentile;
+        slo->limits[slo->count] = (uint64_t)(seconds * 1000000000.0);
+        slo->count++;
+        return 0;
+    }
+    return -1;
+}
+
+int
+slo_parse(slo_t *slo, const char *spec) {
+    char *copy = strdup(spec);
+    char *term = copy;
+
+    memset(slo, 0, sizeof(*slo));
+    slo->error_rate = 0.01;
+
+    while (term && *term) {
+        char *next = strchr(term, ',');
+
+        if (next)
+            *next++ = '\0';
+        if (_slo_term(slo, term) != 0) {
+            fprintf(stderr, "[-] slo: bad value: %s (expected like p99<50ms or errors<1%%)\n", term);
+            free(copy);
+            return -1;
+        }
+        term = next;
+    }
+
+    free(copy);
+    return 0;
+}
+
+int
+slo_check(const slo_t *slo, const statistics_t *stats, char *why, size_t sizeof_why) {
+    uint64_t failures = 0;
+    size_t i;
+
+    /* Everything that didn't get a response */
+    for (i = 0; i < STATS_ERRNO_MAX; i++)
+        failures += stats->errors[i].total;
+    failures += stats->con.timeout_connect.total;
+    failures += stats->con.timeout_first_byte.total;
+    failures += stats->con.timeout_response.total;
+
+    if (stats->http.recved.total == 0) {
+        snprintf(why, sizeof_why, "no responses");
+        return 0;
+    }
+    if (failures > slo->error_rate * (double)(stats->http.recved.total + failures)) {
+        snprintf(why, sizeof_why, "errors %.2f%%",
+            100.0 * failures / (double)(stats->http.recved.total + failures));
+        return 0;
+    }
+
+    /* A server that's shedding load with fast 503s isn't keeping up,
+     * however good its response times look */
+    failures = stats->http.n500.total + stats->http.nother.total;
+    if (failures > slo->error_rate * (double)stats->http.recved.total) {
+        snprintf(why, sizeof_why, "5xx %.2f%%",
+            100.0 * failures / (double)stats->http.recved.total);
+        return 0;
+    }
+
+    for (i = 0; i < slo->count; i++) {
+        uint64_t latency = util_hdr_percentile(&stats->latency.response, slo->percentiles[i]);
+        if (latency >= slo->limits[i]) {
+            snprintf(why, sizeof_why, "p%g %.3fms", slo->percentiles[i], latency / 1000000.0);
+            return 0;
+        }
+    }
+
+    snprintf(why, sizeof_why, "ok");
+    return 1;
+}
+
+double
+findmax_init(findmax_t *search, double ceiling, int is_integer) {
+    memset(search, 0, sizeof(*search));
+    search->ceiling = ceiling;
+    search->is_integer = is_integer;
+
+    search->current = ceiling / 64.0;
+    if (is_integer) {
+        search->current = floor(search->current);
+        if (search->current < 1.0)
+            search->current = 1.0;
+    }
+    return search->current;
+}
+
+/*
+ * Whether the last good and first bad loads are close enough that
+ * there's no point in searching between them
+ */
+static int
+_findmax_is_close(const findmax_t *search) {
+    if (search->is_integer)
+        return search->bad - search->good <= 1.0;
+    if (search->bad <= search->ceiling / 1024.0)
+        return 1;
+    return search->bad - search->good <= search->bad * FINDMAX_RESOLUTION;
+}
+
+double
+findmax_next(findmax_t *search, int is_passed) {
+    double next;
+
+    if (search->is_done)
+        return 0.0;
+    search->probes++;
+    if (is_passed)
+        search->good = search->current;
+    else
+        search->bad = search->current;
+
+    if (search->bad == 0.0) {
+        /* Still going up, until we hit the ceiling */
+        if (search->current >= search->ceiling)
+            search->is_done = 1;
+        next = search->current * 2.0;
+        if (next > search->ceiling)
+            next = search->ceiling;
+    } else {
+        /* Then bisecting */
+        if (_findmax_is_close(search))
+            search->is_done = 1;
+        next = (search->good + search->bad) / 2.0;
+        if (search->is_integer)
+            next = floor(next);
+    }
+
+    if (search->probes >= FINDMAX_MAX_PROBES)
+        search->is_done = 1;
+    if (search->is_done)
+        return 0.0;
+    search->current = next;
+    return next;
+}
+
+/*
+ * Search against a pretend server that can handle up to 'limit'
+ */
+static double
+_findmax_simulate(double ceiling, int is_integer, double limit, unsigned *r_probes) {
+    findmax_t search;
+    double value = findmax_init(&search, ceiling, is_integer);
+
+    while (value > 0.0)
+        value = findmax_next(&search, value <= limit);
+    *r_probes = search.probes;
+    return search.good;
+}
+
+int
+findmax_selftest(void) {
+    static statistics_t stats;
+    unsigned probes;
+    double found;
+    slo_t slo;
+    char why[64];
+    unsigned i;
+
+    /* Connections: 1000 max, 37 is the most that passes */
+    found = _findmax_simulate(1000.0, 1, 37.0, &probes);
+    if (found != 37.0 || probes > 12)
+        goto fail;
+
+    /* Everything passes, so we stop at the ceiling */
+    found = _findmax_simulate(1000.0, 1, 5000.0, &probes);
+    if (found != 1000.0)
+        goto fail;
+
+    /* Nothing passes */
+    found = _findmax_simulate(1000.0, 1, 0.0, &probes);
+    if (found != 0.0)
+        goto fail;
+
+    /* Rates, to within the resolution */
+    found = _findmax_simulate(100000.0, 0, 12345.0, &probes);
+    if (found > 12345.0 || found < 12345.0 * (1.0 - FINDMAX_RESOLUTION))
+        goto fail;
+
+    /* The SLO */
+    if (slo_parse(&slo, "p99<50ms,p50<10ms,errors<0.5%") != 0)
+        goto fail;
+    if (slo.count != 2 || slo.limits[0] != 50000000 || fabs(slo.error_rate - 0.005) > 1e-12)
+        goto fail;
+
+    memset(&stats, 0, sizeof(stats));
+    for (i = 0; i < 1000; i++)
+        util_hdr_record(&stats.latency.response, (i < 995) ? 1000000 : 60000000);
+    stats.http.recved.total = 1000;
+    if (slo_check(&slo, &stats, why, sizeof(why)) != 1)
+        goto fail;
+
+    /* 1.1% of them too slow breaks the p99 */
+    for (i = 0; i < 6; i++)
+        util_hdr_record(&stats.latency.response, 60000000);
+    if (slo_check(&slo, &stats, why, sizeof(why)) != 0 || why[0] != 'p')
+        goto fail;
+
+    /* Too many 5xx responses, however fast */
+    slo.count = 0;
+    stats.http.n500.total = 6;
+    if (slo_check(&slo, &stats, why, sizeof(why)) != 0 || why[0] != '5')
+        goto fail;
+    stats.http.n500.total = 0;
+
+    /* Too many errors */
+    stats.errors[104].total = 6;
+    if (slo_check(&slo, &stats, why, sizeof(why)) != 0 || why[0] != 'e')
+        goto fail;
+
+    return 0;
+fail:
+    fprintf(stderr, "[-] findmax: programming error\n");
+    return 1;
+}
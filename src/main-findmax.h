@@ -0,0 +1,89 @@
+/*
+    Saturation search
+
+ With --find-max, rather than running at a fixed load, we search for
+ the highest load that stays within a latency SLO (--slo), such as:
+
+    --find-max --slo p99<50ms
+    --find-max --slo p50<5ms,p99.9<200ms,errors<0.1%
+
+ The load is the number of connections, up to -c, or with --rate,
+ the request rate, up to --rate. Each probe runs at one load for
+ --probe-time, of which the first fifth is ignored while things settle.
+ The load doubles until a probe breaks the SLO, and then we bisect
+ between the last good and the first bad, until they are close.
+
+ The SLO and the search are here, while the main thread runs the
+ probes and reports the results.
+ */
+#ifndef MAIN_FINDMAX_H
+#define MAIN_FINDMAX_H
+#include "main-stats.h"
+#include <stddef.h>
+
+#define SLO_MAX 8
+
+/* Give up searching after this many probes */
+#define FINDMAX_MAX_PROBES 30
+
+typedef struct slo_t {
+    /* The response time percentiles, and their limits (nanoseconds) */
+    double percentiles[SLO_MAX];
+    uint64_t limits[SLO_MAX];
+    size_t count;
+
+    /* The fraction of requests that can fail (socket errors and
+     * timeouts), 1% unless set, and separately, the fraction of
+     * responses that can be 5xx */
+    double error_rate;
+} slo_t;
+
+typedef struct findmax_t {
+    /* The highest load we'll try */
+    double ceiling;
+
+    /* Connections are whole numbers, rates aren't */
+    int is_integer;
+
+    /* The highest load that passed (or 0), the lowest that failed
+     * (or 0 if none yet), and the one we're trying now */
+    double good;
+    double bad;
+    double current;
+
+    unsigned probes;
+    int is_done;
+} findmax_t;
+
+/**
+ * Parse an SLO such as "p99<50ms,errors<1%".
+ * @return
+ *      0 on success, or -1 if it's not valid, after printing why.
+ */
+int
+slo_parse(slo_t *slo, const char *spec);
+
+/**
+ * Whether the statistics from one probe are within the SLO. If not,
+ * 'why' says which part of it broke.
+ */
+int
+slo_check(const slo_t *slo, const statistics_t *stats, char *why, size_t sizeof_why);
+
+/**
+ * Start the search, returning the first load to try.
+ */
+double
+findmax_init(findmax_t *search, double ceiling, int is_integer);
+
+/**
+ * Report whether the current load passed, returning the next load to
+ * try, or 0 once the search is done.
+ */
+double
+findmax_next(findmax_t *search, int is_passed);
+
+int
+findmax_selftest(void);
+
+#endif
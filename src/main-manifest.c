@@ -0,0 +1,333 @@
+#include "main-manifest.h"
+#include "main-conf.h"
+#include "util-rand.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include "win-sockets.h"
+#else
+#include <unistd.h>
+#include "unix-sockets.h"
+#endif
+
+#if defined(_WIN32)
+#define MANIFEST_OS "windows"
+#elif defined(__APPLE__)
+#define MANIFEST_OS "macos"
+#elif defined(__linux__)
+#define MANIFEST_OS "linux"
+#elif defined(__FreeBSD__)
+#define MANIFEST_OS "freebsd"
+#else
+#define MANIFEST_OS "unix"
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define MANIFEST_ARCH "x86_64"
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define MANIFEST_ARCH "arm64"
+#elif defined(__i386__) || defined(_M_IX86)
+#define MANIFEST_ARCH "x86"
+#else
+#define MANIFEST_ARCH "unknown"
+#endif
+
+static int
+get_addr_length(const struct sockaddr *target) {
+    switch (target->sa_family) {
+    case PF_INET:
+        return sizeof(struct sockaddr_in);
+    case PF_INET6:
+        return sizeof(struct sockaddr_in6);
+    default:
+        return 0;
+    }
+}
+
+static void
+_json_string(FILE *fp, const char *str) {
+    fputc('"', fp);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fprintf(fp, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(fp, "\\u%04x", (unsigned char)*str);
+        else
+            fputc(*str, fp);
+    }
+    fputc('"', fp);
+}
+
+/*
+ * Quote an argument for the shell, only if it needs it, into 'dst',
+ * or if that's NULL, just count the length
+ */
+static size_t
+_shell_quote(char *dst, const char *arg) {
+    size_t length = 0;
+    const char *p;
+
+    for (p = arg; *p; p++) {
+        if (!isalnum((unsigned char)*p) && strchr("%+,-./:=@_", *p) == NULL)
+            break;
+    }
+    if (*arg && *p == '\0') {
+        length = strlen(arg);
+        if (dst)
+            memcpy(dst, arg, length);
+        return length;
+    }
+
+    /* In single quotes, everything is literal, except for the single
+     * quote itself, which has to end the quotes, and be escaped */
+    if (dst)
+        dst[length] = '\'';
+    length++;
+    for (p = arg; *p; p++) {
+        if (*p == '\'') {
+            if (dst)
+                memcpy(dst + length, "'\\''", 4);
+            length += 4;
+        } else {
+            if (dst)
+                dst[length] = *p;
+            length++;
+        }
+    }
+    if (dst)
+        dst[length] = '\'';
+    length++;
+    return length;
+}
+
+/*
+ * The command-line, quoted for the shell, with the --seed added if
+ * it wasn't given, so that it's the same run again
+ */
+static char *
+_replay_command(const main_conf_t *conf, int argc, char *argv[]) {
+    char seed[64];
+    size_t length = 0;
+    char *result;
+    int i;
+
+    snprintf(seed, sizeof(seed), " --seed %llu", (unsigned long long)conf->seed);
+    for (i = 0; i < argc; i++)
+        length += _shell_quote(NULL, argv[i]) + 1;
+    length += strlen(seed) + 1;
+
+    result = malloc(length);
+    if (result == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    length = 0;
+    for (i = 0; i < argc; i++) {
+        if (i)
+            result[length++] = ' ';
+        length += _shell_quote(result + length, argv[i]);
+    }
+    result[length] = '\0';
+    if (!conf->is_seed)
+        strcat(result, seed);
+    return result;
+}
+
+static void
+_compiler(char *buf, size_t buf_size) {
+#if defined(__clang__)
+    snprintf(buf, buf_size, "clang %s", __clang_version__);
+#elif defined(__GNUC__)
+    snprintf(buf, buf_size, "gcc %s", __VERSION__);
+#elif defined(_MSC_VER)
+    snprintf(buf, buf_size, "msvc %d", _MSC_VER);
+#else
+    snprintf(buf, buf_size, "unknown");
+#endif
+}
+
+static void
+_json_addresses(FILE *fp, const struct sockaddr_storage *addrs, size_t count) {
+    size_t i;
+
+    fprintf(fp, "[");
+    for (i = 0; i < count; i++) {
+        const struct sockaddr *addr = (const struct sockaddr *)&addrs[i];
+        char hostname[64];
+        char portname[16];
+        int err;
+
+        err = getnameinfo(addr, get_addr_length(addr),
+            hostname, sizeof(hostname),
+            portname, sizeof(portname),
+            NI_NUMERICHOST | NI_NUMERICSERV);
+        if (err)
+            snprintf(hostname, sizeof(hostname), "?");
+        fprintf(fp, "%s", i ? ", " : "");
+        _json_string(fp, hostname);
+    }
+    fprintf(fp, "]");
+}
+
+void
+manifest_write(const main_conf_t *conf, int argc, char *argv[]) {
+    FILE *fp;
+    char buf[256];
+    char *replay;
+    time_t now;
+    int i;
+
+    if (conf->manifest == NULL)
+        return;
+
+    fp = fopen(conf->manifest, "wt");
+    if (fp == NULL) {
+        fprintf(stderr, "[-] manifest: %s: %s\n", conf->manifest, strerror(errno));
+        exit(1);
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"nxbench\": \"%s\",\n", NXBENCH_VERSION);
+    now = time(0);
+    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    fprintf(fp, "  \"started\": \"%s\",\n", buf);
+
+    /* What to repeat it with */
+    fprintf(fp, "  \"seed\": \"%llu\",\n", (unsigned long long)conf->seed);
+    fprintf(fp, "  \"prng\": ");
+    _json_string(fp, util_rand_name((enum util_rand_kind_t)conf->prng));
+    fprintf(fp, ",\n");
+    fprintf(fp, "  \"command\": [");
+    for (i = 0; i < argc; i++) {
+        fprintf(fp, "%s", i ? ", " : "");
+        _json_string(fp, argv[i]);
+    }
+    fprintf(fp, "],\n");
+    replay = _replay_command(conf, argc, argv);
+    fprintf(fp, "  \"replay\": ");
+    _json_string(fp, replay);
+    fprintf(fp, ",\n");
+    free(replay);
+
+    /* The options, with the defaults filled in */
+    fprintf(fp, "  \"config\": {\n");
+    fprintf(fp, "    \"server\": ");
+    _json_string(fp, conf->server_name);
+    fprintf(fp, ",\n    \"port\": %u,\n", conf->server_port);
+    fprintf(fp, "    \"path\": ");
+    _json_string(fp, conf->path ? conf->path : "/");
+    fprintf(fp, ",\n    \"targets\": ");
+    _json_addresses(fp, conf->targets, conf->targets_count);
+    fprintf(fp, ",\n    \"sources\": ");
+    _json_addresses(fp, conf->sources, conf->sources_count);
+    fprintf(fp, ",\n");
+    if (conf->source_port_count)
+        fprintf(fp, "    \"source_ports\": \"%u-%u\",\n", conf->source_port_first,
+            conf->source_port_first + conf->source_port_count - 1);
+    fprintf(fp, "    \"connections\": %u,\n", conf->concurrent_connections);
+    fprintf(fp, "    \"threads\": %u,\n", conf->thread_count);
+    fprintf(fp, "    \"engine\": \"%s\",\n", (conf->engine == ENGINE_URING) ? "uring" : "epoll");
+    fprintf(fp, "    \"count\": %llu,\n", conf->request_count);
+    fprintf(fp, "    \"duration\": %.15g,\n", conf->duration);
+    fprintf(fp, "    \"drain\": %.15g,\n", conf->drain_timeout);
+    fprintf(fp, "    \"connect_timeout\": %.15g,\n", conf->timeout_connect);
+    fprintf(fp, "    \"first_byte_timeout\": %.15g,\n", conf->timeout_first_byte);
+    fprintf(fp, "    \"response_timeout\": %.15g,\n", conf->timeout_response);
+    fprintf(fp, "    \"rate\": %.15g,\n", conf->rate);
+    fprintf(fp, "    \"arrival\": \"%s\",\n", (conf->arrival == ARRIVAL_POISSON) ? "poisson" : "fixed");
+    fprintf(fp, "    \"connect_rate\": %.15g,\n", conf->connect_rate);
+    fprintf(fp, "    \"pipeline\": %u,\n", conf->pipeline);
+    fprintf(fp, "    \"schedule\": %s,\n", conf->schedule ? "true" : "false");
+    fprintf(fp, "    \"find_max\": %s,\n", conf->is_find_max ? "true" : "false");
+    fprintf(fp, "    \"new_conn_per_request\": %s,\n", conf->is_new_conn ? "true" : "false");
+    fprintf(fp, "    \"linger0\": %s,\n", conf->is_linger0 ? "true" : "false");
+    fprintf(fp, "    \"edge\": %s,\n", conf->is_edge_triggered ? "true" : "false");
+    if (conf->requests_file) {
+        fprintf(fp, "    \"requests\": ");
+        _json_string(fp, conf->requests_file);
+        fprintf(fp, ",\n");
+    }
+    if (conf->replay_file) {
+        fprintf(fp, "    \"replay\": ");
+        _json_string(fp, conf->replay_file);
+        if (conf->is_replay_max)
+            fprintf(fp, ",\n    \"replay_speed\": \"max\",\n");
+        else
+            fprintf(fp, ",\n    \"replay_speed\": %.15g,\n", conf->replay_speed);
+    }
+    fprintf(fp, "    \"request\": ");
+    {
+        char *request = malloc(conf->request_length + 1);
+        if (request == NULL) {
+            fprintf(stderr, "[-] FATAL: out of memory\n");
+            exit(1);
+        }
+        memcpy(request, conf->request, conf->request_length);
+        request[conf->request_length] = '\0';
+        _json_string(fp, request);
+        free(request);
+    }
+    fprintf(fp, "\n  },\n");
+
+    /* Which build, on which machine */
+    fprintf(fp, "  \"build\": {\n");
+    _compiler(buf, sizeof(buf));
+    fprintf(fp, "    \"compiler\": ");
+    _json_string(fp, buf);
+    fprintf(fp, ",\n    \"version\": ");
+    _json_string(fp, NXBENCH_BUILD);
+    fprintf(fp, ",\n");
+    fprintf(fp, "    \"os\": \"%s\",\n", MANIFEST_OS);
+    fprintf(fp, "    \"arch\": \"%s\",\n", MANIFEST_ARCH);
+    fprintf(fp, "    \"chacha20\": \"%s\"\n", util_rand_name(UTIL_RAND_CHACHA20));
+    fprintf(fp, "  },\n");
+    if (gethostname(buf, sizeof(buf)) != 0)
+        snprintf(buf, sizeof(buf), "?");
+    buf[sizeof(buf) - 1] = '\0';
+    fprintf(fp, "  \"host\": ");
+    _json_string(fp, buf);
+    fprintf(fp, "\n}\n");
+
+    if (ferror(fp) | fclose(fp)) {
+        fprintf(stderr, "[-] manifest: %s: %s\n", conf->manifest, strerror(errno));
+        exit(1);
+    }
+}
+
+int
+manifest_selftest(void) {
+    static const struct {
+        const char *arg;
+        const char *quoted;
+    } tests[] = {
+        {"--seed", "--seed"},
+        {"http://example.com/a?b=c", "'http://example.com/a?b=c'"},
+        {"a b", "'a b'"},
+        {"it's", "'it'\\''s'"},
+        {"", "''"},
+        {"{{zipf:100}}", "'{{zipf:100}}'"},
+        {0, 0}
+    };
+    char buf[64];
+    size_t i;
+
+    for (i = 0; tests[i].arg; i++) {
+        size_t length = _shell_quote(NULL, tests[i].arg);
+        if (length != strlen(tests[i].quoted) || length >= sizeof(buf))
+            goto fail;
+        if (_shell_quote(buf, tests[i].arg) != length)
+            goto fail;
+        buf[length] = '\0';
+        if (strcmp(buf, tests[i].quoted) != 0)
+            goto fail;
+    }
+    return 0;
+fail:
+    fprintf(stderr, "[-] manifest: programming error\n");
+    return 1;
+}
@@ -0,0 +1,55 @@
+/*
+    Run manifest
+
+ With --manifest FILE, before the run starts, we write down what's
+ needed to repeat it: the seed the workers' random numbers came
+ from, the command-line, the options as they were worked out (the
+ defaults, and the addresses the name resolved to), and which build
+ of nxbench on which machine. It's one JSON object, such as:
+
+    {
+      "nxbench": "0.1",
+      "seed": "1760689812123456789",
+      "replay": "nxbench 'http://10.0.0.1/item/{{zipf:1000}}' -c 100 --seed 1760689812123456789",
+      ...
+    }
+
+ The seed is a string, because a 64-bit number doesn't fit in the
+ doubles that many JSON readers use. "replay" is the command-line
+ again, with the --seed added if it wasn't given, ready to paste into
+ a shell.
+
+ The same seed gives each worker the same random numbers, so the
+ same URLs, {{placeholders}}, --requests, and Poisson gaps, in the
+ same order. What it can't repeat is the timing: which connection
+ is ready first, and so which request goes out on which connection
+ when, is up to the network and the server.
+ */
+#ifndef MAIN_MANIFEST_H
+#define MAIN_MANIFEST_H
+struct main_conf_t;
+
+#define NXBENCH_VERSION "0.1"
+
+/* Which source the binary was built from, such as from `git describe`,
+ * passed in when building with:
+ *
+ *    -DNXBENCH_BUILD="\"$(git describe --always --dirty)\""
+ *
+ * or just the version. Unlike __DATE__, it's the same each time the
+ * same source is built, so the build can be reproduced */
+#ifndef NXBENCH_BUILD
+#define NXBENCH_BUILD NXBENCH_VERSION
+#endif
+
+/**
+ * Write the manifest, if --manifest was given. It's fatal if it
+ * can't be written.
+ */
+void
+manifest_write(const struct main_conf_t *conf, int argc, char *argv[]);
+
+int
+manifest_selftest(void);
+
+#endif
@@ -0,0 +1,340 @@
+#include "main-metrics.h"
+#include "main-conf.h"
+#include "main-worker.h"
+#include "main-stats.h"
+#include "util-thread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#ifdef _WIN32
+#include "win-sockets.h"
+#else
+#include <unistd.h>
+#include "unix-sockets.h"
+#endif
+
+/* The most we'll read of a scrape's request, which only needs to be
+ * enough for the request line */
+#define METRICS_REQUEST_SIZE 2048
+
+/* How long a scraper gets to send its request (seconds) */
+#define METRICS_TIMEOUT 2
+
+/* The upper bounds (seconds) of the histogram buckets we export. The
+ * underlying histograms are far finer than this, but Prometheus stores
+ * a time series per bucket, so we keep it to a sensible few. */
+static const double metrics_buckets[] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+    0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0};
+
+typedef struct metrics_t {
+    socket_t fd;
+    running_t **workers;
+    size_t count;
+
+    /* The workers' statistics summed at each scrape */
+    statistics_t *stats;
+
+    /* The response being built */
+    char *buf;
+    size_t length;
+    size_t max;
+} metrics_t;
+
+static void
+_metrics_printf(metrics_t *m, const char *fmt, ...) {
+    va_list ap;
+    int len;
+
+    for (;;) {
+        va_start(ap, fmt);
+        len = vsnprintf(m->buf + m->length, m->max - m->length, fmt, ap);
+        va_end(ap);
+        if (len < 0)
+            return;
+        if (m->length + len < m->max)
+            break;
+        m->max = (m->max + len) * 2;
+        m->buf = realloc(m->buf, m->max);
+        if (m->buf == NULL) {
+            fprintf(stderr, "[-] FATAL: out of memory\n");
+            exit(1);
+        }
+    }
+    m->length += len;
+}
+
+/*
+ * A label value, with the quotes, backslashes, and newlines escaped
+ */
+static void
+_metrics_label(metrics_t *m, const char *str) {
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            _metrics_printf(m, "\\%c", *str);
+        else if (*str == '\n')
+            _metrics_printf(m, "\\n");
+        else
+            _metrics_printf(m, "%c", *str);
+    }
+}
+
+/*
+ * One histogram, as cumulative buckets, where 'label' is like
+ * `phase="connect"`. The count is taken from the buckets themselves
+ * rather than `hdr->count`, since a worker may be in the middle of
+ * recording while we read them, and the +Inf bucket must agree with
+ * the count.
+ */
+static void
+_metrics_hdr(metrics_t *m, const char *name, const char *label, const util_hdr_t *hdr) {
+    uint64_t count = util_hdr_count_below(hdr, ~0ULL);
+    size_t i;
+
+    for (i = 0; i < sizeof(metrics_buckets)/sizeof(metrics_buckets[0]); i++) {
+        uint64_t le = (uint64_t)(metrics_buckets[i] * 1000000000.0 + 0.5);
+        _metrics_printf(m, "%s_bucket{%s,le=\"%g\"} %llu\n",
+            name, label, metrics_buckets[i], (unsigned long long)util_hdr_count_below(hdr, le));
+    }
+    _metrics_printf(m, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, label, (unsigned long long)count);
+    _metrics_printf(m, "%s_sum{%s} %.9f\n", name, label, hdr->total / 1000000000.0);
+    _metrics_printf(m, "%s_count{%s} %llu\n", name, label, (unsigned long long)count);
+}
+
+/*
+ * Build the body of the response: a snapshot of everything so far
+ */
+static void
+_metrics_body(metrics_t *m) {
+    statistics_t *stats = m->stats;
+    const counter_t *c;
+    const char *name;
+    size_t concurrency = 0;
+    size_t i;
+
+    stats_clear(stats);
+    for (i = 0; i < m->count; i++) {
+        stats_add(stats, &m->workers[i]->stats);
+        concurrency += m->workers[i]->concurrency;
+    }
+
+    /* The counters, named after those in the JSON output, with the
+     * dots changed to underscores */
+    for (i = 0; (name = stats_counter_name(stats, i, &c)) != NULL; i++) {
+        char metric[64];
+        char *p;
+
+        snprintf(metric, sizeof(metric), "nxbench_%s_total", name);
+        for (p = metric; *p; p++) {
+            if (*p == '.')
+                *p = '_';
+        }
+        _metrics_printf(m, "# TYPE %s counter\n", metric);
+        _metrics_printf(m, "%s %llu\n", metric, (unsigned long long)c->total);
+    }
+
+    _metrics_printf(m, "# TYPE nxbench_socket_errors_total counter\n");
+    for (i = 0; i < STATS_ERRNO_MAX; i++) {
+        int error = stats_errno_value((unsigned)i);
+
+        if (stats->errors[i].total == 0)
+            continue;
+        _metrics_printf(m, "nxbench_socket_errors_total{errno=\"%d\",error=\"", error);
+        _metrics_label(m, sock_strerror(error));
+        _metrics_printf(m, "\"} %llu\n", (unsigned long long)stats->errors[i].total);
+    }
+
+    _metrics_printf(m, "# TYPE nxbench_http_status_total counter\n");
+    for (i = 0; i < STATS_STATUS_MAX; i++) {
+        if (stats->status[i].total == 0)
+            continue;
+        if (i == 0)
+            _metrics_printf(m, "nxbench_http_status_total{code=\"other\"}");
+        else
+            _metrics_printf(m, "nxbench_http_status_total{code=\"%u\"}", (unsigned)i);
+        _metrics_printf(m, " %llu\n", (unsigned long long)stats->status[i].total);
+    }
+
+    _metrics_printf(m, "# TYPE nxbench_concurrency gauge\n");
+    _metrics_printf(m, "nxbench_concurrency %llu\n", (unsigned long long)concurrency);
+
+    _metrics_printf(m, "# TYPE nxbench_latency_seconds histogram\n");
+    _metrics_hdr(m, "nxbench_latency_seconds", "phase=\"connect\"", &stats->latency.connect);
+    _metrics_hdr(m, "nxbench_latency_seconds", "phase=\"first_byte\"", &stats->latency.first_byte);
+    _metrics_hdr(m, "nxbench_latency_seconds", "phase=\"response\"", &stats->latency.response);
+
+    _metrics_printf(m, "# TYPE nxbench_status_latency_seconds histogram\n");
+    for (i = 0; i < STATS_CLASS_MAX; i++) {
+        char label[32];
+
+        snprintf(label, sizeof(label), "class=\"%s\"", stats_class_name((unsigned)i));
+        _metrics_hdr(m, "nxbench_status_latency_seconds", label, &stats->latency.classes[i]);
+    }
+}
+
+static void
+_metrics_send(socket_t fd, const char *buf, size_t length) {
+    while (length) {
+        int count = send(fd, buf, (int)length, MSG_NOSIGNAL);
+        if (count <= 0)
+            return;
+        buf += count;
+        length -= count;
+    }
+}
+
+/*
+ * Answer a single scrape, then close the connection
+ */
+static void
+_metrics_serve(metrics_t *m, socket_t fd) {
+    char request[METRICS_REQUEST_SIZE];
+    size_t length = 0;
+    char header[256];
+    int header_length;
+    int is_found;
+
+#ifdef _WIN32
+    {
+        DWORD timeout = METRICS_TIMEOUT * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+    }
+#else
+    {
+        struct timeval timeout = {METRICS_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+    }
+#endif
+
+    /* We only need the request line, but wait for the whole header,
+     * so that the scraper doesn't see a reset for unread data */
+    while (length < sizeof(request) - 1) {
+        int count = recv(fd, request + length, (int)(sizeof(request) - 1 - length), 0);
+        if (count <= 0)
+            break;
+        length += count;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+    request[length] = '\0';
+
+    is_found = strncmp(request, "GET /metrics ", 13) == 0
+        || strncmp(request, "GET /metrics?", 13) == 0
+        || strncmp(request, "GET / ", 6) == 0;
+
+    m->length = 0;
+    if (is_found)
+        _metrics_body(m);
+    else
+        _metrics_printf(m, "Not found\n");
+
+    header_length = snprintf(header, sizeof(header),
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: %llu\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        is_found ? "200 OK" : "404 Not Found",
+        (unsigned long long)m->length);
+    _metrics_send(fd, header, header_length);
+    _metrics_send(fd, m->buf, m->length);
+    closesocket(fd);
+}
+
+static void
+_metrics_thread(void *v) {
+    metrics_t *m = (metrics_t *)v;
+
+    for (;;) {
+        socket_t fd = accept(m->fd, NULL, NULL);
+
+        if (fd == (socket_t)-1) {
+            util_thread_sleep_ms(10);
+            continue;
+        }
+        _metrics_serve(m, fd);
+    }
+}
+
+/*
+ * Parse "[ADDR:]PORT", with IPv6 addresses in brackets, then
+ * create the listening socket.
+ */
+static socket_t
+_metrics_listen(const char *spec) {
+    char *copy = strdup(spec);
+    char *host = "127.0.0.1";
+    char *port = copy;
+    char *colon = strrchr(copy, ':');
+    struct addrinfo hints;
+    struct addrinfo *ai = NULL;
+    socket_t fd = (socket_t)-1;
+    int yes = 1;
+    int err;
+
+    if (colon) {
+        *colon = '\0';
+        host = copy;
+        port = colon + 1;
+        if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+            host[strlen(host) - 1] = '\0';
+            host++;
+        }
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    err = getaddrinfo(host, port, &hints, &ai);
+    if (err) {
+        fprintf(stderr, "[-] metrics: %s: %s\n", spec, gai_strerror(err));
+        exit(1);
+    }
+
+    fd = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (fd == (socket_t)-1) {
+        fprintf(stderr, "[-] metrics: socket(): %s\n", sock_strerror(sockerrno));
+        exit(1);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&yes, sizeof(yes));
+    if (bind(fd, ai->ai_addr, (int)ai->ai_addrlen) != 0 || listen(fd, 16) != 0) {
+        fprintf(stderr, "[-] metrics: %s: %s\n", spec, sock_strerror(sockerrno));
+        exit(1);
+    }
+
+    freeaddrinfo(ai);
+    free(copy);
+    return fd;
+}
+
+void
+metrics_start(const main_conf_t *conf, running_t **workers, size_t count) {
+    metrics_t *m;
+
+    if (conf->metrics == NULL)
+        return;
+
+    m = calloc(1, sizeof(*m));
+    if (m == NULL || (m->stats = calloc(1, sizeof(*m->stats))) == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    m->workers = workers;
+    m->count = count;
+    m->max = 64 * 1024;
+    m->buf = malloc(m->max);
+    if (m->buf == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+
+    m->fd = _metrics_listen(conf->metrics);
+    if (util_thread_begin(_metrics_thread, m) == 0) {
+        fprintf(stderr, "[-] FATAL: couldn't start metrics thread\n");
+        exit(1);
+    }
+}
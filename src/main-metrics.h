@@ -0,0 +1,41 @@
+/*
+    Prometheus metrics
+
+ With --metrics [ADDR:]PORT, we listen for HTTP requests for /metrics,
+ and answer with the statistics so far in the Prometheus text format
+ (which OpenMetrics scrapers also accept), so that a long run can be
+ watched with the same dashboards as the server under test:
+
+    nxbench_con_attempted_total         every named counter, including
+    nxbench_http_n200_total             the close reasons, timeouts, and
+    ...                                 status classes
+    nxbench_socket_errors_total         by errno
+    nxbench_http_status_total           by status code
+    nxbench_concurrency                 open connections right now
+    nxbench_latency_seconds             connect, first_byte, and response
+                                        histograms
+    nxbench_status_latency_seconds      response histograms by status
+                                        class, 1xx through 5xx
+
+ The address defaults to 127.0.0.1, since this isn't meant to be
+ exposed to the world.
+
+ The listener has its own thread, which sleeps in accept() between
+ scrapes. At each scrape it sums the workers' counters, the same way
+ the main thread does for the display, reading them without any
+ locking, so the workers' event loops never know it's there.
+ */
+#ifndef MAIN_METRICS_H
+#define MAIN_METRICS_H
+#include <stddef.h>
+struct main_conf_t;
+struct running_t;
+
+/**
+ * Start listening, on a thread of its own, if --metrics was given.
+ * It's fatal if we can't listen on the address.
+ */
+void
+metrics_start(const struct main_conf_t *conf, struct running_t **workers, size_t count);
+
+#endif
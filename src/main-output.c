@@ -0,0 +1,252 @@
+#include "main-output.h"
+#include "main-conf.h"
+#include "util-time.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include "win-sockets.h"
+#else
+#include "unix-sockets.h"
+#endif
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+static const double output_percentiles[] = {50.0, 90.0, 99.0, 99.9};
+static const char *output_percentile_names[] = {"p50", "p90", "p99", "p99.9"};
+
+static FILE *
+_output_open(const char *filename, const char *option) {
+    FILE *fp = fopen(filename, "wt");
+
+    if (fp == NULL) {
+        fprintf(stderr, "[-] %s: %s: %s\n", option, filename, strerror(errno));
+        exit(1);
+    }
+    setvbuf(fp, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    return fp;
+}
+
+/*
+ * The CSV header, which must list the columns in the same order
+ * that `_csv_record()` writes them
+ */
+static void
+_csv_header(FILE *fp, const statistics_t *stats) {
+    const counter_t *c;
+    const char *name;
+    size_t i;
+    size_t j;
+
+    fprintf(fp, "type,timestamp,elapsed,concurrency");
+    for (i = 0; (name = stats_counter_name(stats, i, &c)) != NULL; i++)
+        fprintf(fp, ",%s,%s.rate", name, name);
+    fprintf(fp, ",errors,errors.rate");
+    for (i = 0; i < 3; i++) {
+        static const char *hdrs[] = {"connect", "first_byte", "response"};
+        for (j = 0; j < 4; j++)
+            fprintf(fp, ",%s.%s_ms", hdrs[i], output_percentile_names[j]);
+        fprintf(fp, ",%s.max_ms,%s.count", hdrs[i], hdrs[i]);
+    }
+    fprintf(fp, "\n");
+}
+
+output_t *
+output_create(const main_conf_t *conf) {
+    output_t *out;
+
+    if (conf->output_json == NULL && conf->output_csv == NULL)
+        return NULL;
+
+    out = calloc(1, sizeof(*out));
+    out->last = calloc(1, sizeof(*out->last));
+    out->diff = calloc(1, sizeof(*out->diff));
+    if (out->last == NULL || out->diff == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+
+    if (conf->output_json)
+        out->json = _output_open(conf->output_json, "output-json");
+    if (conf->output_csv) {
+        out->csv = _output_open(conf->output_csv, "output-csv");
+        _csv_header(out->csv, out->last);
+    }
+    return out;
+}
+
+static double
+_output_timestamp(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * The rate of a counter: for intervals, the smoothed rate the
+ * display shows, and for the summary, the average over the run.
+ */
+static double
+_output_rate(const counter_t *c, double elapsed, int is_summary) {
+    if (!is_summary)
+        return (double)c->rate;
+    return (elapsed > 0.0) ? c->total / elapsed : 0.0;
+}
+
+static void
+_json_string(FILE *fp, const char *str) {
+    fputc('"', fp);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fprintf(fp, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(fp, "\\u%04x", (unsigned char)*str);
+        else
+            fputc(*str, fp);
+    }
+    fputc('"', fp);
+}
+
+static void
+_json_hdr(FILE *fp, const char *name, const util_hdr_t *hdr) {
+    size_t i;
+
+    fprintf(fp, "\"%s\":{", name);
+    for (i = 0; i < 4; i++)
+        fprintf(fp, "\"%s\":%.3f,", output_percentile_names[i],
+            util_hdr_percentile(hdr, output_percentiles[i]) / 1000000.0);
+    fprintf(fp, "\"max\":%.3f,\"mean\":%.3f,\"count\":%llu}",
+        hdr->max / 1000000.0, util_hdr_mean(hdr) / 1000000.0,
+        (unsigned long long)hdr->count);
+}
+
+static void
+_json_record(FILE *fp, const char *type, const statistics_t *stats, const statistics_t *latency,
+        double elapsed, size_t concurrency, int is_summary) {
+    const counter_t *c;
+    const char *name;
+    const char *comma = "";
+    size_t i;
+
+    fprintf(fp, "{\"type\":\"%s\",\"timestamp\":%.3f,\"elapsed\":%.3f,",
+        type, _output_timestamp(), elapsed);
+    fprintf(fp, "\"%s\":%llu,", is_summary ? "unfinished" : "concurrency",
+        (unsigned long long)concurrency);
+
+    fprintf(fp, "\"counters\":{");
+    for (i = 0; (name = stats_counter_name(stats, i, &c)) != NULL; i++) {
+        fprintf(fp, "%s\"%s\":{\"total\":%llu,\"rate\":%.1f}", comma, name,
+            (unsigned long long)c->total, _output_rate(c, elapsed, is_summary));
+        comma = ",";
+    }
+
+    fprintf(fp, "},\"errors\":{");
+    comma = "";
+    for (i = 0; i < STATS_ERRNO_MAX; i++) {
+        c = &stats->errors[i];
+        if (c->total == 0)
+            continue;
+        fprintf(fp, "%s\"%d\":{\"total\":%llu,\"rate\":%.1f,\"message\":", comma,
+            stats_errno_value((unsigned)i), (unsigned long long)c->total,
+            _output_rate(c, elapsed, is_summary));
+        _json_string(fp, sock_strerror(stats_errno_value((unsigned)i)));
+        fprintf(fp, "}");
+        comma = ",";
+    }
+
+    fprintf(fp, "},\"status\":{");
+    comma = "";
+    for (i = 0; i < STATS_STATUS_MAX; i++) {
+        c = &stats->status[i];
+        if (c->total == 0)
+            continue;
+        if (i == 0)
+            fprintf(fp, "%s\"other\":", comma);
+        else
+            fprintf(fp, "%s\"%u\":", comma, (unsigned)i);
+        fprintf(fp, "{\"total\":%llu,\"rate\":%.1f}", (unsigned long long)c->total,
+            _output_rate(c, elapsed, is_summary));
+        comma = ",";
+    }
+
+    fprintf(fp, "},\"latency_ms\":{");
+    _json_hdr(fp, "connect", &latency->latency.connect);
+    fprintf(fp, ",");
+    _json_hdr(fp, "first_byte", &latency->latency.first_byte);
+    fprintf(fp, ",");
+    _json_hdr(fp, "response", &latency->latency.response);
+    for (i = 0; i < STATS_CLASS_MAX; i++) {
+        if (latency->latency.classes[i].count == 0)
+            continue;
+        fprintf(fp, ",");
+        _json_hdr(fp, stats_class_name((unsigned)i), &latency->latency.classes[i]);
+    }
+    fprintf(fp, "}}\n");
+}
+
+static void
+_csv_hdr(FILE *fp, const util_hdr_t *hdr) {
+    size_t i;
+
+    for (i = 0; i < 4; i++)
+        fprintf(fp, ",%.3f", util_hdr_percentile(hdr, output_percentiles[i]) / 1000000.0);
+    fprintf(fp, ",%.3f,%llu", hdr->max / 1000000.0, (unsigned long long)hdr->count);
+}
+
+static void
+_csv_record(FILE *fp, const char *type, const statistics_t *stats, const statistics_t *latency,
+        double elapsed, size_t concurrency, int is_summary) {
+    const counter_t *c;
+    const char *name;
+    uint64_t errors = 0;
+    double errors_rate = 0.0;
+    size_t i;
+
+    fprintf(fp, "%s,%.3f,%.3f,%llu", type, _output_timestamp(), elapsed,
+        (unsigned long long)concurrency);
+    for (i = 0; (name = stats_counter_name(stats, i, &c)) != NULL; i++)
+        fprintf(fp, ",%llu,%.1f", (unsigned long long)c->total, _output_rate(c, elapsed, is_summary));
+
+    /* The errors are summed, as there are too many to have a
+     * column for each */
+    for (i = 0; i < STATS_ERRNO_MAX; i++) {
+        errors += stats->errors[i].total;
+        errors_rate += _output_rate(&stats->errors[i], elapsed, is_summary);
+    }
+    fprintf(fp, ",%llu,%.1f", (unsigned long long)errors, errors_rate);
+
+    _csv_hdr(fp, &latency->latency.connect);
+    _csv_hdr(fp, &latency->latency.first_byte);
+    _csv_hdr(fp, &latency->latency.response);
+    fprintf(fp, "\n");
+}
+
+void
+output_interval(output_t *out, const statistics_t *stats, double elapsed, size_t concurrency) {
+    /* The latency during just this interval */
+    memcpy(out->diff, stats, sizeof(*out->diff));
+    stats_subtract(out->diff, out->last);
+    memcpy(out->last, stats, sizeof(*out->last));
+
+    if (out->json)
+        _json_record(out->json, "interval", stats, out->diff, elapsed, concurrency, 0);
+    if (out->csv)
+        _csv_record(out->csv, "interval", stats, out->diff, elapsed, concurrency, 0);
+}
+
+void
+output_summary(output_t *out, const statistics_t *stats, double elapsed, size_t unfinished) {
+    if (out->json) {
+        _json_record(out->json, "summary", stats, stats, elapsed, unfinished, 1);
+        fclose(out->json);
+    }
+    if (out->csv) {
+        _csv_record(out->csv, "summary", stats, stats, elapsed, unfinished, 1);
+        fclose(out->csv);
+    }
+    free(out->last);
+    free(out->diff);
+    free(out);
+}
@@ -0,0 +1,53 @@
+/*
+    Machine-readable output
+
+ With --output-json FILE and/or --output-csv FILE, the main thread
+ writes a record once a second, with the total and rate of every
+ counter, the errors, and the latency percentiles for that second,
+ then a final "summary" record at the end, with the latency for the
+ whole run, and the average rates. JSON is one object per line (JSON
+ Lines), and CSV has a header line, then one line per record.
+
+ The files are written by the main thread, fully buffered, so none of
+ this is anywhere near the workers' event loops.
+ */
+#ifndef MAIN_OUTPUT_H
+#define MAIN_OUTPUT_H
+#include "main-stats.h"
+#include <stdio.h>
+#include <stddef.h>
+struct main_conf_t;
+
+typedef struct output_t {
+    FILE *json;
+    FILE *csv;
+
+    /* The totals at the last record, so that we can get the latency
+     * for each interval on its own */
+    statistics_t *last;
+    statistics_t *diff;
+} output_t;
+
+/**
+ * Open the output files, if any were configured. It's fatal if
+ * they can't be opened.
+ * @return
+ *      the output, or NULL if there isn't any.
+ */
+output_t *
+output_create(const struct main_conf_t *conf);
+
+/**
+ * Write one record for the interval that just ended, 'elapsed' seconds
+ * after the start, from the totals and rates in 'stats'.
+ */
+void
+output_interval(output_t *out, const statistics_t *stats, double elapsed, size_t concurrency);
+
+/**
+ * Write the final summary record, and close the files.
+ */
+void
+output_summary(output_t *out, const statistics_t *stats, double elapsed, size_t unfinished);
+
+#endif
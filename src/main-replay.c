@@ -0,0 +1,482 @@
+#include "main-replay.h"
+#include "http-request.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* How far each worker gets past the last pages it gave back to the OS
+ * before giving back some more */
+#define REPLAY_RELEASE_SIZE (64 * 1024 * 1024)
+
+/* The most lines in one second that we look ahead for, to spread them
+ * across it. Past this, the rest of that second go out in bursts. */
+#define REPLAY_SECOND_MAX 1000000
+
+/*
+ * The days since 1970-01-01 of a date in the Gregorian calendar
+ */
+static int64_t
+_days_from_civil(int64_t year, int month, int day) {
+    int64_t era;
+    int64_t year_of_era;
+    int64_t day_of_year;
+    int64_t day_of_era;
+
+    year -= (month <= 2);
+    era = (year >= 0 ? year : year - 399) / 400;
+    year_of_era = year - era * 400;
+    day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+static int
+_digits(const unsigned char *s, size_t count, int *r_value) {
+    size_t i;
+
+    *r_value = 0;
+    for (i = 0; i < count; i++) {
+        if (s[i] < '0' || s[i] > '9')
+            return -1;
+        *r_value = *r_value * 10 + (s[i] - '0');
+    }
+    return 0;
+}
+
+/*
+ * Parse the time from the log, like "10/Oct/2000:13:55:36 -0700",
+ * into seconds since 1970.
+ */
+static int
+_parse_time(const unsigned char *s, size_t length, int64_t *r_time) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    int day, month, year, hour, minute, second, zone;
+    const char *found;
+
+    if (length != 26 || s[2] != '/' || s[6] != '/' || s[11] != ':' || s[14] != ':'
+        || s[17] != ':' || s[20] != ' ' || (s[21] != '+' && s[21] != '-'))
+        return -1;
+    if (_digits(s, 2, &day) || _digits(s + 7, 4, &year) || _digits(s + 12, 2, &hour)
+        || _digits(s + 15, 2, &minute) || _digits(s + 18, 2, &second) || _digits(s + 22, 4, &zone))
+        return -1;
+
+    found = NULL;
+    for (month = 0; month < 12; month++) {
+        if (memcmp(s + 3, months + month * 3, 3) == 0) {
+            found = months + month * 3;
+            break;
+        }
+    }
+    if (found == NULL)
+        return -1;
+
+    /* The zone is +HHMM east of UTC, so subtract it */
+    zone = (zone / 100) * 3600 + (zone % 100) * 60;
+    if (s[21] == '-')
+        zone = -zone;
+
+    *r_time = _days_from_civil(year, month + 1, day) * 86400
+        + hour * 3600 + minute * 60 + second - zone;
+    return 0;
+}
+
+/*
+ * Find the time in the line, between the square brackets
+ */
+static int
+_time_slice(const unsigned char *p, size_t length, const unsigned char **r_time, size_t *r_length) {
+    const unsigned char *open = memchr(p, '[', length);
+    const unsigned char *close;
+
+    if (open == NULL)
+        return -1;
+    open++;
+    close = memchr(open, ']', length - (open - p));
+    if (close == NULL)
+        return -1;
+    *r_time = open;
+    *r_length = close - open;
+    return 0;
+}
+
+/*
+ * Find the next quoted string, starting at 'p'
+ */
+static const unsigned char *
+_quoted(const unsigned char *p, const unsigned char *end, size_t *r_length) {
+    const unsigned char *open = memchr(p, '"', end - p);
+    const unsigned char *close;
+
+    if (open == NULL)
+        return NULL;
+    open++;
+    close = memchr(open, '"', end - open);
+    if (close == NULL)
+        return NULL;
+    *r_length = close - open;
+    return open;
+}
+
+/*
+ * Parse one line of the log, getting the method and path from the
+ * "request", the User-Agent, and the time.
+ */
+static int
+_replay_parse(const unsigned char *p, size_t length, replay_line_t *line, int64_t *r_time) {
+    const unsigned char *end = p + length;
+    const unsigned char *time;
+    const unsigned char *request;
+    const unsigned char *referer;
+    const unsigned char *space;
+    size_t time_length;
+    size_t request_length;
+    size_t referer_length;
+    int64_t seconds;
+
+    memset(line, 0, sizeof(*line));
+    if (_time_slice(p, length, &time, &time_length) != 0)
+        return -1;
+    if (_parse_time(time, time_length, &seconds) != 0)
+        return -1;
+    if (r_time)
+        *r_time = seconds;
+
+    /* "METHOD PATH PROTOCOL", where the protocol may be missing */
+    request = _quoted(time + time_length, end, &request_length);
+    if (request == NULL)
+        return -1;
+    space = memchr(request, ' ', request_length);
+    if (space == NULL || space == request)
+        return -1;
+    line->method = request;
+    line->method_length = space - request;
+    line->is_head = (line->method_length == 4 && memcmp(line->method, "HEAD", 4) == 0);
+    line->path = space + 1;
+    space = memchr(line->path, ' ', request + request_length - line->path);
+    line->path_length = (space ? space : request + request_length) - line->path;
+    if (line->path_length == 0)
+        return -1;
+
+    /* The referer, then the User-Agent, which might not be there */
+    referer = _quoted(request + request_length + 1, end, &referer_length);
+    if (referer) {
+        line->agent = _quoted(referer + referer_length + 1, end, &line->agent_length);
+        if (line->agent == NULL || (line->agent_length == 1 && line->agent[0] == '-'))
+            line->agent_length = 0;
+    }
+    return 0;
+}
+
+/*
+ * At the start of a new second, count how many lines of the log are
+ * in it, so that we can spread them across it. Lines without a time
+ * we can parse don't belong to any second, so we pass over them,
+ * rather than let one end the second early.
+ * @return
+ *      0, or -1 if this line has no time, so there's no new second.
+ */
+static int
+_replay_second(replay_cursor_t *cursor, const unsigned char *p, size_t length) {
+    const replay_log_t *log = cursor->log;
+    const unsigned char *time;
+    size_t time_length;
+    int64_t seconds;
+    size_t offset;
+
+    if (_time_slice(p, length, &time, &time_length) != 0
+        || time_length > sizeof(cursor->second_text)
+        || _parse_time(time, time_length, &seconds) != 0)
+        return -1;
+    cursor->second = seconds;
+    memcpy(cursor->second_text, time, time_length);
+    cursor->second_text_length = time_length;
+    cursor->second_index = 0;
+    cursor->second_count = 1;
+
+    for (offset = cursor->offset; offset < log->size && cursor->second_count < REPLAY_SECOND_MAX; ) {
+        const unsigned char *next = log->data + offset;
+        const unsigned char *eol = memchr(next, '\n', log->size - offset);
+        size_t next_length = eol ? (size_t)(eol - next) : log->size - offset;
+        const unsigned char *next_time;
+        size_t next_time_length;
+
+        if (_time_slice(next, next_length, &next_time, &next_time_length) == 0) {
+            if (next_time_length == time_length && memcmp(next_time, time, time_length) == 0)
+                cursor->second_count++;
+            else if (_parse_time(next_time, next_time_length, &seconds) == 0)
+                break;
+        }
+        offset += next_length + (eol != NULL);
+    }
+    cursor->second_end = offset;
+    return 0;
+}
+
+/*
+ * Whether a line within the current second was one of those counted
+ * in it, rather than one without a time
+ */
+static int
+_replay_is_counted(const replay_cursor_t *cursor, const unsigned char *p, size_t length) {
+    const unsigned char *time;
+    size_t time_length;
+
+    return _time_slice(p, length, &time, &time_length) == 0
+        && time_length == cursor->second_text_length
+        && memcmp(time, cursor->second_text, time_length) == 0;
+}
+
+/*
+ * Tell the OS it can drop the pages we've finished with. They're
+ * still mapped, so if we do touch them again, they're read back in.
+ */
+static void
+_replay_release(replay_cursor_t *cursor, size_t offset) {
+#ifndef _WIN32
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t end = offset - offset % page;
+
+    if (end < cursor->released + REPLAY_RELEASE_SIZE)
+        return;
+    madvise((void *)(cursor->log->data + cursor->released), end - cursor->released, MADV_DONTNEED);
+    cursor->released = end;
+#else
+    (void)cursor;
+    (void)offset;
+#endif
+}
+
+void
+replay_cursor_init(replay_cursor_t *cursor, const replay_log_t *log, unsigned index, unsigned count) {
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->log = log;
+    cursor->index = index;
+    cursor->count = count;
+    cursor->second = log->first_time;
+}
+
+int
+replay_next(replay_cursor_t *cursor, replay_line_t *line) {
+    const replay_log_t *log = cursor->log;
+
+    while (cursor->offset < log->size) {
+        const unsigned char *p = log->data + cursor->offset;
+        const unsigned char *eol = memchr(p, '\n', log->size - cursor->offset);
+        size_t length = eol ? (size_t)(eol - p) : log->size - cursor->offset;
+        size_t start = cursor->offset;
+        uint64_t number = cursor->line_number++;
+
+        cursor->offset += length + (eol != NULL);
+
+        /* Every worker keeps track of where every line is within its
+         * second, so that they all agree on when to send them */
+        if (start >= cursor->second_end)
+            _replay_second(cursor, p, length);
+        else if (_replay_is_counted(cursor, p, length))
+            cursor->second_index++;
+
+        if (number % cursor->count != cursor->index)
+            continue;
+        _replay_release(cursor, start);
+        if (_replay_parse(p, length, line, NULL) != 0) {
+            cursor->skipped++;
+            continue;
+        }
+        line->time = (double)(cursor->second - log->first_time)
+            + (double)cursor->second_index / (double)cursor->second_count;
+        return 1;
+    }
+    return 0;
+}
+
+size_t
+replay_build(const replay_line_t *line, const unsigned char *base, size_t base_length, unsigned char **r_request) {
+    unsigned char *request;
+    size_t length;
+
+    request = realloc(*r_request, base_length + 1);
+    if (request == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    memcpy(request, base, base_length);
+    request[base_length] = '\0';
+
+    length = http_edit_request(&request, base_length, "method", 6, line->method, line->method_length);
+    length = http_edit_request(&request, length, "url", 3, line->path, line->path_length);
+    if (line->agent_length)
+        length = http_edit_request(&request, length, "User-Agent", 10, line->agent, line->agent_length);
+    *r_request = request;
+    return length;
+}
+
+/*
+ * Find the time of the first line we can parse
+ */
+static int
+_replay_first_time(replay_log_t *log) {
+    size_t offset = 0;
+
+    while (offset < log->size) {
+        const unsigned char *p = log->data + offset;
+        const unsigned char *eol = memchr(p, '\n', log->size - offset);
+        size_t length = eol ? (size_t)(eol - p) : log->size - offset;
+        replay_line_t line;
+
+        if (_replay_parse(p, length, &line, &log->first_time) == 0)
+            return 0;
+        offset += length + (eol != NULL);
+    }
+    return -1;
+}
+
+replay_log_t *
+replay_open(const char *filename) {
+    replay_log_t *log = calloc(1, sizeof(*log));
+
+    if (log == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+
+#ifdef _WIN32
+    {
+        HANDLE file;
+        HANDLE mapping;
+        LARGE_INTEGER size;
+
+        file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size)) {
+            fprintf(stderr, "[-] replay: %s: error %u\n", filename, (unsigned)GetLastError());
+            exit(1);
+        }
+        log->size = (size_t)size.QuadPart;
+        if (log->size) {
+            mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping == NULL) {
+                fprintf(stderr, "[-] replay: %s: error %u\n", filename, (unsigned)GetLastError());
+                exit(1);
+            }
+            log->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+    }
+#else
+    {
+        struct stat st;
+        int fd;
+
+        fd = open(filename, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            fprintf(stderr, "[-] replay: %s: %s\n", filename, strerror(errno));
+            exit(1);
+        }
+        log->size = (size_t)st.st_size;
+        if (log->size) {
+            void *data = mmap(NULL, log->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                fprintf(stderr, "[-] replay: %s: %s\n", filename, strerror(errno));
+                exit(1);
+            }
+            madvise(data, log->size, MADV_SEQUENTIAL);
+            log->data = data;
+        }
+        close(fd);
+    }
+#endif
+
+    if (log->size == 0 || log->data == NULL || _replay_first_time(log) != 0) {
+        fprintf(stderr, "[-] replay: %s: no lines in the combined log format\n", filename);
+        exit(1);
+    }
+    return log;
+}
+
+int
+replay_selftest(void) {
+    static const char text[] =
+        "1.2.3.4 - - [10/Oct/2000:13:55:36 -0700] \"GET /a HTTP/1.1\" 200 5 \"-\" \"curl/8.0\"\n"
+        "1.2.3.4 - - [10/Oct/2000:13:55:36 -0700] \"POST /b?x=1 HTTP/1.1\" 200 5 \"-\" \"-\"\n"
+        "1.2.3.4 - - [10/Oct/2000:13:55:36 -0700] \"\\x16\\x03\" 400 0 \"-\" \"-\"\n"
+        "garbage\n"
+        "1.2.3.4 - - [10/Oct/2000:13:55:38 -0700] \"GET /c\" 200 5\n"
+        "more garbage\n"
+        "1.2.3.4 - - [-] \"GET /d\" 200 5\n"
+        "1.2.3.4 - - [10/Oct/2000:13:55:38 -0700] \"HEAD / HTTP/1.0\" 200 5 \"http://x/\" \"Mozilla/5.0 (X11)\"";
+    static const char base[] = "GET / HTTP/1.1\r\nHost: example\r\n\r\n";
+    replay_log_t log;
+    replay_cursor_t cursor;
+    replay_line_t line;
+    unsigned char *request = NULL;
+    size_t length;
+    int64_t t;
+    unsigned count;
+
+    if (_parse_time((const unsigned char *)"01/Jan/1970:00:00:00 +0000", 26, &t) != 0 || t != 0)
+        goto fail;
+    if (_parse_time((const unsigned char *)"10/Oct/2000:13:55:36 -0700", 26, &t) != 0 || t != 971211336)
+        goto fail;
+    if (_parse_time((const unsigned char *)"29/Feb/2024:23:59:59 +0100", 26, &t) != 0 || t != 1709247599)
+        goto fail;
+    if (_parse_time((const unsigned char *)"10/Foo/2000:13:55:36 -0700", 26, &t) == 0)
+        goto fail;
+
+    log.data = (const unsigned char *)text;
+    log.size = sizeof(text) - 1;
+    if (_replay_first_time(&log) != 0 || log.first_time != 971211336)
+        goto fail;
+
+    /* One worker gets all four good lines. The first three lines are
+     * in the same second, so they're spread a third of a second apart,
+     * even though the third is bad. The lines without a time don't
+     * count, so the last two are still half a second apart */
+    replay_cursor_init(&cursor, &log, 0, 1);
+    if (!replay_next(&cursor, &line) || line.time != 0.0 || line.agent_length != 8 || line.is_head)
+        goto fail;
+    if (!replay_next(&cursor, &line) || line.path_length != 6 || line.agent_length != 0)
+        goto fail;
+    if (line.time < 0.33 || line.time > 0.34)
+        goto fail;
+    if (!replay_next(&cursor, &line) || line.time != 2.0 || line.path_length != 2)
+        goto fail;
+    if (!replay_next(&cursor, &line) || line.time != 2.5 || line.method_length != 4 || !line.is_head)
+        goto fail;
+    if (replay_next(&cursor, &line) || cursor.skipped != 4)
+        goto fail;
+
+    length = replay_build(&line, (const unsigned char *)base, sizeof(base) - 1, &request);
+    if (length != strlen((char *)request)
+        || strcmp((char *)request, "HEAD / HTTP/1.1\r\nHost: example\r\nUser-Agent: Mozilla/5.0 (X11)\r\n\r\n") != 0)
+        goto fail;
+    free(request);
+
+    /* The second of two workers gets the odd lines, at the same
+     * times as above */
+    replay_cursor_init(&cursor, &log, 1, 2);
+    for (count = 0; replay_next(&cursor, &line); count++) {
+        if (count == 0 && (line.time < 0.33 || line.time > 0.34))
+            goto fail;
+        if (count == 1 && line.time != 2.5)
+            goto fail;
+    }
+    if (count != 2)
+        goto fail;
+
+    return 0;
+fail:
+    fprintf(stderr, "[-] replay: programming error\n");
+    return 1;
+}
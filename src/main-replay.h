@@ -0,0 +1,124 @@
+/*
+    Access log replay
+
+ With --replay FILE, rather than sending the same request over and
+ over, we send the requests from an nginx (or Apache) access log in
+ the "combined" format:
+
+    1.2.3.4 - - [10/Oct/2023:13:55:36 -0700] "GET /a?b=c HTTP/1.1" 200 2326 "-" "curl/8.0"
+
+ Each line becomes a request built from the one on the command-line,
+ with the method, path, and User-Agent from the log. They're sent at
+ the times they were logged, relative to the first line, sped up or
+ slowed down by --replay-speed, or with --replay-speed max, as fast
+ as the -c connections can go. The log only has whole seconds, so the
+ lines within a second (up to a million of them) are spread evenly
+ across it. The replay ends at the end of the log.
+
+ Like --rate, the timed replay is open-loop: requests go out when
+ the log says, whether or not the server has kept up, and their
+ latency is measured from then.
+
+ The log is memory-mapped, not read into memory, and each worker
+ parses its own share of the lines (every Nth) as it goes, so nothing
+ is shared but the read-only mapping. Every so often each worker
+ tells the OS it's done with the pages behind it, so that memory use
+ stays flat however large the log.
+ */
+#ifndef MAIN_REPLAY_H
+#define MAIN_REPLAY_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct replay_log_t {
+    const unsigned char *data;
+    size_t size;
+
+    /* The time of the first line, which the others are relative to
+     * (seconds since 1970) */
+    int64_t first_time;
+} replay_log_t;
+
+/**
+ * One request from the log, pointing into the mapping
+ */
+typedef struct replay_line_t {
+    /* When to send it, in seconds from the first line */
+    double time;
+
+    const unsigned char *method;
+    size_t method_length;
+    const unsigned char *path;
+    size_t path_length;
+    const unsigned char *agent;
+    size_t agent_length;
+
+    /* A HEAD request, whose response has no content */
+    bool is_head;
+} replay_line_t;
+
+/**
+ * Each worker's place in the log
+ */
+typedef struct replay_cursor_t {
+    const replay_log_t *log;
+
+    /* The start of the next line, and its number (from 0) */
+    size_t offset;
+    uint64_t line_number;
+
+    /* We take every 'count'th line, starting at 'index' */
+    unsigned index;
+    unsigned count;
+
+    /* The second the lines are in now, as it's written in the log,
+     * where its lines end, how many there are (counting every
+     * worker's, but not the lines without a time), and which of
+     * those the next line is */
+    int64_t second;
+    unsigned char second_text[64];
+    size_t second_text_length;
+    size_t second_end;
+    uint64_t second_count;
+    uint64_t second_index;
+
+    /* How much of the log we've given back to the OS */
+    size_t released;
+
+    /* Our lines that couldn't be parsed */
+    uint64_t skipped;
+} replay_cursor_t;
+
+/**
+ * Map the log into memory, and find the time of its first line.
+ * It's fatal if it can't be read, or has no valid lines.
+ */
+replay_log_t *
+replay_open(const char *filename);
+
+void
+replay_cursor_init(replay_cursor_t *cursor, const replay_log_t *log, unsigned index, unsigned count);
+
+/**
+ * Get this worker's next request from the log.
+ * @return
+ *      1 if there was one, or 0 at the end of the log.
+ */
+int
+replay_next(replay_cursor_t *cursor, replay_line_t *line);
+
+/**
+ * Build the request for a line, starting from 'base', into '*r_request',
+ * which is reallocated as needed, and can be reused from one line to
+ * the next.
+ * @return
+ *      the length of the request.
+ */
+size_t
+replay_build(const replay_line_t *line, const unsigned char *base, size_t base_length, unsigned char **r_request);
+
+int
+replay_selftest(void);
+
+#endif
@@ -0,0 +1,279 @@
+#include "main-requests.h"
+#include "http-request.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+/* The longest line we'll read from the file */
+#define REQUESTS_LINE_MAX 8192
+
+static void *
+_requests_realloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (p == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * Split off the next word from the line, which is then the rest
+ */
+static char *
+_next_word(char **line) {
+    char *word = *line;
+    char *end;
+
+    while (isspace((unsigned char)*word))
+        word++;
+    end = word;
+    while (*end && !isspace((unsigned char)*end))
+        end++;
+    if (*end)
+        *end++ = '\0';
+    *line = end;
+    return word;
+}
+
+/*
+ * Parse one line of the file, which either starts a new request, or
+ * if indented, adds a header field to the last one.
+ * @return
+ *      0 on success, or -1 if it's not valid.
+ */
+static int
+_requests_line(request_set_t *set, char *line, const unsigned char *base, size_t base_length) {
+    request_entry_t *entry;
+    char *word;
+    char *method;
+    char *path;
+    unsigned long weight = 1;
+    size_t length;
+
+    /* Trim the end of the line */
+    length = strlen(line);
+    while (length && isspace((unsigned char)line[length - 1]))
+        line[--length] = '\0';
+
+    /* Skip blank lines and comments */
+    word = line;
+    while (isspace((unsigned char)*word))
+        word++;
+    if (*word == '\0' || *word == '#')
+        return 0;
+
+    /* An indented "Name: value" adds a field to the last request */
+    if (word != line) {
+        char *value = strchr(word, ':');
+        char *end;
+
+        if (set->count == 0 || value == NULL || value == word)
+            return -1;
+        end = value;
+        while (end > word && isspace((unsigned char)end[-1]))
+            end--;
+        *end = '\0';
+        value++;
+        while (isspace((unsigned char)*value))
+            value++;
+
+        entry = &set->entries[set->count - 1];
+        entry->length = http_edit_request(&entry->request, entry->length,
+            word, strlen(word), value, strlen(value));
+        return 0;
+    }
+
+    /* Otherwise, [WEIGHT] METHOD PATH */
+    word = _next_word(&line);
+    if (isdigit((unsigned char)word[0])) {
+        char *end = NULL;
+
+        weight = strtoul(word, &end, 10);
+        if (*end != '\0' || weight == 0 || weight > 0xFFFFFFFF)
+            return -1;
+        word = _next_word(&line);
+    }
+    method = word;
+    path = _next_word(&line);
+    if (*method == '\0' || *path == '\0' || *_next_word(&line) != '\0')
+        return -1;
+
+    set->entries = _requests_realloc(set->entries, (set->count + 1) * sizeof(*set->entries));
+    entry = &set->entries[set->count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->weight = (unsigned)weight;
+    entry->is_head = (strcmp(method, "HEAD") == 0);
+
+    entry->name = _requests_realloc(NULL, strlen(method) + strlen(path) + 2);
+    sprintf(entry->name, "%s %s", method, path);
+
+    entry->request = _requests_realloc(NULL, base_length + 1);
+    memcpy(entry->request, base, base_length);
+    entry->request[base_length] = '\0';
+    entry->length = http_edit_request(&entry->request, base_length, "method", 6, method, strlen(method));
+    entry->length = http_edit_request(&entry->request, entry->length, "url", 3, path, strlen(path));
+    return 0;
+}
+
+/*
+ * Once all the requests are built, copy them into the arena, and
+ * build the table for choosing them by weight.
+ */
+static void
+_requests_finish(request_set_t *set, unsigned pipeline) {
+    double *weights;
+    size_t i;
+    unsigned j;
+
+    weights = _requests_realloc(NULL, set->count * sizeof(*weights));
+    for (i = 0; i < set->count; i++) {
+        set->arena_length += pipeline * set->entries[i].length;
+        set->total_weight += set->entries[i].weight;
+        weights[i] = set->entries[i].weight;
+    }
+    if (util_dist_weights(&set->choice, weights, set->count) != 0) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    free(weights);
+
+    set->arena = _requests_realloc(NULL, set->arena_length);
+    set->arena_length = 0;
+    for (i = 0; i < set->count; i++) {
+        request_entry_t *entry = &set->entries[i];
+
+        entry->template = template_compile(entry->request, entry->length);
+        entry->offset = set->arena_length;
+        for (j = 0; j < pipeline; j++) {
+            memcpy(set->arena + set->arena_length, entry->request, entry->length);
+            set->arena_length += entry->length;
+        }
+        free(entry->request);
+        entry->request = NULL;
+    }
+}
+
+request_set_t *
+requests_read(const char *filename, const unsigned char *base, size_t base_length, unsigned pipeline) {
+    request_set_t *set;
+    char *line;
+    unsigned line_number = 0;
+    FILE *fp;
+
+    fp = fopen(filename, "rt");
+    if (fp == NULL) {
+        fprintf(stderr, "[-] requests: %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+
+    set = _requests_realloc(NULL, sizeof(*set));
+    memset(set, 0, sizeof(*set));
+    line = _requests_realloc(NULL, REQUESTS_LINE_MAX);
+
+    while (fgets(line, REQUESTS_LINE_MAX, fp)) {
+        line_number++;
+        if (_requests_line(set, line, base, base_length) != 0) {
+            fprintf(stderr, "[-] requests: %s:%u: bad line (expected [WEIGHT] METHOD PATH, "
+                "or an indented Name: value)\n", filename, line_number);
+            exit(1);
+        }
+    }
+    fclose(fp);
+    free(line);
+
+    if (set->count == 0) {
+        fprintf(stderr, "[-] requests: %s: no requests\n", filename);
+        exit(1);
+    }
+    _requests_finish(set, pipeline);
+    return set;
+}
+
+unsigned
+requests_choose(const request_set_t *set, util_rand_t *r) {
+    if (set->count == 1)
+        return 0;
+    return (unsigned)util_dist_next(&set->choice, r, 0);
+}
+
+int
+requests_selftest(void) {
+    static const char *lines[] = {
+        "# a comment\n",
+        "3 GET /a\n",
+        "  Accept: text/html\n",
+        "\n",
+        "POST /b?x=1\r\n",
+        "    Cookie :  c=1 \n",
+        0};
+    static const char *bad[] = {"  Accept: x", "0 GET /", "GET", "GET / x", "2 GET /\n  nocolon", 0};
+    static const char base[] = "GET / HTTP/1.1\r\nHost: example\r\n\r\n";
+    request_set_t set;
+    util_rand_t r;
+    unsigned counts[2] = {0, 0};
+    char line[256];
+    size_t i;
+
+    memset(&set, 0, sizeof(set));
+    for (i = 0; lines[i]; i++) {
+        snprintf(line, sizeof(line), "%s", lines[i]);
+        if (_requests_line(&set, line, (const unsigned char *)base, sizeof(base) - 1) != 0)
+            goto fail;
+    }
+    _requests_finish(&set, 2);
+
+    if (set.count != 2 || set.total_weight != 4 || strcmp(set.entries[1].name, "POST /b?x=1") != 0)
+        goto fail;
+    if (set.entries[0].length != strlen("GET /a HTTP/1.1\r\nHost: example\r\nAccept: text/html\r\n\r\n"))
+        goto fail;
+    if (memcmp(set.arena + set.entries[1].offset + set.entries[1].length,
+            "POST /b?x=1 HTTP/1.1\r\nHost: example\r\nCookie: c=1\r\n\r\n", set.entries[1].length) != 0)
+        goto fail;
+    if (set.arena_length != 2 * (set.entries[0].length + set.entries[1].length))
+        goto fail;
+
+    /* Three to one */
+    util_rand_seed(&r, "requests", 8);
+    for (i = 0; i < 4000; i++)
+        counts[requests_choose(&set, &r)]++;
+    if (counts[0] < 2800 || counts[0] > 3200)
+        goto fail;
+
+    for (i = 0; i < set.count; i++)
+        free(set.entries[i].name);
+    free(set.entries);
+    util_dist_free(&set.choice);
+    free(set.arena);
+
+    /* These are all errors */
+    for (i = 0; bad[i]; i++) {
+        char *second;
+        int err;
+
+        memset(&set, 0, sizeof(set));
+        snprintf(line, sizeof(line), "%s", bad[i]);
+        second = strchr(line, '\n');
+        if (second)
+            *second++ = '\0';
+        err = _requests_line(&set, line, (const unsigned char *)base, sizeof(base) - 1);
+        if (err == 0 && second)
+            err = _requests_line(&set, second, (const unsigned char *)base, sizeof(base) - 1);
+        if (set.count) {
+            free(set.entries[0].name);
+            free(set.entries[0].request);
+            free(set.entries);
+        }
+        if (err == 0) {
+            fprintf(stderr, "[-] requests: accepted: %s\n", bad[i]);
+            goto fail;
+        }
+    }
+
+    return 0;
+fail:
+    fprintf(stderr, "[-] requests: programming error\n");
+    return 1;
+}
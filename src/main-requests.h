@@ -0,0 +1,107 @@
+/*
+    Request sets
+
+ Normally every request is the same one, built from the URL and any
+ --http-xxx options. With --requests FILE, each request is chosen at
+ random from a list in the file, according to their weights:
+
+    # WEIGHT  METHOD  PATH
+    10  GET   /
+    5   GET   /search?q=cats
+        Accept: application/json
+    1   POST  /login
+        Cookie: session=1234
+
+ The weight is optional, defaulting to 1. Indented lines add (or
+ change) header fields in the request above them. Every request starts
+ from the one built from the command-line, so they all have its Host
+ and any other fields from --http-xxx. They can also have
+ {{placeholders}}, as described in main-template.h.
+
+ The requests are built once at startup, then copied into a single
+ arena, --pipeline copies of each back-to-back, so that sending one
+ is only a matter of pointing at it, the same as with a single
+ request. With --pipeline, each batch is several copies of the same
+ request.
+
+ Each worker counts the responses and their latency for each request,
+ which the main thread sums to show which requests limit the rate.
+ */
+#ifndef MAIN_REQUESTS_H
+#define MAIN_REQUESTS_H
+#include "util-hdr.h"
+#include "util-rand.h"
+#include "main-template.h"
+#include "util-dist.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct request_entry_t {
+    /* Like "GET /search?q=cats", for reports */
+    char *name;
+
+    unsigned weight;
+
+    /* A HEAD request, whose responses have no content */
+    bool is_head;
+
+    /* Where the --pipeline copies are in the arena, and the length
+     * of a single copy */
+    size_t offset;
+    size_t length;
+
+    /* If it has {{placeholders}}, which are filled in for each one
+     * we send, rather than sending the copies in the arena */
+    template_t *template;
+
+    /* The request while we're building it, before it goes into
+     * the arena */
+    unsigned char *request;
+} request_entry_t;
+
+typedef struct request_set_t {
+    request_entry_t *entries;
+    size_t count;
+
+    /* For choosing one by weight */
+    util_dist_t choice;
+    uint64_t total_weight;
+
+    unsigned char *arena;
+    size_t arena_length;
+} request_set_t;
+
+/**
+ * Each worker's counts for one of the requests
+ */
+typedef struct request_stats_t {
+    uint64_t responses;
+
+    /* Responses that weren't 2xx or 3xx, and requests that never got
+     * one, because their connection timed out or failed */
+    uint64_t failures;
+
+    util_hdr_t latency;
+} request_stats_t;
+
+/**
+ * Read the requests from the file, building each one from the
+ * 'base' request, and copying them into the arena. It's fatal if the
+ * file can't be read or has errors.
+ */
+request_set_t *
+requests_read(const char *filename, const unsigned char *base, size_t base_length, unsigned pipeline);
+
+/**
+ * Choose one of the requests at random, by weight.
+ * @return
+ *      the index of the request in `set->entries`.
+ */
+unsigned
+requests_choose(const request_set_t *set, util_rand_t *r);
+
+int
+requests_selftest(void);
+
+#endif
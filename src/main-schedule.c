@@ -0,0 +1,276 @@
+#include "main-schedule.h"
+#include "util-time.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SCHEDULE_MAX_FIELDS 4
+
+/*
+ * Parse a value, or a range of values like "100-1000", either of which
+ * may have "/s" after it to make it a rate.
+ * @return
+ *      the number of values (1 or 2), or 0 if it's not valid.
+ */
+static int
+_parse_range(const char *str, double *r_from, double *r_to, unsigned *r_kind) {
+    char *end = NULL;
+    int count = 1;
+
+    *r_kind = SCHEDULE_CONNECTIONS;
+    *r_from = strtod(str, &end);
+    if (end == str)
+        return 0;
+    if (strncmp(end, "/s", 2) == 0) {
+        *r_kind = SCHEDULE_RATE;
+        end += 2;
+    }
+    *r_to = *r_from;
+
+    if (*end == '-') {
+        str = end + 1;
+        *r_to = strtod(str, &end);
+        if (end == str)
+            return 0;
+        if (strncmp(end, "/s", 2) == 0) {
+            *r_kind = SCHEDULE_RATE;
+            end += 2;
+        }
+        count = 2;
+    }
+
+    if (*end != '\0' || *r_from < 0.0 || *r_to < 0.0)
+        return 0;
+    return count;
+}
+
+static void
+_phase_add(schedule_t *schedule, const char *name, double from, double to, double duration) {
+    schedule_phase_t *phase;
+
+    schedule->phases = realloc(schedule->phases, (schedule->count + 1) * sizeof(*schedule->phases));
+    if (schedule->phases == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    phase = &schedule->phases[schedule->count++];
+    phase->name = name;
+    phase->from = from;
+    phase->to = to;
+    phase->start = schedule->duration;
+    phase->duration = duration;
+
+    schedule->duration += duration;
+    if (schedule->max < from)
+        schedule->max = from;
+    if (schedule->max < to)
+        schedule->max = to;
+}
+
+/*
+ * Parse one segment, which has had its fields split apart at the
+ * colons, adding its phases to the schedule.
+ * @return
+ *      0 on success, -1 if it's not valid, or -2 if it's a different
+ *      kind from the segments before it.
+ */
+static int
+_parse_segment(schedule_t *schedule, char **fields, size_t field_count) {
+    const char *type = fields[0];
+    double from;
+    double to;
+    double by = 0.0;
+    double duration;
+    unsigned kind;
+    int range_count;
+
+    if (field_count < 3)
+        return -1;
+    range_count = _parse_range(fields[1], &from, &to, &kind);
+    if (range_count == 0)
+        return -1;
+    duration = util_parse_seconds(fields[field_count - 1]);
+    if (!(duration > 0.0))
+        return -1;
+
+    /* All the segments must be the same kind */
+    if (schedule->count == 0)
+        schedule->kind = kind;
+    else if (schedule->kind != kind)
+        return -2;
+
+    if (strcmp(type, "hold") == 0 || strcmp(type, "spike") == 0) {
+        if (range_count != 1 || field_count != 3)
+            return -1;
+        _phase_add(schedule, (type[0] == 'h') ? "hold" : "spike", from, from, duration);
+    } else if (strcmp(type, "ramp") == 0) {
+        if (field_count != 3)
+            return -1;
+
+        /* With only one value, carry on from where we were */
+        if (range_count == 1) {
+            from = schedule->count ? schedule->phases[schedule->count - 1].to : 0.0;
+        }
+        _phase_add(schedule, "ramp", from, to, duration);
+    } else if (strcmp(type, "step") == 0) {
+        double value;
+        double direction;
+
+        if (range_count != 2 || field_count != 4)
+            return -1;
+        by = strtod(fields[2], NULL);
+        if (!(by > 0.0))
+            return -1;
+
+        /* Include the last step, even if it's not a whole BY away */
+        direction = (to >= from) ? 1.0 : -1.0;
+        for (value = from; (to - value) * direction > 1e-9; value += by * direction)
+            _phase_add(schedule, "step", value, value, duration);
+        _phase_add(schedule, "step", to, to, duration);
+    } else
+        return -1;
+
+    return 0;
+}
+
+/*
+ * The selftest uses this to parse bad schedules without printing
+ * the error messages.
+ */
+static int
+_schedule_parse(schedule_t *schedule, const char *spec, int is_verbose) {
+    char *copy = strdup(spec);
+    char *segment = copy;
+
+    while (segment && *segment) {
+        char *fields[SCHEDULE_MAX_FIELDS];
+        size_t field_count = 0;
+        char *next = strchr(segment, ',');
+        char *field = segment;
+        int err;
+
+        if (next)
+            *next++ = '\0';
+
+        /* Split it apart at the colons */
+        while (field && field_count < SCHEDULE_MAX_FIELDS) {
+            fields[field_count++] = field;
+            field = strchr(field, ':');
+            if (field)
+                *field++ = '\0';
+        }
+
+        err = field ? -1 : _parse_segment(schedule, fields, field_count);
+        if (err && is_verbose) {
+            if (err == -2)
+                fprintf(stderr, "[-] schedule: can't mix connections and rates\n");
+            else
+                fprintf(stderr, "[-] schedule: bad segment: %s\n", fields[0]);
+        }
+        if (err) {
+            free(copy);
+            return -1;
+        }
+        segment = next;
+    }
+
+    free(copy);
+    return 0;
+}
+
+int
+schedule_parse(schedule_t *schedule, const char *spec) {
+    return _schedule_parse(schedule, spec, 1);
+}
+
+size_t
+schedule_phase(const schedule_t *schedule, double elapsed) {
+    size_t i;
+
+    for (i = 0; i < schedule->count; i++) {
+        const schedule_phase_t *phase = &schedule->phases[i];
+        if (elapsed < phase->start + phase->duration)
+            return i;
+    }
+    return schedule->count;
+}
+
+double
+schedule_value(const schedule_t *schedule, double elapsed) {
+    const schedule_phase_t *phase;
+    size_t i;
+
+    if (schedule->count == 0)
+        return 0.0;
+    i = schedule_phase(schedule, elapsed);
+    if (i >= schedule->count)
+        return schedule->phases[schedule->count - 1].to;
+
+    phase = &schedule->phases[i];
+    if (elapsed <= phase->start)
+        return phase->from;
+    return phase->from + (phase->to - phase->from) * (elapsed - phase->start) / phase->duration;
+}
+
+int
+schedule_selftest(void) {
+    schedule_t schedule;
+    static const char *bad[] = {
+        "hold:100", "hold:100:0s", "ramp:x:10s", "step:100:10:1s",
+        "step:100-200:0:1s", "hold:100:1s:1s", "jump:100:1s",
+        "hold:100:1s,hold:100/s:1s", 0};
+    size_t i;
+
+    memset(&schedule, 0, sizeof(schedule));
+    if (schedule_parse(&schedule, "ramp:100:10s,step:100-300:100:5s") != 0)
+        goto fail;
+    if (schedule_parse(&schedule, "spike:1000:1s,ramp:0:4s") != 0)
+        goto fail;
+
+    /* ramp, three steps, spike, ramp */
+    if (schedule.count != 6 || schedule.duration != 30.0 || schedule.max != 1000.0)
+        goto fail;
+    if (schedule.kind != SCHEDULE_CONNECTIONS)
+        goto fail;
+    if (schedule_value(&schedule, 0.0) != 0.0 || schedule_value(&schedule, 5.0) != 50.0)
+        goto fail;
+    if (schedule_phase(&schedule, 12.0) != 1 || schedule_value(&schedule, 12.0) != 100.0)
+        goto fail;
+    if (schedule_phase(&schedule, 20.0) != 3 || schedule_value(&schedule, 24.9) != 300.0)
+        goto fail;
+    if (schedule_value(&schedule, 25.5) != 1000.0)
+        goto fail;
+    if (schedule_value(&schedule, 28.0) != 500.0)
+        goto fail;
+    if (schedule_phase(&schedule, 30.0) != 6 || schedule_value(&schedule, 99.0) != 0.0)
+        goto fail;
+    free(schedule.phases);
+
+    /* Rates, and steps that don't divide evenly, going down */
+    memset(&schedule, 0, sizeof(schedule));
+    if (schedule_parse(&schedule, "step:250/s-100/s:100:1m") != 0)
+        goto fail;
+    if (schedule.kind != SCHEDULE_RATE || schedule.count != 3 || schedule.duration != 180.0)
+        goto fail;
+    if (schedule.phases[1].from != 150.0 || schedule.phases[2].to != 100.0)
+        goto fail;
+    free(schedule.phases);
+
+    /* These are all errors */
+    for (i = 0; bad[i]; i++) {
+        int err;
+
+        memset(&schedule, 0, sizeof(schedule));
+        err = _schedule_parse(&schedule, bad[i], 0);
+        free(schedule.phases);
+        if (err == 0) {
+            fprintf(stderr, "[-] schedule: accepted: %s\n", bad[i]);
+            goto fail;
+        }
+    }
+
+    return 0;
+fail:
+    fprintf(stderr, "[-] schedule: programming error\n");
+    return 1;
+}
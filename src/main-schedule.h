@@ -0,0 +1,82 @@
+/*
+    Load schedules
+
+ With --schedule, the load changes over time, rather than being the
+ single -c or --rate for the whole run. The schedule is a list of
+ segments, separated by commas, or given in several --schedule
+ options (or `schedule = ` lines in a --conf file):
+
+    hold:VALUE:TIME         stay at VALUE for TIME
+    ramp:[FROM-]TO:TIME     change linearly from FROM (or from where
+                            the last segment left off) to TO
+    step:FROM-TO:BY:TIME    a staircase from FROM to TO, going up (or
+                            down) BY at a time, holding each for TIME
+    spike:VALUE:TIME        jump straight to VALUE for TIME
+
+ A VALUE is a number of connections, like "500", or with "/s", a
+ request rate, like "2000/s", which means an open-loop (--rate) run.
+ All the segments must be the same kind. For example:
+
+    --schedule step:100-1000/s:100:30s,spike:5000/s:5s,hold:100/s:30s
+
+ Each hold, step, spike, and ramp becomes a phase, and the final
+ report shows the throughput and latency for each one. Every worker
+ follows the schedule on its own, from the same start time, taking
+ its share of the value, so nothing is shared between them.
+ */
+#ifndef MAIN_SCHEDULE_H
+#define MAIN_SCHEDULE_H
+#include <stddef.h>
+
+/* What the schedule's values are */
+enum {SCHEDULE_CONNECTIONS, SCHEDULE_RATE};
+
+typedef struct schedule_phase_t {
+    const char *name; /* "hold", "ramp", "step", or "spike" */
+    double from;
+    double to;
+
+    /* When the phase starts (seconds from the start of the run),
+     * and how long it lasts */
+    double start;
+    double duration;
+} schedule_phase_t;
+
+typedef struct schedule_t {
+    unsigned kind;
+    schedule_phase_t *phases;
+    size_t count;
+
+    /* The total length of the schedule (seconds), and the largest
+     * value in it, which is what we size things for */
+    double duration;
+    double max;
+} schedule_t;
+
+/**
+ * Parse the segments in 'spec', adding them to the end of the
+ * schedule, which starts out zeroed.
+ * @return
+ *      0 on success, or -1 if it's not valid, after printing why.
+ */
+int
+schedule_parse(schedule_t *schedule, const char *spec);
+
+/**
+ * Which phase we're in at 'elapsed' seconds from the start of the run,
+ * or `schedule->count` once it's over.
+ */
+size_t
+schedule_phase(const schedule_t *schedule, double elapsed);
+
+/**
+ * The value (connections, or requests per second) at 'elapsed' seconds
+ * from the start of the run. After the end, it's the last value.
+ */
+double
+schedule_value(const schedule_t *schedule, double elapsed);
+
+int
+schedule_selftest(void);
+
+#endif
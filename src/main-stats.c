@@ -0,0 +1,164 @@
+#include "main-stats.h"
+#include "util-time.h"
+#include <math.h>
+#include <stddef.h>
+
+unsigned
+stats_errno_index(int error) {
+#ifdef _WIN32
+    if (error >= 10000)
+        error -= 10000;
+#endif
+    if (error < 0 || error >= STATS_ERRNO_MAX)
+        return STATS_ERRNO_MAX - 1;
+    return (unsigned)error;
+}
+
+int
+stats_errno_value(unsigned index) {
+#ifdef _WIN32
+    return (int)index + 10000;
+#else
+    return (int)index;
+#endif
+}
+
+unsigned
+stats_status_index(unsigned code) {
+    if (code < 100 || code >= STATS_STATUS_MAX)
+        return 0;
+    return code;
+}
+
+void
+stats_status_record(statistics_t *stats, unsigned code, uint64_t latency) {
+    unsigned index = stats_status_index(code);
+    unsigned klass = index / 100;
+
+    switch (klass) {
+        case 1: stats->http.n100.total++; break;
+        case 2: stats->http.n200.total++; break;
+        case 3: stats->http.n300.total++; break;
+        case 4: stats->http.n400.total++; break;
+        case 5: stats->http.n500.total++; break;
+        default: stats->http.nother.total++; break;
+    }
+    stats->status[index].total++;
+    util_hdr_record(&stats->latency.classes[klass], latency);
+}
+
+const char *
+stats_class_name(unsigned klass) {
+    static const char *names[STATS_CLASS_MAX] = {"other", "1xx", "2xx", "3xx", "4xx", "5xx"};
+
+    if (klass >= STATS_CLASS_MAX)
+        return names[0];
+    return names[klass];
+}
+
+#define STATS_COUNTER(name) {#name, offsetof(statistics_t, name)}
+static const struct {
+    const char *name;
+    size_t offset;
+} stats_counters[] = {
+    STATS_COUNTER(con.attempted),
+    STATS_COUNTER(con.failed),
+    STATS_COUNTER(con.succeeded),
+    STATS_COUNTER(con.error),
+    STATS_COUNTER(con.read),
+    STATS_COUNTER(con.hangup),
+    STATS_COUNTER(con.hangup2),
+    STATS_COUNTER(con.pipeline),
+    STATS_COUNTER(con.unknown),
+    STATS_COUNTER(con.timeout_connect),
+    STATS_COUNTER(con.timeout_first_byte),
+    STATS_COUNTER(con.timeout_response),
+    STATS_COUNTER(http.sent),
+    STATS_COUNTER(http.recved),
+    STATS_COUNTER(http.n100),
+    STATS_COUNTER(http.n200),
+    STATS_COUNTER(http.n300),
+    STATS_COUNTER(http.n400),
+    STATS_COUNTER(http.n500),
+    STATS_COUNTER(http.nother),
+};
+
+const char *
+stats_counter_name(const statistics_t *stats, size_t index, const counter_t **r_counter) {
+    if (index >= sizeof(stats_counters)/sizeof(stats_counters[0]))
+        return NULL;
+    *r_counter = (const counter_t *)((const char *)stats + stats_counters[index].offset);
+    return stats_counters[index].name;
+}
+
+void
+stats_clear(statistics_t *sum) {
+    counter_t *c;
+    size_t i;
+
+    for (c = &sum->first; c < &sum->last; c++)
+        c->total = 0;
+    util_hdr_clear(&sum->latency.connect);
+    util_hdr_clear(&sum->latency.first_byte);
+    util_hdr_clear(&sum->latency.response);
+    for (i = 0; i < STATS_CLASS_MAX; i++)
+        util_hdr_clear(&sum->latency.classes[i]);
+}
+
+void
+stats_add(statistics_t *sum, const statistics_t *stats) {
+    counter_t *c;
+    const counter_t *src = &stats->first;
+    size_t i;
+
+    for (c = &sum->first; c < &sum->last; c++, src++)
+        c->total += src->total;
+
+    util_hdr_add(&sum->latency.connect, &stats->latency.connect);
+    util_hdr_add(&sum->latency.first_byte, &stats->latency.first_byte);
+    util_hdr_add(&sum->latency.response, &stats->latency.response);
+    for (i = 0; i < STATS_CLASS_MAX; i++)
+        util_hdr_add(&sum->latency.classes[i], &stats->latency.classes[i]);
+}
+
+void
+stats_subtract(statistics_t *stats, const statistics_t *before) {
+    counter_t *c;
+    const counter_t *src = &before->first;
+    size_t i;
+
+    for (c = &stats->first; c < &stats->last; c++, src++)
+        c->total -= src->total;
+
+    util_hdr_subtract(&stats->latency.connect, &before->latency.connect);
+    util_hdr_subtract(&stats->latency.first_byte, &before->latency.first_byte);
+    util_hdr_subtract(&stats->latency.response, &before->latency.response);
+    for (i = 0; i < STATS_CLASS_MAX; i++)
+        util_hdr_subtract(&stats->latency.classes[i], &before->latency.classes[i]);
+}
+
+void
+stats_calculate_rates(statistics_t *stats) {
+    uint64_t now;
+    uint64_t elapsed;
+    struct timespec ts;
+    counter_t *c;
+
+    /* get the current time in nanoseconds, plus the elapsed
+     *time */
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    elapsed = now - stats->last_time;
+    stats->last_time = now;
+    if (elapsed == 0)
+        return;
+
+    /* Do the tate calculation for all the counters */
+
+    for (c = &stats->first; c < &stats->last; c++) {
+        uint64_t diff = c->total - c->last;
+        uint64_t rate = diff * 1000000000ULL / elapsed;
+        c->rate = (uint64_t)floor(c->rate * 0.9 + rate * 0.1);
+        c->last = c->total;
+    }
+}
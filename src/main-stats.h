@@ -0,0 +1,167 @@
+/*
+    Statistics counters
+
+ Each worker thread has its own set of counters that only it
+ increments, so there's no locking or atomic instructions in the
+ hot path. The main thread periodically sums them together in
+ order to display them.
+ */
+#ifndef MAIN_STATS_H
+#define MAIN_STATS_H
+#include <stdint.h>
+#include <stddef.h>
+#include "util-hdr.h"
+
+/* The number of distinct errno values we count, anything larger is
+ * counted in the last one */
+#define STATS_ERRNO_MAX 256
+
+/* The status codes we count one by one, 100 through 599, with any
+ * other code counted at 0, see `stats_status_index()` */
+#define STATS_STATUS_MAX 600
+
+/* The status classes, 1xx through 5xx, with 0 for anything else */
+#define STATS_CLASS_MAX 6
+
+typedef struct counter_t {
+    uint64_t total;
+    uint64_t last;
+    uint64_t rate;
+} counter_t;
+
+/**
+ * All the counters must be between 'first' and 'last', as we
+ * enumerate them as an array when calculating rates and summing
+ * workers.
+ */
+typedef struct statistics_t {
+    counter_t first;
+    struct {
+        counter_t attempted;
+        counter_t failed;
+        counter_t succeeded;
+        counter_t error;
+        counter_t read;
+        counter_t hangup;
+        counter_t hangup2;
+        counter_t pipeline;
+        counter_t unknown;
+        counter_t timeout_connect;
+        counter_t timeout_first_byte;
+        counter_t timeout_response;
+    } con;
+    struct {
+        counter_t sent;
+        counter_t recved;
+        counter_t n100;
+        counter_t n200;
+        counter_t n300;
+        counter_t n400;
+        counter_t n500;
+        counter_t nother;
+    } http;
+
+    /* Socket errors, counted by errno, see `stats_errno_index()` */
+    counter_t errors[STATS_ERRNO_MAX];
+
+    /* Responses, counted by status code, see `stats_status_index()` */
+    counter_t status[STATS_STATUS_MAX];
+
+    counter_t last;
+
+    /* Latency histograms (nanoseconds). The time to first byte is
+     * from when the request was fully sent. The response time is
+     * from when the request was supposed to be sent, not when it
+     * actually was: with --rate, that includes any time spent waiting
+     * for a free connection, so slow responses aren't hidden
+     * (coordinated omission). */
+    struct {
+        util_hdr_t connect;
+        util_hdr_t first_byte;
+        util_hdr_t response;
+
+        /* The response time again, split by status class, so that
+         * fast errors can be told apart from real successes. It's by
+         * class rather than by code, as each histogram is 35KB, and
+         * there's a copy of this for each worker and each interval;
+         * the codes themselves are counted in `status[]` above */
+        util_hdr_t classes[STATS_CLASS_MAX];
+    } latency;
+
+    /* The timestamp (nanoseconds) of the last time we calculated
+     * the rates */
+    uint64_t last_time;
+} statistics_t;
+
+/**
+ * Where in the `errors[]` array to count this socket error. On Windows,
+ * the WSAxxxx errors start at 10000, so they are counted 10000 lower.
+ */
+unsigned
+stats_errno_index(int error);
+
+/**
+ * The reverse of `stats_errno_index()`, the error that's counted
+ * at this index.
+ */
+int
+stats_errno_value(unsigned index);
+
+/**
+ * Where in the `status[]` array to count this response's status code,
+ * which is 0 for codes outside 100 through 599.
+ */
+unsigned
+stats_status_index(unsigned code);
+
+/**
+ * Count one response, with the given status code and response time
+ * (nanoseconds), by its class and by its code.
+ */
+void
+stats_status_record(statistics_t *stats, unsigned code, uint64_t latency);
+
+/**
+ * The name of a status class, like "2xx", or "other" for 0.
+ */
+const char *
+stats_class_name(unsigned klass);
+
+/**
+ * Enumerate the named counters (all but the errors), for writing them
+ * out. This gets the 'index' one, with a name like "con.attempted".
+ * @return
+ *      the name of the counter, or NULL past the end.
+ */
+const char *
+stats_counter_name(const statistics_t *stats, size_t index, const counter_t **r_counter);
+
+/**
+ * Zero out the 'total' of each counter, and the histograms, before
+ * summing the workers with `stats_add()`. The other fields are left
+ * alone, so that rates can be calculated from one call to the next.
+ */
+void
+stats_clear(statistics_t *sum);
+
+/**
+ * Add the totals from one worker's 'stats' into the 'sum'.
+ */
+void
+stats_add(statistics_t *sum, const statistics_t *stats);
+
+/**
+ * Subtract an earlier snapshot of the same totals, leaving what was
+ * counted since, such as during one phase of a --schedule.
+ */
+void
+stats_subtract(statistics_t *stats, const statistics_t *before);
+
+/**
+ * Update the 'rate' of each counter since the last time this
+ * function was called.
+ */
+void
+stats_calculate_rates(statistics_t *stats);
+
+#endif
@@ -0,0 +1,490 @@
+#include "main-template.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+
+/* The longest placeholder, between the braces */
+#define TEMPLATE_FIELD_MAX 1024
+
+/* The most values a {{zipf}} can have, as each takes 8 bytes of its
+ * alias table */
+#define TEMPLATE_ZIPF_MAX (16 * 1024 * 1024)
+
+/* The most digits a number can have */
+#define TEMPLATE_DIGITS_MAX 20
+
+static void *
+_template_realloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (p == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * Parse a number that must take up all of the string
+ */
+static int
+_parse_u64(const char *s, uint64_t *r_value) {
+    char *end = NULL;
+
+    if (!isdigit((unsigned char)*s))
+        return -1;
+    errno = 0;
+    *r_value = strtoull(s, &end, 10);
+    if (errno || *end != '\0')
+        return -1;
+    return 0;
+}
+
+/*
+ * Read the lines of the file, skipping blank ones, to choose from
+ * uniformly
+ */
+static int
+_words_read(template_field_t *field, const char *filename) {
+    char line[TEMPLATE_FIELD_MAX];
+    size_t length = 0;
+    size_t count = 0;
+    FILE *fp;
+
+    fp = fopen(filename, "rt");
+    if (fp == NULL) {
+        fprintf(stderr, "[-] template: %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    field->word_offsets = _template_realloc(NULL, sizeof(*field->word_offsets));
+    field->word_offsets[0] = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        size_t word_length = strlen(line);
+
+        while (word_length && isspace((unsigned char)line[word_length - 1]))
+            word_length--;
+        if (word_length == 0)
+            continue;
+
+        field->words = _template_realloc(field->words, length + word_length);
+        memcpy(field->words + length, line, word_length);
+        length += word_length;
+
+        count++;
+        field->word_offsets = _template_realloc(field->word_offsets, (count + 1) * sizeof(*field->word_offsets));
+        field->word_offsets[count] = length;
+    }
+    fclose(fp);
+
+    if (count == 0) {
+        fprintf(stderr, "[-] template: %s: no words\n", filename);
+        return -1;
+    }
+    util_dist_uniform(&field->dist, count);
+    return 0;
+}
+
+/*
+ * Parse a percentage, from 0 to 100, as a fraction
+ */
+static int
+_parse_percent(const char *s, double *r_value) {
+    char *end = NULL;
+
+    *r_value = strtod(s, &end) / 100.0;
+    if (end == s || *end != '\0' || !(*r_value >= 0.0 && *r_value <= 1.0))
+        return -1;
+    return 0;
+}
+
+/*
+ * Parse what's between the braces, like "random:1-100"
+ * @return
+ *      0 on success, or -1 if it's not valid.
+ */
+static int
+_template_field(template_field_t *field, const char *spec) {
+    char buf[TEMPLATE_FIELD_MAX];
+    char *args;
+    char *arg2;
+    uint64_t count;
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    args = strchr(buf, ':');
+    if (args)
+        *args++ = '\0';
+
+    if (strcmp(buf, "random") == 0) {
+        uint64_t last;
+
+        field->kind = TEMPLATE_NUMBER;
+        arg2 = args ? strchr(args, '-') : NULL;
+        if (arg2 == NULL)
+            return -1;
+        *arg2++ = '\0';
+        if (_parse_u64(args, &field->first) || _parse_u64(arg2, &last))
+            return -1;
+        if (last < field->first || last - field->first == UINT64_MAX)
+            return -1;
+        util_dist_uniform(&field->dist, last - field->first + 1);
+        return 0;
+    }
+
+    /* The others are all from 1 to N */
+    field->kind = TEMPLATE_NUMBER;
+    field->first = 1;
+    arg2 = args ? strchr(args, ':') : NULL;
+    if (arg2)
+        *arg2++ = '\0';
+    if (args == NULL || _parse_u64(args, &count) || count == 0)
+        count = 0;
+
+    if (strcmp(buf, "zipf") == 0) {
+        double s = 1.0;
+
+        if (arg2) {
+            char *end = NULL;
+
+            s = strtod(arg2, &end);
+            if (end == arg2 || *end != '\0' || !(s > 0.0) || s > 100.0)
+                return -1;
+        }
+        if (count == 0 || count > TEMPLATE_ZIPF_MAX)
+            return -1;
+        return util_dist_zipf(&field->dist, count, s);
+    }
+
+    if (strcmp(buf, "hotspot") == 0) {
+        char *arg3 = arg2 ? strchr(arg2, ':') : NULL;
+        double traffic;
+        double keys;
+
+        if (count == 0 || arg3 == NULL)
+            return -1;
+        *arg3++ = '\0';
+        if (_parse_percent(arg2, &traffic) || _parse_percent(arg3, &keys))
+            return -1;
+        return util_dist_hotspot(&field->dist, count, traffic, keys);
+    }
+
+    if (strcmp(buf, "scan") == 0) {
+        if (count == 0 || arg2)
+            return -1;
+        util_dist_scan(&field->dist, count);
+        return 0;
+    }
+
+    if (strcmp(buf, "seq") == 0) {
+        field->kind = TEMPLATE_SEQUENCE;
+        if (arg2)
+            return -1;
+        if (args && _parse_u64(args, &field->first))
+            return -1;
+        return 0;
+    }
+
+    if (strcmp(buf, "words") == 0) {
+        field->kind = TEMPLATE_WORDS;
+        field->first = 0;
+        if (args == NULL || *args == '\0')
+            return -1;
+        if (arg2)
+            arg2[-1] = ':';
+        return _words_read(field, args);
+    }
+
+    return -1;
+}
+
+/*
+ * The most bytes the field's value can take
+ */
+static size_t
+_field_max_length(const template_field_t *field) {
+    size_t max = 0;
+    uint64_t i;
+
+    if (field->kind != TEMPLATE_WORDS)
+        return TEMPLATE_DIGITS_MAX;
+    for (i = 0; i < field->dist.count; i++) {
+        size_t length = field->word_offsets[i + 1] - field->word_offsets[i];
+        if (max < length)
+            max = length;
+    }
+    return max;
+}
+
+/*
+ * Parse the request into its literal text and fields.
+ * @return
+ *      0 on success, or -1 if a placeholder isn't valid, in which case
+ *      '*r_bad' is where it starts.
+ */
+static int
+_template_parse(template_t *t, const unsigned char *request, size_t length, size_t *r_bad) {
+    size_t offset = 0;
+    size_t literal_offset = 0;
+
+    *r_bad = 0;
+    memset(t, 0, sizeof(*t));
+    t->text = _template_realloc(NULL, length + 1);
+    memcpy(t->text, request, length);
+    t->text[length] = '\0';
+    t->length = length;
+
+    while (offset + 1 < length) {
+        template_field_t *field;
+        char spec[TEMPLATE_FIELD_MAX];
+        size_t end;
+
+        if (request[offset] != '{' || request[offset + 1] != '{') {
+            offset++;
+            continue;
+        }
+
+        /* Find the closing braces, which must be on the same line */
+        for (end = offset + 2; end + 1 < length; end++) {
+            if (request[end] == '}' && request[end + 1] == '}')
+                break;
+            if (request[end] == '\r' || request[end] == '\n')
+                break;
+        }
+        *r_bad = offset;
+        if (end + 1 >= length || request[end] != '}' || end - offset - 2 >= sizeof(spec))
+            return -1;
+        memcpy(spec, request + offset + 2, end - offset - 2);
+        spec[end - offset - 2] = '\0';
+
+        t->fields = _template_realloc(t->fields, (t->field_count + 1) * sizeof(*t->fields));
+        field = &t->fields[t->field_count++];
+        memset(field, 0, sizeof(*field));
+        field->literal_offset = literal_offset;
+        field->literal_length = offset - literal_offset;
+        if (_template_field(field, spec) != 0)
+            return -1;
+
+        t->max_length += field->literal_length + _field_max_length(field);
+        offset = end + 2;
+        literal_offset = offset;
+    }
+
+    t->tail_offset = literal_offset;
+    t->max_length += length - literal_offset;
+    return 0;
+}
+
+static void
+_template_free(template_t *t) {
+    size_t i;
+
+    for (i = 0; i < t->field_count; i++) {
+        util_dist_free(&t->fields[i].dist);
+        free(t->fields[i].words);
+        free(t->fields[i].word_offsets);
+    }
+    free(t->fields);
+    free(t->text);
+}
+
+template_t *
+template_compile(const unsigned char *request, size_t length) {
+    template_t *t;
+    size_t bad = 0;
+
+    t = _template_realloc(NULL, sizeof(*t));
+    if (_template_parse(t, request, length, &bad) != 0) {
+        size_t end = bad;
+
+        while (end < length && request[end] != '\r' && request[end] != '\n' && request[end] != ' ')
+            end++;
+        fprintf(stderr, "[-] template: bad placeholder: %.*s\n", (int)(end - bad), request + bad);
+        fprintf(stderr, "[-] template: expected {{random:LOW-HIGH}}, {{zipf:N[:S]}}, "
+            "{{hotspot:N:X:Y}}, {{scan:N}}, {{seq[:START]}}, or {{words:FILE}}\n");
+        exit(1);
+    }
+    if (t->field_count == 0) {
+        _template_free(t);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+/*
+ * Write out the number in decimal
+ */
+static unsigned char *
+_put_number(unsigned char *p, uint64_t value) {
+    unsigned char digits[TEMPLATE_DIGITS_MAX];
+    size_t count = 0;
+
+    do {
+        digits[TEMPLATE_DIGITS_MAX - ++count] = (unsigned char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    memcpy(p, digits + TEMPLATE_DIGITS_MAX - count, count);
+    return p + count;
+}
+
+size_t
+template_expand(const template_t *t, unsigned char *buf, util_rand_t *r, uint64_t sequence) {
+    unsigned char *p = buf;
+    size_t i;
+
+    for (i = 0; i < t->field_count; i++) {
+        const template_field_t *field = &t->fields[i];
+
+        memcpy(p, t->text + field->literal_offset, field->literal_length);
+        p += field->literal_length;
+
+        switch (field->kind) {
+        case TEMPLATE_NUMBER:
+            p = _put_number(p, field->first + util_dist_next(&field->dist, r, sequence));
+            break;
+        case TEMPLATE_SEQUENCE:
+            p = _put_number(p, field->first + sequence);
+            break;
+        case TEMPLATE_WORDS: {
+            uint64_t id = util_dist_next(&field->dist, r, sequence);
+            size_t length = field->word_offsets[id + 1] - field->word_offsets[id];
+
+            memcpy(p, field->words + field->word_offsets[id], length);
+            p += length;
+            break;
+        }
+        }
+    }
+
+    memcpy(p, t->text + t->tail_offset, t->length - t->tail_offset);
+    p += t->length - t->tail_offset;
+    return p - buf;
+}
+
+int
+template_selftest(void) {
+    static const char request[] = "GET /a/{{random:5-7}}/{{seq:100}}?k={{zipf:10:1.2}} HTTP/1.1\r\n"
+        "Host: {{seq}}\r\n\r\n";
+    static const char *bad[] = {
+        "GET /{{random:7-5}} HTTP/1.1\r\n\r\n",
+        "GET /{{random:1}} HTTP/1.1\r\n\r\n",
+        "GET /{{zipf:0}} HTTP/1.1\r\n\r\n",
+        "GET /{{zipf:10:-1}} HTTP/1.1\r\n\r\n",
+        "GET /{{seq:x}} HTTP/1.1\r\n\r\n",
+        "GET /{{scan:3:1}} HTTP/1.1\r\n\r\n",
+        "GET /{{hotspot:10:90}} HTTP/1.1\r\n\r\n",
+        "GET /{{hotspot:10:190:10}} HTTP/1.1\r\n\r\n",
+        "GET /{{nothing}} HTTP/1.1\r\n\r\n",
+        "GET /{{random:1-2 HTTP/1.1\r\n}}\r\n",
+        0};
+    unsigned counts[10] = {0};
+    unsigned char buf[256];
+    template_t t;
+    util_rand_t r;
+    size_t bad_offset;
+    size_t length;
+    size_t i;
+
+    if (_template_parse(&t, (const unsigned char *)request, sizeof(request) - 1, &bad_offset) != 0)
+        goto fail;
+    if (t.field_count != 4 || t.max_length != sizeof(request) - 1 - 47 + 4 * TEMPLATE_DIGITS_MAX)
+        goto fail;
+
+    util_rand_seed(&r, "template", 8);
+    for (i = 0; i < 10000; i++) {
+        unsigned value;
+        unsigned rank;
+        unsigned sequence;
+        unsigned host;
+        int n;
+
+        length = template_expand(&t, buf, &r, 3);
+        buf[length] = '\0';
+        if (length > t.max_length)
+            goto fail;
+        n = sscanf((char *)buf, "GET /a/%u/%u?k=%u HTTP/1.1\r\nHost: %u\r\n\r\n", &value, &sequence, &rank, &host);
+        if (n != 4 || value < 5 || value > 7 || rank < 1 || rank > 10 || sequence != 103 || host != 4)
+            goto fail;
+        if (memcmp(buf + length - 4, "\r\n\r\n", 4) != 0)
+            goto fail;
+        counts[rank - 1]++;
+    }
+
+    /* With s=1.2, 1 is 2^1.2 = 2.3 times as likely as 2, and about
+     * 40% of them, while 10 is only 2.6% */
+    if (counts[0] < 3800 || counts[0] > 4300 || counts[1] < 1550 || counts[1] > 1950 || counts[9] > 360)
+        goto fail;
+    _template_free(&t);
+
+    /* All the traffic to the first 20%, and a scan through 3 */
+    {
+        static const char scan[] = "GET /{{hotspot:10:100:20}}/{{scan:3}} HTTP/1.1\r\n\r\n";
+
+        if (_template_parse(&t, (const unsigned char *)scan, sizeof(scan) - 1, &bad_offset) != 0)
+            goto fail;
+        for (i = 0; i < 100; i++) {
+            unsigned value;
+            unsigned position;
+
+            length = template_expand(&t, buf, &r, i);
+            buf[length] = '\0';
+            if (sscanf((char *)buf, "GET /%u/%u ", &value, &position) != 2)
+                goto fail;
+            if (value < 1 || value > 2 || position != 1 + i % 3)
+                goto fail;
+        }
+        _template_free(&t);
+    }
+
+    /* Words */
+    memset(&t, 0, sizeof(t));
+    {
+        static const char words[] = "catdogfish";
+        static size_t offsets[] = {0, 3, 6, 10};
+        template_field_t field;
+
+        memset(&field, 0, sizeof(field));
+        field.kind = TEMPLATE_WORDS;
+        util_dist_uniform(&field.dist, 3);
+        field.words = (unsigned char *)words;
+        field.word_offsets = offsets;
+        field.literal_length = 1;
+        t.text = (unsigned char *)"/.";
+        t.length = 2;
+        t.fields = &field;
+        t.field_count = 1;
+        t.tail_offset = 1;
+        if (_field_max_length(&field) != 4)
+            goto fail;
+        for (i = 0; i < 100; i++) {
+            length = template_expand(&t, buf, &r, 0);
+            if (length < 5 || buf[0] != '/' || buf[length - 1] != '.')
+                goto fail;
+            buf[length - 1] = '\0';
+            if (strstr(words, (char *)buf + 1) == NULL)
+                goto fail;
+        }
+    }
+
+    /* These are all errors */
+    for (i = 0; bad[i]; i++) {
+        int err = _template_parse(&t, (const unsigned char *)bad[i], strlen(bad[i]), &bad_offset);
+
+        _template_free(&t);
+        if (err == 0 || bad_offset != 5) {
+            fprintf(stderr, "[-] template: accepted: %s\n", bad[i]);
+            goto fail;
+        }
+    }
+
+    /* Without placeholders, or with a lone brace, there's nothing to do */
+    if (template_compile((const unsigned char *)"GET /{x}} HTTP/1.1\r\n\r\n", 22) != NULL)
+        goto fail;
+
+    return 0;
+fail:
+    fprintf(stderr, "[-] template: programming error\n");
+    return 1;
+}
@@ -0,0 +1,112 @@
+/*
+    Request templates
+
+ When every request is byte-for-byte the same, the server answers
+ them all from its cache, which makes it look far faster than it is
+ in real life. So the URL and header fields can have placeholders,
+ which are filled in with a different value for each request:
+
+    {{random:LOW-HIGH}}     a number from LOW to HIGH, each as likely
+    {{zipf:N}}              a number from 1 to N, Zipf distributed,
+    {{zipf:N:S}}            so 1 is the most popular, then 2, and so on
+                            (the exponent S defaults to 1)
+    {{hotspot:N:X:Y}}       a number from 1 to N, where X% of the
+                            requests go to the first Y% of them
+    {{scan:N}}              the numbers from 1 to N in order, over and
+                            over
+    {{seq}}                 a sequence number, from 1, or START, so no
+    {{seq:START}}           two requests get the same one
+    {{words:FILE}}          a line from the file, each as likely
+
+ For example:
+
+    nxbench 'http://example.com/item/{{zipf:100000}}' \
+        --http-Cookie 'session={{random:1-5000}}'
+
+ Choosing the range of the keys, and how skewed they are, gives the
+ cache hit ratio we want, rather than 100%. The numbers are chosen by
+ the samplers in util-dist, which take the same time however many
+ keys there are.
+
+ The placeholders are found once at startup, splitting the request
+ into the literal text between them and the fields. Building a request
+ is then only a matter of copying the text and writing out the values
+ into the connection's buffer, without parsing anything. The same goes
+ for each of the --requests, which can have placeholders of their own.
+
+ The sequence numbers are interleaved between the workers, so they
+ don't need to share a counter: with 4 threads, the first worker
+ sends 1, 5, 9, ..., the second 2, 6, 10, ..., and so on. The same
+ goes for {{scan}}, so between them, they go through the keys in
+ order.
+ */
+#ifndef MAIN_TEMPLATE_H
+#define MAIN_TEMPLATE_H
+#include "util-rand.h"
+#include "util-dist.h"
+#include <stdint.h>
+#include <stddef.h>
+
+enum template_kind_t {
+    TEMPLATE_NUMBER,
+    TEMPLATE_SEQUENCE,
+    TEMPLATE_WORDS,
+};
+
+typedef struct template_field_t {
+    enum template_kind_t kind;
+
+    /* The literal text before this field */
+    size_t literal_offset;
+    size_t literal_length;
+
+    /* The first number, which is added to the ones from the sampler */
+    uint64_t first;
+
+    /* Chooses the numbers, or the words */
+    util_dist_t dist;
+
+    /* With words, all of them, and where each one starts, with one
+     * more offset at the end */
+    unsigned char *words;
+    size_t *word_offsets;
+} template_field_t;
+
+typedef struct template_t {
+    /* The request, with its placeholders */
+    unsigned char *text;
+    size_t length;
+
+    template_field_t *fields;
+    size_t field_count;
+
+    /* The literal text after the last field */
+    size_t tail_offset;
+
+    /* The longest the request can be once it's filled in */
+    size_t max_length;
+} template_t;
+
+/**
+ * Find the placeholders in the request.
+ * @return
+ *      the template, or NULL if the request has no placeholders.
+ *      It's fatal if any of them aren't valid.
+ */
+template_t *
+template_compile(const unsigned char *request, size_t length);
+
+/**
+ * Fill in the placeholders, writing the request into 'buf', which must
+ * have room for 'max_length' bytes. Any {{seq}} fields get 'sequence'
+ * (from 0) added to their start.
+ * @return
+ *      the length of the request.
+ */
+size_t
+template_expand(const template_t *t, unsigned char *buf, util_rand_t *r, uint64_t sequence);
+
+int
+template_selftest(void);
+
+#endif
@@ -0,0 +1,643 @@
+#include "main-uring.h"
+#include "main-worker.h"
+#include "main-conf.h"
+#include "util-time.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#endif
+
+#if defined(IORING_RECV_MULTISHOT)
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * The operation is encoded in the low bits of the 'user_data' of each
+ * submission, the rest of which is the pointer to the connection.
+ */
+enum {OP_CONNECT=1, OP_SEND=2, OP_RECV=3, OP_CANCEL=4};
+#define OP_MASK 7
+
+/* The provided buffer group that multishot recv() picks buffers from */
+#define BUFFER_GROUP 0
+
+/* We don't use liburing, so these are the raw system calls */
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_length) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_length);
+}
+static int
+io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+typedef struct uring_t {
+    int fd;
+
+    /* The submission queue */
+    struct {
+        unsigned *head;
+        unsigned *tail;
+        unsigned mask;
+        unsigned *array;
+        struct io_uring_sqe *sqes;
+        unsigned local_tail;
+        void *ring;
+        size_t ring_size;
+    } sq;
+
+    /* The completion queue */
+    struct {
+        unsigned *head;
+        unsigned *tail;
+        unsigned mask;
+        struct io_uring_cqe *cqes;
+        void *ring;
+        size_t ring_size;
+    } cq;
+
+    /* The ring of buffers that the kernel picks from when a
+     * multishot recv() has data for us */
+    struct {
+        struct io_uring_buf_ring *ring;
+        unsigned mask;
+        unsigned count;
+        unsigned local_tail;
+        unsigned char *buffers;
+    } br;
+} uring_t;
+
+static unsigned
+_pow2(size_t n, unsigned min, unsigned max) {
+    unsigned x = min;
+    while (x < n && x < max)
+        x <<= 1;
+    return x;
+}
+
+/*
+ * Submit everything we've queued up, optionally waiting up to
+ * 'milliseconds' for at least one completion.
+ */
+static void
+_uring_submit(uring_t *u, int is_wait, unsigned milliseconds) {
+    unsigned to_submit;
+    int err;
+
+    STORE_RELEASE(u->sq.tail, u->sq.local_tail);
+    to_submit = u->sq.local_tail - LOAD_ACQUIRE(u->sq.head);
+
+    if (is_wait) {
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+
+        ts.tv_sec = milliseconds / 1000;
+        ts.tv_nsec = (milliseconds % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        err = io_uring_enter(u->fd, to_submit, 1,
+                    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                    &arg, sizeof(arg));
+    } else if (to_submit) {
+        err = io_uring_enter(u->fd, to_submit, 0, 0, 0, 0);
+    } else
+        err = 0;
+
+    if (err < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+        fprintf(stderr, "[-] io_uring_enter(): %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+/*
+ * Get the next free submission entry. If the queue is full, then
+ * submit what we have to make room.
+ */
+static struct io_uring_sqe *
+_uring_sqe(uring_t *u, myinfo_t *info, unsigned op) {
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    while (u->sq.local_tail - LOAD_ACQUIRE(u->sq.head) > u->sq.mask)
+        _uring_submit(u, 0, 0);
+
+    index = u->sq.local_tail & u->sq.mask;
+    u->sq.array[index] = index;
+    u->sq.local_tail++;
+
+    sqe = &u->sq.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)(uintptr_t)info | op;
+    info->uring_pending++;
+    return sqe;
+}
+
+static void
+_uring_send(uring_t *u, myinfo_t *info) {
+    struct io_uring_sqe *sqe;
+
+    sqe = _uring_sqe(u, info, OP_SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = info->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(info->request + info->request_sent);
+    sqe->len = (unsigned)(info->request_length - info->request_sent);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    info->is_send_pending = true;
+}
+
+static void
+_uring_recv(uring_t *u, myinfo_t *info) {
+    struct io_uring_sqe *sqe;
+
+    sqe = _uring_sqe(u, info, OP_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = info->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+}
+
+/*
+ * Give a buffer back to the kernel after we've parsed it. We don't
+ * tell the kernel until the end of the batch of completions.
+ */
+static void
+_uring_buffer_return(uring_t *u, unsigned bid) {
+    struct io_uring_buf *buf;
+
+    buf = &u->br.ring->bufs[u->br.local_tail & u->br.mask];
+    buf->addr = (uint64_t)(uintptr_t)(u->br.buffers + (size_t)bid * RECV_BUFFER_SIZE);
+    buf->len = RECV_BUFFER_SIZE;
+    buf->bid = (unsigned short)bid;
+    u->br.local_tail++;
+}
+
+/*
+ * The connection record can only be reused after the kernel has
+ * finished all the operations we've submitted for it.
+ */
+static void
+_uring_release(running_t *run, myinfo_t *info) {
+    if (info->uring_pending)
+        return;
+    closesocket(info->fd);
+    worker_info_free(run, info);
+}
+
+static void
+_uring_close(running_t *run, myinfo_t *info, int reason, int error) {
+    if (info->is_closing)
+        return;
+    info->is_closing = true;
+    worker_closed(run, info, reason, error);
+
+    /* Cancel anything still outstanding on this socket, such as the
+     * multishot recv(), which would otherwise stay armed */
+    if (info->uring_pending) {
+        struct io_uring_sqe *sqe;
+        sqe = _uring_sqe(run->uring, info, OP_CANCEL);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = info->fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+    _uring_release(run, info);
+}
+
+static int
+_uring_connect(running_t *run) {
+    uring_t *u = run->uring;
+    struct io_uring_sqe *sqe;
+    const struct sockaddr *target;
+    int target_length;
+    socket_t fd;
+    myinfo_t *info;
+    util_ports_t *ports;
+    unsigned port;
+
+    /* Closed connections may still be waiting for their
+     * operations to be cancelled */
+    if (run->freed == NULL)
+        return -1;
+
+    fd = worker_socket(run, &target, &target_length, &ports, &port);
+    if (fd == (socket_t)-1)
+        return -1;
+
+    info = worker_info_alloc(run);
+    info->fd = fd;
+    info->ports = ports;
+    info->source_port = port;
+    info->time_connect = run->now;
+    worker_timeout_update(run, info);
+
+    sqe = _uring_sqe(u, info, OP_CONNECT);
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)target;
+    sqe->off = (uint64_t)target_length;
+
+    run->concurrency++;
+    run->stats.con.attempted.total++;
+    return 0;
+}
+
+static void
+_uring_on_connect(running_t *run, myinfo_t *info, int res) {
+    if (res < 0) {
+        _uring_close(run, info, REASON_ERROR, -res);
+        return;
+    }
+
+    res = worker_connected(run, info);
+    if (res) {
+        _uring_close(run, info, REASON_ERROR, res);
+        return;
+    }
+
+    /* The recv() stays armed for as long as the connection
+     * is open */
+    _uring_recv(run->uring, info);
+
+    /* With --rate, the first request waits its turn */
+    if (worker_is_open_loop(run))
+        worker_idle(run, info);
+    else if (!worker_request_next(run, info))
+        _uring_close(run, info, REASON_DONE, 0);
+    else
+        _uring_send(run->uring, info);
+}
+
+/*
+ * Once a response is finished, either send the next request(s)
+ * right away, or with --rate, wait for its turn.
+ */
+static void
+_uring_next(running_t *run, myinfo_t *info) {
+    if (worker_is_finished(run, info))
+        _uring_close(run, info, REASON_DONE, 0);
+    else if (worker_is_open_loop(run))
+        worker_idle(run, info);
+    else if (worker_request_next(run, info))
+        _uring_send(run->uring, info);
+    else if (info->pending == 0)
+        _uring_close(run, info, REASON_DONE, 0);
+}
+
+/*
+ * Called by worker_arrivals() to start a request on an idle connection
+ */
+static void
+_uring_start(running_t *run, myinfo_t *info) {
+    _uring_send(run->uring, info);
+}
+
+static void
+_uring_on_send(running_t *run, myinfo_t *info, int res) {
+    info->is_send_pending = false;
+    if (res < 0) {
+        _uring_close(run, info, REASON_ERROR, -res);
+        return;
+    }
+
+    info->request_sent += res;
+    if (info->request_sent < info->request_length) {
+        _uring_send(run->uring, info);
+        return;
+    }
+
+    worker_sent(run, info);
+
+    if (info->is_send_next) {
+        info->is_send_next = false;
+        _uring_next(run, info);
+    }
+}
+
+static void
+_uring_on_recv(running_t *run, myinfo_t *info, int res, unsigned flags) {
+    uring_t *u = run->uring;
+    int is_more = (flags & IORING_CQE_F_MORE) != 0;
+
+    if (res > 0) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        const unsigned char *buf = u->br.buffers + (size_t)bid * RECV_BUFFER_SIZE;
+        int x;
+
+        x = worker_response(run, info, buf, (size_t)res);
+        _uring_buffer_return(u, bid);
+
+        if (x == RESPONSE_EXTRA) {
+            _uring_close(run, info, REASON_PIPELINE, 0);
+            return;
+        } else if (x == RESPONSE_FINISHED) {
+            /* Send the next request on this connection, unless we
+             * haven't yet seen the completion of the last send */
+            if (info->is_send_pending)
+                info->is_send_next = true;
+            else
+                _uring_next(run, info);
+            if (info->is_closing)
+                return;
+        }
+
+        /* The kernel stops a multishot recv() on its own in some
+         * cases, so we need to re-arm it */
+        if (!is_more)
+            _uring_recv(u, info);
+    } else if (res == 0) {
+        _uring_close(run, info, REASON_READEND, 0);
+    } else if (res == -ENOBUFS) {
+        /* We ran out of buffers, which we'll give back at the
+         * end of this batch, so try again */
+        if (!is_more)
+            _uring_recv(u, info);
+    } else {
+        _uring_close(run, info, REASON_ERROR, -res);
+    }
+}
+
+static void
+_uring_complete(running_t *run, const struct io_uring_cqe *cqe) {
+    myinfo_t *info = (myinfo_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+    unsigned op = (unsigned)(cqe->user_data & OP_MASK);
+
+    /* Multishot recv() has more completions coming for the same
+     * submission, so it's still pending */
+    if (op != OP_RECV || !(cqe->flags & IORING_CQE_F_MORE))
+        info->uring_pending--;
+
+    if (info->is_closing) {
+        if (op == OP_RECV && (cqe->flags & IORING_CQE_F_BUFFER))
+            _uring_buffer_return(run->uring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        _uring_release(run, info);
+        return;
+    }
+
+    switch (op) {
+    case OP_CONNECT:
+        _uring_on_connect(run, info, cqe->res);
+        break;
+    case OP_SEND:
+        _uring_on_send(run, info, cqe->res);
+        break;
+    case OP_RECV:
+        _uring_on_recv(run, info, cqe->res, cqe->flags);
+        break;
+    }
+}
+
+int
+uring_run_loop(running_t *run) {
+    uring_t *u = run->uring;
+    unsigned head;
+    unsigned tail;
+    unsigned timeout;
+    myinfo_t *info;
+    size_t count;
+
+    run->now = util_time_ns();
+    if (!worker_is_running(run))
+        return 0;
+    worker_schedule(run);
+
+    /* Once we're stopping, connections waiting for their next
+     * request have nothing more to do */
+    while (run->is_stopping && run->idle)
+        _uring_close(run, run->idle, REASON_DONE, 0);
+
+    /* Close any connections that have timed out */
+    while ((info = worker_timeout_next(run)) != NULL)
+        _uring_close(run, info, info->timeout_reason, 0);
+
+    /* If we don't have enough concurrent connections, then add
+     * some new ones, the same as the epoll loop */
+    count = worker_connect_budget(run);
+    while (count-- && _uring_connect(run) == 0)
+        ;
+    /* We're finished if we can't open any connections, unless
+     * the records are still waiting for their cancellations, or
+     * we're holding back on purpose */
+    if (run->concurrency == 0 && run->freed != NULL && !worker_is_paced(run))
+        return 0;
+
+    /*
+     * With --rate, start the requests whose time has come
+     */
+    timeout = worker_arrivals(run, _uring_start);
+    timeout = worker_connect_next(run, timeout);
+    timeout = util_timers_next(&run->timers, run->now / 1000000, timeout);
+
+    /*
+     * Submit everything, and wait for completions
+     */
+    _uring_submit(u, 1, timeout);
+    run->now = util_time_ns();
+
+    /*
+     * Process all the completions that were returned
+     */
+    head = *u->cq.head;
+    tail = LOAD_ACQUIRE(u->cq.tail);
+    for (; head != tail; head++) {
+        _uring_complete(run, &u->cq.cqes[head & u->cq.mask]);
+    }
+    STORE_RELEASE(u->cq.head, head);
+
+    /* Give all the parsed buffers back to the kernel */
+    STORE_RELEASE(&u->br.ring->tail, (unsigned short)u->br.local_tail);
+
+    return 1;
+}
+
+int
+uring_probe(void) {
+    static const unsigned char needed[] = {
+        IORING_OP_CONNECT, IORING_OP_SEND, IORING_OP_RECV, IORING_OP_ASYNC_CANCEL,
+        /* Multishot recv can't be probed for, but arrived in the same
+         * release (6.0) as this */
+        IORING_OP_SEND_ZC,
+    };
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    size_t size;
+    size_t i;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = io_uring_setup(4, &p);
+    if (fd < 0) {
+        if (errno == ENOSYS)
+            fprintf(stderr, "[-] io_uring: not in this kernel (needs Linux 6.0 or later)\n");
+        else if (errno == EPERM)
+            fprintf(stderr, "[-] io_uring: not allowed (see the kernel.io_uring_disabled sysctl)\n");
+        else
+            fprintf(stderr, "[-] io_uring_setup(): %s\n", strerror(errno));
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "[-] io_uring: kernel too old (needs Linux 6.0 or later)\n");
+        close(fd);
+        return -1;
+    }
+
+    size = sizeof(*probe) + 256 * sizeof(probe->ops[0]);
+    probe = calloc(1, size);
+    if (probe == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    if (io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        fprintf(stderr, "[-] io_uring: kernel too old (needs Linux 6.0 or later)\n");
+        free(probe);
+        close(fd);
+        return -1;
+    }
+    for (i = 0; i < sizeof(needed); i++) {
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+            fprintf(stderr, "[-] io_uring: kernel too old (needs Linux 6.0 or later)\n");
+            free(probe);
+            close(fd);
+            return -1;
+        }
+    }
+    free(probe);
+    close(fd);
+    return 0;
+}
+
+int
+uring_worker_init(running_t *run) {
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    uring_t *u;
+    unsigned entries;
+    unsigned i;
+    size_t size;
+
+    u = calloc(1, sizeof(*u));
+    if (u == NULL)
+        return -1;
+
+    /*
+     * Each connection has up to three operations outstanding
+     * (recv, send, cancel), so we size the completion queue for that.
+     */
+    entries = _pow2(run->max_concurrency * 2, 64, 4096);
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = _pow2(run->max_concurrency * 4, entries * 2, 65536);
+    u->fd = io_uring_setup(entries, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        /* older kernels don't know the newer flags */
+        p.flags = IORING_SETUP_CQSIZE;
+        u->fd = io_uring_setup(entries, &p);
+    }
+    if (u->fd < 0) {
+        fprintf(stderr, "[-] io_uring_setup(): %s\n", strerror(errno));
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "[-] io_uring: kernel too old\n");
+        return -1;
+    }
+
+    /*
+     * Map the rings into our memory
+     */
+    u->sq.ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq.ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (u->cq.ring_size > u->sq.ring_size)
+        u->sq.ring_size = u->cq.ring_size;
+    u->sq.ring = mmap(0, u->sq.ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq.ring == MAP_FAILED) {
+        fprintf(stderr, "[-] io_uring mmap(): %s\n", strerror(errno));
+        return -1;
+    }
+    u->cq.ring = u->sq.ring;
+    u->sq.sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sq.sqes == MAP_FAILED) {
+        fprintf(stderr, "[-] io_uring mmap(): %s\n", strerror(errno));
+        return -1;
+    }
+    u->sq.head = (unsigned *)((char *)u->sq.ring + p.sq_off.head);
+    u->sq.tail = (unsigned *)((char *)u->sq.ring + p.sq_off.tail);
+    u->sq.mask = *(unsigned *)((char *)u->sq.ring + p.sq_off.ring_mask);
+    u->sq.array = (unsigned *)((char *)u->sq.ring + p.sq_off.array);
+    u->sq.local_tail = *u->sq.tail;
+    u->cq.head = (unsigned *)((char *)u->cq.ring + p.cq_off.head);
+    u->cq.tail = (unsigned *)((char *)u->cq.ring + p.cq_off.tail);
+    u->cq.mask = *(unsigned *)((char *)u->cq.ring + p.cq_off.ring_mask);
+    u->cq.cqes = (struct io_uring_cqe *)((char *)u->cq.ring + p.cq_off.cqes);
+
+    /*
+     * Create the ring of receive buffers, and give them all
+     * to the kernel.
+     */
+    u->br.count = _pow2(run->max_concurrency + 64, 128, 32768);
+    u->br.mask = u->br.count - 1;
+    size = u->br.count * sizeof(struct io_uring_buf);
+    u->br.ring = mmap(0, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br.ring == MAP_FAILED) {
+        fprintf(stderr, "[-] io_uring mmap(): %s\n", strerror(errno));
+        return -1;
+    }
+    u->br.buffers = malloc((size_t)u->br.count * RECV_BUFFER_SIZE);
+    if (u->br.buffers == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    memset(u->br.buffers, 0, (size_t)u->br.count * RECV_BUFFER_SIZE);
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br.ring;
+    reg.ring_entries = u->br.count;
+    reg.bgid = BUFFER_GROUP;
+    if (io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        fprintf(stderr, "[-] io_uring register buffers: %s\n", strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < u->br.count; i++)
+        _uring_buffer_return(u, i);
+    STORE_RELEASE(&u->br.ring->tail, (unsigned short)u->br.local_tail);
+
+    run->uring = u;
+    return 0;
+}
+
+#else
+
+int
+uring_probe(void) {
+    fprintf(stderr, "[-] io_uring: not supported on this platform\n");
+    return -1;
+}
+
+int
+uring_worker_init(struct running_t *run) {
+    (void)run;
+    fprintf(stderr, "[-] io_uring: not supported on this platform\n");
+    return -1;
+}
+
+int
+uring_run_loop(struct running_t *run) {
+    (void)run;
+    return 0;
+}
+
+#endif
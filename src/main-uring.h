@@ -0,0 +1,46 @@
+/*
+    io_uring event loop
+
+ An alternative to the epoll event loop (--engine uring). Instead of
+ one system call for every connect(), send(), recv(), and epoll_ctl(),
+ operations are queued up and submitted in a batch with a single
+ system call per pass through the loop, which also waits for their
+ completions. Responses are received with "multishot" recv, which
+ stays armed across responses, into a ring of buffers provided to
+ the kernel ahead of time.
+
+ This needs Linux 6.0 or later. That's checked before the workers
+ start, and without it, we fall back to epoll.
+ */
+#ifndef MAIN_URING_H
+#define MAIN_URING_H
+struct running_t;
+
+/**
+ * Check that the kernel has everything the engine uses, before any
+ * workers start, printing what's missing if it doesn't.
+ * @return
+ *      0 if it does, or -1 if it doesn't.
+ */
+int
+uring_probe(void);
+
+/**
+ * Create the io_uring for this worker. This is called from the worker
+ * thread after its memory has been allocated.
+ * @return
+ *      0 on success, or -1 if io_uring isn't supported.
+ */
+int
+uring_worker_init(struct running_t *run);
+
+/**
+ * One pass through the event loop: open any new connections, submit
+ * all the queued operations, and process the completions.
+ * @return
+ *      1 if we should keep running, 0 if there are no more connections.
+ */
+int
+uring_run_loop(struct running_t *run);
+
+#endif
@@ -0,0 +1,1785 @@
+#include "main-worker.h"
+#include "main-uring.h"
+#include "main-conf.h"
+#include "main-schedule.h"
+#include "util-tui.h"
+#include "util-time.h"
+#include "util-thread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <stddef.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#undef EPOLLRDHUP
+#define EPOLLRDHUP 0
+
+/* Not supported by wepoll on Windows, where --edge is rejected */
+#ifndef EPOLLET
+#define EPOLLET 0
+#endif
+
+/* How long to wait before trying again when we can't create a socket
+ * for a new connection */
+#define CONNECT_BACKOFF_NS (10 * 1000000ULL)
+
+myinfo_t *
+worker_info_alloc(running_t *run) {
+    const main_conf_t *conf = run->conf;
+    myinfo_t *info;
+
+    info = run->freed;
+    if (info == NULL) {
+        fprintf(stderr, "[*] ran out of memory\n");
+        exit(1);
+    }
+
+    /* unlink from free list, add to active list */
+    run->freed = info->next;
+    memset(info, 0, sizeof(*info));
+    info->next = run->active;
+    run->active = info;
+
+    info->request = (char*)conf->request;
+    info->request_length = conf->request_length;
+    info->request_sent = 0;
+    info->is_connected = 0;
+    info->intended_times = run->intended_times + (info - run->pool) * conf->pipeline;
+    if (run->request_ids)
+        info->request_ids = run->request_ids + (info - run->pool) * conf->pipeline;
+
+    return info;
+}
+void
+worker_info_free(running_t *run, myinfo_t *info) {
+    /* The socket is closed, so its source port can be reused */
+    if (info->ports) {
+        util_ports_free(info->ports, info->source_port);
+        info->ports = NULL;
+    }
+
+    run->active = info->next;
+    info->next = run->freed;
+    run->freed = info;
+}
+
+static int
+get_addr_length(const struct sockaddr *target) {
+        switch (target->sa_family) {
+        case PF_INET:
+            return sizeof(struct sockaddr_in);
+            break;
+        case PF_INET6:
+            return sizeof(struct sockaddr_in6);
+            break;
+        default:
+            fprintf(stderr, "[-] unknown address family\n");
+            return 0;
+            break;
+    }
+}
+
+static bool
+_connection_is_sent(myinfo_t* info) {
+    return info->request_sent >= info->request_length;
+}
+
+int
+worker_connected(running_t *run, myinfo_t *info) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (getsockopt(info->fd, SOL_SOCKET, SO_ERROR, (char*)&error, &len) != 0)
+        error = sockerrno;
+    if (error)
+        return error;
+
+    run->stats.con.succeeded.total++;
+    info->is_connected = true;
+    info->time_connected = run->now;
+    util_hdr_record(&run->stats.latency.connect, run->now - info->time_connect);
+    worker_timeout_update(run, info);
+    return 0;
+}
+
+void
+worker_sent(running_t *run, myinfo_t *info) {
+    if (run->conf->is_shutdown)
+        shutdown(info->fd, SHUT_WR);
+    run->stats.http.sent.total += info->request_batch;
+    info->time_sent = run->now;
+    worker_timeout_update(run, info);
+}
+
+void
+worker_timeout_update(running_t *run, myinfo_t *info) {
+    uint64_t expires = ~0ULL;
+
+    if (!run->timeout_connect && !run->timeout_first_byte && !run->timeout_response)
+        return;
+
+    if (!info->is_connected) {
+        if (run->timeout_connect) {
+            expires = info->time_connect + run->timeout_connect;
+            info->timeout_reason = REASON_TIMEOUT_CONNECT;
+        }
+    } else if (info->pending) {
+        if (run->timeout_first_byte && info->time_sent && info->time_first_byte == 0) {
+            expires = info->time_sent + run->timeout_first_byte;
+            info->timeout_reason = REASON_TIMEOUT_FIRST_BYTE;
+        }
+
+        /* From when the oldest outstanding request was supposed
+         * to start, the same as the response latency */
+        if (run->timeout_response
+            && info->intended_times[info->oldest] + run->timeout_response < expires) {
+            expires = info->intended_times[info->oldest] + run->timeout_response;
+            info->timeout_reason = REASON_TIMEOUT_RESPONSE;
+        }
+    }
+
+    /* The wheel counts milliseconds, which we round up, so that
+     * we never time out early */
+    if (expires == ~0ULL)
+        util_timer_remove(&run->timers, &info->timer);
+    else
+        util_timer_add(&run->timers, &info->timer, (expires + 999999) / 1000000);
+}
+
+myinfo_t *
+worker_timeout_next(running_t *run) {
+    util_timer_t *timer;
+
+    timer = util_timers_expire(&run->timers, run->now / 1000000);
+    if (timer == NULL)
+        return NULL;
+    return (myinfo_t *)((char *)timer - offsetof(myinfo_t, timer));
+}
+
+/*
+ * Once we reach the end of the run, we stop starting new requests,
+ * but give the outstanding ones some time to finish.
+ */
+static void
+_worker_stop(running_t *run) {
+    run->is_stopping = true;
+    run->drain_deadline = run->now + (uint64_t)(run->conf->drain_timeout * 1000000000.0);
+}
+
+/*
+ * With --replay, make sure we have the next line of the log.
+ * @return
+ *      false at the end of the log.
+ */
+static bool
+_replay_ready(running_t *run) {
+    if (!run->is_replay_line)
+        run->is_replay_line = replay_next(&run->replay, &run->replay_line) != 0;
+    return run->is_replay_line;
+}
+
+bool
+worker_request_begin(running_t *run) {
+    if (run->is_stopping)
+        return false;
+    if (run->request_count >= run->request_max) {
+        _worker_stop(run);
+        return false;
+    }
+
+    /* With --replay, we stop at the end of the log */
+    if (run->conf->replay && !_replay_ready(run)) {
+        _worker_stop(run);
+        return false;
+    }
+    run->request_count++;
+    return true;
+}
+
+bool
+worker_is_running(running_t *run) {
+    if (!run->is_stopping) {
+        if (run->time_end && run->now >= run->time_end)
+            _worker_stop(run);
+        else if (run->is_stop_requested)
+            _worker_stop(run);
+        else if (run->request_count >= run->request_max)
+            _worker_stop(run);
+        else
+            return true;
+    }
+
+    if (run->concurrency == 0)
+        return false;
+    if (run->now >= run->drain_deadline)
+        return false;
+    return true;
+}
+
+/*
+ * Fill in the placeholders for 'count' requests, back-to-back in the
+ * connection's buffer. The sequence numbers are interleaved with the
+ * other workers', so they're never the same.
+ */
+static void
+_template_queue(running_t *run, myinfo_t *info, const template_t *t, unsigned count) {
+    const main_conf_t *conf = run->conf;
+    unsigned char *buf;
+    size_t length = 0;
+    unsigned i;
+
+    buf = run->template_requests + (info - run->pool) * conf->pipeline * conf->template_max_length;
+    for (i = 0; i < count; i++) {
+        uint64_t sequence = run->template_sequence++ * conf->thread_count + run->index;
+        length += template_expand(t, buf + length, &run->r, sequence);
+    }
+    info->request = (char *)buf;
+    info->request_length = length;
+}
+
+/*
+ * Queue up 'count' more requests on the connection, which are sent
+ * together in a single batch. They are all the same, so the batch is
+ * just the last 'count' copies from the prebuilt pipeline buffer, or
+ * with --requests, from the copies of the one we choose. With
+ * {{placeholders}}, they're filled in anew for each request instead.
+ */
+static void
+_request_queue(running_t *run, myinfo_t *info, unsigned count, uint64_t intended_time) {
+    const main_conf_t *conf = run->conf;
+    unsigned id = 0;
+    unsigned i;
+
+    if (conf->requests)
+        id = requests_choose(conf->requests, &run->r);
+
+    for (i = 0; i < count; i++) {
+        unsigned slot = (info->oldest + info->pending) % conf->pipeline;
+
+        info->intended_times[slot] = intended_time;
+        if (info->request_ids)
+            info->request_ids[slot] = id;
+        info->pending++;
+    }
+
+    if (conf->replay) {
+        unsigned char **buf = &run->replay_requests[info - run->pool];
+
+        info->request_length = replay_build(&run->replay_line, conf->request, conf->request_length, buf);
+        info->request = (char *)*buf;
+        info->is_head = run->replay_line.is_head;
+        run->is_replay_line = false;
+    } else if (conf->requests) {
+        const request_entry_t *entry = &conf->requests->entries[id];
+
+        if (entry->template)
+            _template_queue(run, info, entry->template, count);
+        else {
+            info->request = (char *)conf->requests->arena + entry->offset + (conf->pipeline - count) * entry->length;
+            info->request_length = count * entry->length;
+        }
+    } else if (conf->request_template) {
+        _template_queue(run, info, conf->request_template, count);
+    } else {
+        info->request = (char *)conf->pipeline_request + (conf->pipeline - count) * conf->request_length;
+        info->request_length = count * conf->request_length;
+    }
+    info->request_batch = count;
+    info->request_sent = 0;
+    info->is_request_done = false;
+    info->time_sent = 0;
+    worker_timeout_update(run, info);
+}
+
+void
+worker_request_init(running_t *run, myinfo_t *info, uint64_t intended_time) {
+    _request_queue(run, info, 1, intended_time);
+}
+
+unsigned
+worker_request_next(running_t *run, myinfo_t *info) {
+    unsigned count = 0;
+
+    /* When the --schedule calls for fewer connections, the extra
+     * ones close once their outstanding responses are in */
+    if (run->concurrency > run->target_concurrency)
+        return 0;
+
+    while (info->pending + count < run->conf->pipeline && worker_request_begin(run))
+        count++;
+    if (count)
+        _request_queue(run, info, count, run->now);
+    return count;
+}
+
+void
+worker_idle(running_t *run, myinfo_t *info) {
+    info->is_idle = true;
+    info->idle_prev = NULL;
+    info->idle_next = run->idle;
+    if (run->idle)
+        run->idle->idle_prev = info;
+    run->idle = info;
+}
+
+static void
+_idle_remove(running_t *run, myinfo_t *info) {
+    if (info->idle_prev)
+        info->idle_prev->idle_next = info->idle_next;
+    else
+        run->idle = info->idle_next;
+    if (info->idle_next)
+        info->idle_next->idle_prev = info->idle_prev;
+    info->is_idle = false;
+}
+
+/*
+ * The time (nanoseconds) between one request and the next, either
+ * fixed, or exponentially distributed for a Poisson process.
+ */
+static uint64_t
+_arrival_interval(running_t *run) {
+    double seconds;
+
+    if (run->conf->arrival == ARRIVAL_POISSON) {
+        /* a uniform number in [0..1) with 53 bits of precision */
+        double u = (util_rand(&run->r) >> 11) * (1.0 / 9007199254740992.0);
+        seconds = -log(1.0 - u) / run->rate;
+    } else
+        seconds = 1.0 / run->rate;
+
+    return (uint64_t)(seconds * 1000000000.0);
+}
+
+/*
+ * With --replay, when the next line of the log is due, relative to
+ * the start of the run, at --replay-speed. Lines from before the
+ * first are sent right away.
+ */
+static bool
+_replay_arrival(running_t *run) {
+    double seconds;
+
+    if (!_replay_ready(run)) {
+        _worker_stop(run);
+        return false;
+    }
+    seconds = run->replay_line.time / run->conf->replay_speed;
+    if (seconds < 0.0)
+        seconds = 0.0;
+    run->next_arrival = run->time_start + (uint64_t)(seconds * 1000000000.0);
+    return true;
+}
+
+unsigned
+worker_arrivals(running_t *run, void (*start)(running_t *run, myinfo_t *info)) {
+    uint64_t wait;
+
+    if (!worker_is_open_loop(run) || run->is_stopping)
+        return 10;
+
+    if (run->next_arrival == 0) {
+        if (run->conf->replay) {
+            if (!_replay_arrival(run))
+                return 10;
+        } else
+            run->next_arrival = run->now;
+    }
+
+    while (run->next_arrival <= run->now) {
+        myinfo_t *info = run->idle;
+
+        /* All the connections are busy, so these requests have
+         * to wait, but we don't reschedule them */
+        if (info == NULL)
+            return 10;
+        if (!worker_request_begin(run))
+            return 10;
+
+        _idle_remove(run, info);
+        worker_request_init(run, info, run->next_arrival);
+        start(run, info);
+        if (run->conf->replay) {
+            if (!_replay_arrival(run))
+                return 10;
+        } else
+            run->next_arrival += _arrival_interval(run);
+    }
+
+    /* Rounded up, like the timers, as rounding down to 0 would spin
+     * until the next arrival whenever it's less than a millisecond
+     * away. Sending up to a millisecond late is fine, as its latency
+     * counts from when it was due */
+    wait = (run->next_arrival - run->now + 999999) / 1000000;
+    if (wait > 10)
+        wait = 10;
+    return (unsigned)wait;
+}
+
+void
+worker_schedule(running_t *run) {
+    const main_conf_t *conf = run->conf;
+    unsigned kind;
+    double value;
+
+    if (conf->schedule) {
+        kind = conf->schedule->kind;
+        value = schedule_value(conf->schedule, (run->now - run->time_start) / 1000000000.0);
+    } else if (conf->is_find_max) {
+        kind = (conf->rate > 0.0) ? SCHEDULE_RATE : SCHEDULE_CONNECTIONS;
+        value = run->control;
+    } else
+        return;
+
+    if (kind == SCHEDULE_CONNECTIONS) {
+        /* Our share, with the remainder spread across the first
+         * workers, the same as -c */
+        size_t total = (size_t)(value + 0.5);
+        run->target_concurrency = total / conf->thread_count;
+        if (run->index < total % conf->thread_count)
+            run->target_concurrency++;
+        if (run->target_concurrency > run->max_concurrency)
+            run->target_concurrency = run->max_concurrency;
+    } else {
+        /* A rate of 0 would mean closed-loop, so just make it slow */
+        double rate = value / conf->thread_count;
+        if (rate < 0.001)
+            rate = 0.001;
+
+        /* When the rate goes up, don't wait for a request that was
+         * scheduled at the old, slower rate */
+        if (run->next_arrival > run->now + (uint64_t)(1000000000.0 / rate))
+            run->next_arrival = run->now + (uint64_t)(1000000000.0 / rate);
+        run->rate = rate;
+    }
+}
+
+bool
+worker_is_open_loop(const running_t *run) {
+    return run->rate > 0.0 || (run->conf->replay && !run->conf->is_replay_max);
+}
+
+bool
+worker_is_paced(const running_t *run) {
+    return run->connect_rate > 0.0 || run->conf->schedule != NULL || run->conf->is_find_max;
+}
+
+size_t
+worker_connect_budget(running_t *run) {
+    size_t missing;
+    double burst;
+    size_t count;
+
+    if (run->is_stopping || run->concurrency >= run->target_concurrency)
+        return 0;
+    if (run->now < run->connect_backoff)
+        return 0;
+    missing = run->target_concurrency - run->concurrency;
+    if (run->connect_rate <= 0.0)
+        return missing;
+
+    /* Refill the bucket for the time since we last looked. It holds
+     * 10 milliseconds worth, so that we can keep up with the rate
+     * even though we only get here once per pass through the loop */
+    burst = run->connect_rate / 100.0;
+    if (burst < 1.0)
+        burst = 1.0;
+    if (run->connect_last == 0)
+        run->connect_tokens = 1.0;
+    else
+        run->connect_tokens += (run->now - run->connect_last) * run->connect_rate / 1000000000.0;
+    if (run->connect_tokens > burst)
+        run->connect_tokens = burst;
+    run->connect_last = run->now;
+
+    count = (size_t)run->connect_tokens;
+    if (count > missing)
+        count = missing;
+    run->connect_tokens -= (double)count;
+    return count;
+}
+
+unsigned
+worker_connect_next(running_t *run, unsigned max) {
+    double wait;
+
+    if (run->is_stopping || run->concurrency >= run->target_concurrency)
+        return max;
+    if (run->now < run->connect_backoff) {
+        uint64_t backoff = (run->connect_backoff - run->now + 999999) / 1000000;
+        return (backoff < max) ? (unsigned)backoff : max;
+    }
+    if (run->connect_rate <= 0.0)
+        return max;
+
+    wait = (1.0 - run->connect_tokens) * 1000.0 / run->connect_rate;
+    if (wait < 0.0)
+        return 0;
+    if (wait >= max)
+        return max;
+    return (unsigned)wait + 1;
+}
+
+bool
+worker_is_finished(running_t *run, myinfo_t *info) {
+    return run->conf->is_new_conn && info->pending == 0;
+}
+
+/*
+ * A connection we couldn't even start, such as when we've run out of
+ * file descriptors. It counts as a failed attempt, and we wait a
+ * moment before trying again, rather than try (and count the error)
+ * on every pass through the loop.
+ */
+static void
+_socket_failed(running_t *run, int error) {
+    run->stats.con.attempted.total++;
+    run->stats.con.failed.total++;
+    worker_error(run, error);
+    run->connect_backoff = run->now + CONNECT_BACKOFF_NS;
+}
+
+/*
+ * Bind to our own choice of source port (--source-ports), from the
+ * allocator for this pair of addresses. Without a source address,
+ * we bind to the wildcard address of the target's family.
+ * @return
+ *      0 on success, or else the error.
+ */
+static int
+_socket_bind_port(socket_t fd, const struct sockaddr *source,
+        const struct sockaddr *target, util_ports_t *ports, unsigned *r_port) {
+    struct sockaddr_storage local;
+    unsigned port;
+    int one = 1;
+    int err;
+
+    port = util_ports_alloc(ports);
+    if (port == 0)
+        return WSA(EADDRNOTAVAIL);
+
+    memset(&local, 0, sizeof(local));
+    if (source)
+        memcpy(&local, source, get_addr_length(source));
+    else
+        local.ss_family = target->sa_family;
+    if (local.ss_family == AF_INET6)
+        ((struct sockaddr_in6 *)&local)->sin6_port = htons((unsigned short)port);
+    else
+        ((struct sockaddr_in *)&local)->sin_port = htons((unsigned short)port);
+
+    /* The port may still be in TIME_WAIT from a previous connection,
+     * which is fine as long as it was to a different target */
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&one, sizeof(one));
+
+    err = bind(fd, (const struct sockaddr *)&local, get_addr_length((const struct sockaddr *)&local));
+    if (err) {
+        err = sockerrno;
+        util_ports_free(ports, port);
+        return err;
+    }
+    *r_port = port;
+    return 0;
+}
+
+socket_t
+worker_socket(running_t *run, const struct sockaddr **r_target, int *r_target_length,
+        util_ports_t **r_ports, unsigned *r_port) {
+    socket_t fd;
+    const struct sockaddr *target;
+    const struct sockaddr *source;
+    size_t target_index;
+    size_t source_index;
+    int err;
+    int addr_len;
+
+again:
+    /* Choose a random source and destination IP address */
+    target_index = util_rand32_uniform(&run->r, (unsigned)run->targets_count);
+    target = (struct sockaddr *)&run->targets[target_index];
+    if (run->sources_count) {
+        source_index = util_rand32_uniform(&run->r, (unsigned)run->sources_count);
+        source = (struct sockaddr *)&run->sources[source_index];
+    } else {
+        source_index = 0;
+        source = NULL;
+    }
+    if (source && (source->sa_family != target->sa_family))
+        goto again;
+
+    /* With --source-ports, if this pair has used up its ports, take
+     * the next one that hasn't, so we only run out once they all have */
+    if (run->ports) {
+        size_t pairs = (run->sources_count ? run->sources_count : 1) * run->targets_count;
+        size_t first = source_index * run->targets_count + target_index;
+        size_t i;
+
+        for (i = 0; i < pairs; i++) {
+            size_t pair = (first + i) % pairs;
+            const util_ports_t *ports = &run->ports[pair];
+            const struct sockaddr *t = (struct sockaddr *)&run->targets[pair % run->targets_count];
+            const struct sockaddr *s = NULL;
+
+            if (run->sources_count)
+                s = (struct sockaddr *)&run->sources[pair / run->targets_count];
+            if ((s && s->sa_family != t->sa_family) || ports->in_use >= ports->count)
+                continue;
+            source_index = pair / run->targets_count;
+            target_index = pair % run->targets_count;
+            source = s;
+            target = t;
+            break;
+        }
+    }
+
+    /* create socket for this connection. If we've run out of file
+     * descriptors (use ulimit to increase them), or anything else,
+     * we count the error and try again later */
+    fd = socket(target->sa_family, SOCK_STREAM, 0);
+    if (fd == (socket_t)-1) {
+        _socket_failed(run, sockerrno);
+        return (socket_t)-1;
+    }
+
+    /* With --linger0, closing sends a reset, so the connection
+     * doesn't linger in TIME_WAIT */
+    if (run->conf->is_linger0) {
+        struct linger linger;
+        linger.l_onoff = 1;
+        linger.l_linger = 0;
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, (const char *)&linger, sizeof(linger));
+    }
+
+    *r_ports = NULL;
+    *r_port = 0;
+    if (run->ports) {
+        /* Bind to a port we chose ourselves */
+        util_ports_t *ports = &run->ports[source_index * run->targets_count + target_index];
+        err = _socket_bind_port(fd, source, target, ports, r_port);
+        if (err) {
+            _socket_failed(run, err);
+            closesocket(fd);
+            return (socket_t)-1;
+        }
+        *r_ports = ports;
+    } else if (source) {
+        /* Bind to a source address. Normally, bind() reserves a port
+         * right away, which must then be unique across all targets,
+         * so we run out after 28k or so connections. This tells the
+         * kernel to wait until connect() to choose the port, when
+         * it can reuse ports that are connected to other targets */
+#ifdef IP_BIND_ADDRESS_NO_PORT
+        int one = 1;
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+#endif
+        addr_len = get_addr_length(source);
+        err = bind(fd, source, addr_len);
+        if (err) {
+            _socket_failed(run, sockerrno);
+            closesocket(fd);
+            return (socket_t)-1;
+        }
+    }
+
+    *r_target = target;
+    *r_target_length = get_addr_length(target);
+    return fd;
+}
+
+static int 
+_connection_create(const main_conf_t *conf, running_t *run) {
+    socket_t fd;
+    const struct sockaddr *target;
+    int err;
+    int addr_len;
+    struct epoll_event event;
+    myinfo_t *info;
+    util_ports_t *ports;
+    unsigned port;
+
+    fd = worker_socket(run, &target, &addr_len, &ports, &port);
+    if (fd == (socket_t)-1)
+        return -1;
+
+    /* set to non-blocking */
+    sock_nonblocking(fd);
+
+    /* initiate the connection to the target*/
+    err = connect(fd, target, addr_len);
+    if (err == -1 && sockerrno != WSA(EINPROGRESS) && sockerrno != WSA(EWOULDBLOCK)) {
+        _socket_failed(run, sockerrno);
+        closesocket(fd);
+        if (ports)
+            util_ports_free(ports, port);
+        return -1;
+    }
+
+    /* Get data specific to this connection */
+    info = worker_info_alloc(run);
+    info->fd = fd;
+    info->ports = ports;
+    info->source_port = port;
+    info->time_connect = run->now;
+    worker_timeout_update(run, info);
+
+    /* save the event data */
+    memset(&event, 0, sizeof(event));
+    event.data.ptr = info;
+    event.events = EPOLLOUT | EPOLLIN  | EPOLLRDHUP;
+    if (conf->is_edge_triggered)
+        event.events |= EPOLLET;
+    err = epoll_ctl(run->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    if (err) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    run->concurrency++;
+    run->stats.con.attempted.total++;
+
+    return 0;
+}
+
+int
+worker_send(myinfo_t *info) {
+    ssize_t bytes_sent;
+
+    bytes_sent = send(  info->fd,
+                        info->request + info->request_sent,
+                        (int)(info->request_length - info->request_sent),
+                        MSG_NOSIGNAL);
+    if (bytes_sent > 0) {
+        info->request_sent += bytes_sent;
+        return 0;
+    } else {
+        return -1;
+    }
+}
+
+void
+worker_error(running_t *run, int error) {
+    run->stats.errors[stats_errno_index(error)].total++;
+}
+
+void
+worker_closed(running_t *run, myinfo_t *info, int reason, int error) {
+    socket_t fd = info->fd;
+
+    if (info->is_idle)
+        _idle_remove(run, info);
+    util_timer_remove(&run->timers, &info->timer);
+
+    /* Record statistics */
+    switch (reason) {
+        case REASON_ERROR:
+            /* Errors before the connection completes are failed
+             * connections */
+            if (info->is_connected)
+                run->stats.con.error.total++;
+            else
+                run->stats.con.failed.total++;
+
+            if (error == 0) {
+                socklen_t len = sizeof(error);
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*)&error, &len) != 0)
+                    error = sockerrno;
+            }
+            worker_error(run, error);
+            break;
+        case REASON_READEND:
+            run->stats.con.read.total++;
+            break;
+        case REASON_HANGUP:
+            run->stats.con.hangup.total++;
+            break;
+        case REASON_HANGUP2:
+            run->stats.con.hangup2.total++;
+            break;
+        case REASON_PIPELINE:
+            run->stats.con.pipeline.total++;
+            break;
+        case REASON_DONE:
+            break;
+        case REASON_TIMEOUT_CONNECT:
+            run->stats.con.timeout_connect.total++;
+            break;
+        case REASON_TIMEOUT_FIRST_BYTE:
+            run->stats.con.timeout_first_byte.total++;
+            break;
+        case REASON_TIMEOUT_RESPONSE:
+            run->stats.con.timeout_response.total++;
+            break;
+        default:
+            run->stats.con.unknown.total++;
+            break;
+    }
+
+    /* With --requests, the ones still outstanding will never get
+     * their responses, so they're failures too */
+    if (run->request_stats) {
+        unsigned i;
+
+        for (i = 0; i < info->pending; i++) {
+            unsigned slot = (info->oldest + i) % run->conf->pipeline;
+
+            run->request_stats[info->request_ids[slot]].failures++;
+        }
+    }
+
+    /* we have one fewer concurrent connections */
+    run->concurrency--;
+}
+
+int
+worker_response(running_t *run, myinfo_t *info, const unsigned char *buf, size_t length) {
+    int result = RESPONSE_INCOMPLETE;
+
+    /* With --pipeline, there can be several responses back-to-back
+     * in the same buffer */
+    while (length) {
+        size_t count;
+        uint64_t latency;
+        int is_finished = false;
+
+        if (info->time_first_byte == 0) {
+            info->time_first_byte = run->now;
+            worker_timeout_update(run, info);
+        }
+
+        /* The response to a HEAD ends with its header */
+        if (run->request_stats && info->pending)
+            info->http.is_head = run->conf->requests->entries[info->request_ids[info->oldest]].is_head;
+        else
+            info->http.is_head = info->is_head;
+
+        count = http_rsp_parse(&info->http, buf, length, &is_finished);
+        if (!is_finished)
+            return (count < length) ? RESPONSE_EXTRA : result;
+
+        /* A response to something we didn't ask for */
+        if (info->pending == 0)
+            return RESPONSE_EXTRA;
+
+        run->stats.http.recved.total++;
+
+        /* Record the latencies. With io_uring, we can see the response
+         * before the completion of the send, so we won't know the time */
+        if (info->time_sent && info->time_sent <= info->time_first_byte)
+            util_hdr_record(&run->stats.latency.first_byte, info->time_first_byte - info->time_sent);
+        latency = run->now - info->intended_times[info->oldest];
+        util_hdr_record(&run->stats.latency.response, latency);
+        stats_status_record(&run->stats, info->http.response_code, latency);
+        if (run->request_stats) {
+            request_stats_t *rs = &run->request_stats[info->request_ids[info->oldest]];
+
+            rs->responses++;
+            if (info->http.response_code < 200 || info->http.response_code >= 400)
+                rs->failures++;
+            util_hdr_record(&rs->latency, latency);
+        }
+        memset(&info->http, 0, sizeof(info->http));
+        info->time_first_byte = 0;
+        info->oldest = (info->oldest + 1) % run->conf->pipeline;
+        info->pending--;
+
+        result = RESPONSE_FINISHED;
+        buf += count;
+        length -= count;
+    }
+
+    if (result == RESPONSE_FINISHED)
+        worker_timeout_update(run, info);
+    return result;
+}
+
+static int
+_connection_close_error(running_t *run, socket_t fd, struct epoll_event *event, int reason, int error) {
+    myinfo_t *info = event->data.ptr;
+    int err;
+
+    /* Remove from our connection list */
+    err = epoll_ctl(run->epoll_fd, EPOLL_CTL_DEL, fd, event);
+    if (err) {
+        perror("epoll_ctl(EPOLL_CTL_DEL)");
+        exit(1);
+    }
+
+    /* Record statistics */
+    worker_closed(run, info, reason, error);
+
+    /* close the connection */
+    closesocket(fd);
+
+    /* put the info structure back into the pool */
+    worker_info_free(run, info);
+
+    return err;
+}
+
+static int
+_connection_close(running_t *run, socket_t fd, struct epoll_event *event, int reason) {
+    return _connection_close_error(run, fd, event, reason, 0);
+}
+
+/*
+ * In edge-triggered mode, we send until either we've sent the entire
+ * request or the socket's buffer is full, in which case we'll get an
+ * EPOLLOUT event when it's writable again.
+ * @return
+ *      0 on success, -1 if the connection was closed.
+ */
+static int
+_edge_send(running_t *run, struct epoll_event *event) {
+    myinfo_t *info = (myinfo_t*)event->data.ptr;
+
+    while (!_connection_is_sent(info)) {
+        ssize_t bytes_sent;
+
+        if (!info->is_writable)
+            return 0;
+
+        bytes_sent = send(  info->fd,
+                            info->request + info->request_sent,
+                            (int)(info->request_length - info->request_sent),
+                            MSG_NOSIGNAL);
+        if (bytes_sent > 0) {
+            info->request_sent += bytes_sent;
+        } else if (bytes_sent < 0 && (sockerrno == WSA(EWOULDBLOCK) || sockerrno == WSA(EAGAIN))) {
+            info->is_writable = false;
+            return 0;
+        } else {
+            _connection_close(run, info->fd, event, REASON_ERROR);
+            return -1;
+        }
+    }
+
+    if (!info->is_request_done) {
+        info->is_request_done = true;
+        worker_sent(run, info);
+    }
+    return 0;
+}
+
+/*
+ * Called by worker_arrivals() to start a request on an idle connection
+ * in edge-triggered mode.
+ */
+static void
+_edge_start(running_t *run, myinfo_t *info) {
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.data.ptr = info;
+    _edge_send(run, &event);
+}
+
+/*
+ * Handles an event in edge-triggered mode (--edge). Each socket is
+ * registered once for all the events we care about, and never modified
+ * with EPOLL_CTL_MOD. Instead, we remember whether the socket is writable,
+ * and always read until there's nothing left to read. EPOLLRDHUP is
+ * defined as 0 above, so we see the server close its side as recv()
+ * returning 0, the same as in level-triggered mode.
+ */
+static void
+_edge_event(running_t *run, struct epoll_event *event) {
+    unsigned flags = event->events;
+    myinfo_t *info = (myinfo_t*)event->data.ptr;
+    socket_t fd = info->fd;
+
+    if (flags & EPOLLERR) {
+        _connection_close(run, fd, event, REASON_ERROR);
+        return;
+    }
+
+    if (flags & EPOLLOUT) {
+        info->is_writable = true;
+        if (info->is_connected == 0) {
+            int error = worker_connected(run, info);
+            if (error) {
+                _connection_close_error(run, fd, event, REASON_ERROR, error);
+                return;
+            }
+
+            /* With --rate, the first request waits its turn */
+            if (worker_is_open_loop(run)) {
+                info->request_sent = info->request_length;
+                info->is_request_done = true;
+                worker_idle(run, info);
+            } else if (!worker_request_next(run, info)) {
+                _connection_close(run, fd, event, REASON_DONE);
+                return;
+            }
+        }
+        if (_edge_send(run, event) != 0)
+            return;
+    }
+
+    if (flags & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) {
+        unsigned char *buffer = run->recv_buffer;
+
+        for (;;) {
+            int bytes_read;
+            int x;
+
+            bytes_read = recv(fd, buffer, RECV_BUFFER_SIZE - 1, 0);
+            if (bytes_read == 0) {
+                _connection_close(run, fd, event, REASON_READEND);
+                return;
+            } else if (bytes_read < 0) {
+                if (sockerrno == WSA(EWOULDBLOCK) || sockerrno == WSA(EAGAIN))
+                    break;
+                _connection_close(run, fd, event, REASON_ERROR);
+                return;
+            }
+
+            x = worker_response(run, info, buffer, bytes_read);
+            if (x == RESPONSE_EXTRA) {
+                _connection_close(run, fd, event, REASON_PIPELINE);
+                return;
+            } else if (x == RESPONSE_FINISHED) {
+                if (worker_is_finished(run, info)) {
+                    _connection_close(run, fd, event, REASON_DONE);
+                    return;
+                }
+                if (worker_is_open_loop(run)) {
+                    worker_idle(run, info);
+                    continue;
+                }
+
+                /* With --pipeline, top up the requests once the last
+                 * batch has been sent */
+                if (!info->is_request_done)
+                    continue;
+                if (worker_request_next(run, info)) {
+                    if (_edge_send(run, event) != 0)
+                        return;
+                } else if (info->pending == 0) {
+                    _connection_close(run, fd, event, REASON_DONE);
+                    return;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Send a request on a connection that is waiting for a response. If
+ * we can't send all of it, then wait until the socket is writable.
+ */
+static void
+_connection_start(running_t *run, myinfo_t *info) {
+    worker_send(info);
+    if (!_connection_is_sent(info)) {
+        int err;
+        struct epoll_event eventmod;
+        memset(&eventmod, 0, sizeof(eventmod));
+        eventmod.data.ptr = info;
+        eventmod.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+        err = epoll_ctl(run->epoll_fd, EPOLL_CTL_MOD, info->fd, &eventmod);
+        if (err) {
+            perror("EPOLL_CTL_MOD");
+        }
+    } else {
+        worker_sent(run, info);
+    }
+}
+
+static int
+run_loop(const main_conf_t *conf, running_t *run) {
+    int n;
+    int i;
+    size_t count;
+    unsigned timeout;
+    myinfo_t *info;
+
+    run->now = util_time_ns();
+    if (!worker_is_running(run))
+        return 0;
+    worker_schedule(run);
+
+    /* Once we're stopping, connections waiting for their next
+     * request have nothing more to do */
+    while (run->is_stopping && run->idle) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.data.ptr = run->idle;
+        _connection_close(run, run->idle->fd, &event, REASON_DONE);
+    }
+
+    /* Close any connections that have timed out */
+    while ((info = worker_timeout_next(run)) != NULL) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.data.ptr = info;
+        _connection_close(run, info->fd, &event, info->timeout_reason);
+    }
+
+    /* If we don't have enough concurrent connections, then add
+     * some new ones, as many as --connect-rate allows */
+    count = worker_connect_budget(run);
+    while (count-- && _connection_create(conf, run) == 0)
+        ;
+    if (run->concurrency == 0 && !worker_is_paced(run))
+        return 0;
+
+    /*
+     * With --rate, start the requests whose time has come, and
+     * don't wait past the next one.
+     */
+    timeout = worker_arrivals(run, conf->is_edge_triggered ? _edge_start : _connection_start);
+    timeout = worker_connect_next(run, timeout);
+    timeout = util_timers_next(&run->timers, run->now / 1000000, timeout);
+
+    /*
+     * Now wait for incoming events
+     */
+    struct epoll_event *events = run->events;
+    n = epoll_wait( run->epoll_fd,
+                    events,
+                    (int)run->max_concurrency,
+                    (int)timeout);
+    run->now = util_time_ns();
+
+    /*
+     * process all the events that were returned
+     */
+    for (i = 0; i < n; i++) {
+        struct epoll_event *event = &events[i];
+        unsigned flags = event->events;
+        myinfo_t *info = (myinfo_t*)event->data.ptr;
+        socket_t fd = info->fd;
+
+        if (conf->is_edge_triggered) {
+            _edge_event(run, event);
+            continue;
+        }
+
+        /*
+         * A connect that fails is reported as writable as well as in
+         * error, so until we're connected, look for the error first,
+         * or we'd count it as a connection
+         */
+        if (!info->is_connected && (flags & (EPOLLERR | EPOLLHUP))) {
+            _connection_close(run, fd, event, REASON_ERROR);
+            continue;
+        }
+
+        /*
+        * This is where we SEND requests.
+        * This is where we detect CONNECTIONS.
+        */
+        if (flags & EPOLLOUT) {
+            if (info->is_connected == 0) {
+                int error = worker_connected(run, info);
+                if (error) {
+                    _connection_close_error(run, fd, event, REASON_ERROR, error);
+                    continue;
+                }
+
+                /* With --rate, the first request waits its turn */
+                if (worker_is_open_loop(run)) {
+                    struct epoll_event eventmod = *event;
+                    eventmod.events = EPOLLIN  | EPOLLRDHUP;
+                    if (epoll_ctl(run->epoll_fd, EPOLL_CTL_MOD, fd, &eventmod))
+                        perror("EPOLL_CTL_MOD");
+                    worker_idle(run, info);
+                    continue;
+                }
+                if (!worker_request_next(run, info)) {
+                    _connection_close(run, fd, event, REASON_DONE);
+                    continue;
+                }
+            }
+            if (worker_send(info) != 0 && sockerrno != WSA(EWOULDBLOCK) && sockerrno != WSA(EAGAIN)) {
+                _connection_close(run, fd, event, REASON_ERROR);
+                continue;
+            }
+
+            /* If we've sent everything, then modify our record
+             * so that we no longer receive this event */
+            if (_connection_is_sent(info)) {
+                int err;
+                struct epoll_event eventmod = *event;
+                eventmod.events = EPOLLIN  | EPOLLRDHUP;
+                err = epoll_ctl(run->epoll_fd, EPOLL_CTL_MOD, fd, &eventmod);
+                if (err) {
+                    perror("EPOLL_CTL_MOD");
+                }
+                worker_sent(run, info);
+            }
+            continue;
+        }
+
+
+        if (flags & EPOLLERR) {
+            _connection_close(run, fd, event, REASON_ERROR);
+            continue;
+        }
+
+
+        /*
+         * This is where we RECEIVE responses.
+         * This is where we also will SEND requests (after
+         * receiving a complete response).
+         */
+        if (flags & EPOLLIN) {
+            unsigned char *buffer = run->recv_buffer;
+            int bytes_read = recv(fd, buffer, RECV_BUFFER_SIZE - 1, 0);
+            if (bytes_read > 0) {
+                int x;
+                x = worker_response(run, info, buffer, bytes_read);
+                if (x == RESPONSE_EXTRA) {
+                    _connection_close(run, fd, event, REASON_PIPELINE);
+                } else if (x == RESPONSE_FINISHED) {
+                    if (flags & EPOLLHUP) {
+                        _connection_close(run, fd, event, REASON_HANGUP);
+                        continue;
+                    }
+                    if (flags & EPOLLRDHUP) {
+                        _connection_close(run, fd, event, REASON_HANGUP2);
+                        continue;
+                    }
+
+                    if (worker_is_finished(run, info)) {
+                        _connection_close(run, fd, event, REASON_DONE);
+                        continue;
+                    }
+                    if (worker_is_open_loop(run)) {
+                        worker_idle(run, info);
+                        continue;
+                    }
+                    /* With --pipeline, top up the requests once the
+                     * last batch has been sent */
+                    if (!_connection_is_sent(info))
+                        continue;
+                    if (worker_request_next(run, info))
+                        _connection_start(run, info);
+                    else if (info->pending == 0)
+                        _connection_close(run, fd, event, REASON_DONE);
+                } else {
+                    /* continue waiting for the response to be finished */
+                    if (flags & EPOLLHUP) {
+                        _connection_close(run, fd, event, REASON_UNKNOWNx);
+                        continue;
+                    }
+                    if (flags & EPOLLRDHUP) {
+                        _connection_close(run, fd, event, REASON_UNKNOWNx);
+                        continue;
+                    }
+                }
+
+            } else if (bytes_read == 0) {
+                if (flags & EPOLLHUP) {
+                    _connection_close(run, fd, event, REASON_HANGUP);
+                    continue;
+                }
+                if (flags & EPOLLRDHUP) {
+                    _connection_close(run, fd, event, REASON_HANGUP2);
+                    continue;
+                }
+                _connection_close(run, fd, event, REASON_READEND);
+                continue;
+            } else if (bytes_read < 0) {
+                _connection_close(run, fd, event, REASON_ERROR);
+            }
+            continue;
+        }
+
+        if (flags & EPOLLHUP) {
+            _connection_close(run, fd, event, REASON_HANGUP);
+            continue;
+        }
+
+        if (flags & EPOLLRDHUP) {
+            _connection_close(run, fd, event, REASON_HANGUP2);
+            continue;
+        }
+
+        fprintf(stderr, "unknown\n");
+    }
+
+
+    return 1;
+}
+
+/*
+ * Takes the slice [index..count) of the list of addresses, so that
+ * each worker uses a different subset. If there are fewer addresses
+ * than workers, then all the workers share the full list.
+ */
+static void
+_addresses_slice(const struct sockaddr_storage *list, size_t list_count,
+    unsigned index, unsigned count,
+    const struct sockaddr_storage **r_list, size_t *r_count) {
+    size_t start;
+    size_t end;
+
+    if (list_count < count) {
+        *r_list = list;
+        *r_count = list_count;
+        return;
+    }
+
+    start = list_count * index / count;
+    end = list_count * (index + 1) / count;
+    *r_list = list + start;
+    *r_count = end - start;
+}
+
+/*
+ * We can only connect if at least one source address is the same
+ * family (IPv4 or IPv6) as one of the targets.
+ */
+static int
+_addresses_is_usable(const running_t *run) {
+    size_t i;
+    size_t j;
+
+    if (run->sources_count == 0)
+        return 1;
+    for (i = 0; i < run->targets_count; i++) {
+        for (j = 0; j < run->sources_count; j++) {
+            if (run->targets[i].ss_family == run->sources[j].ss_family)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+running_t *
+worker_create(const main_conf_t *conf, unsigned index, unsigned count) {
+    running_t *run;
+
+    /*
+     * This sets up the running job. This contains everything
+     * that changes during each run through the loop.
+     */
+    run = calloc(1, sizeof(*run));
+    run->conf = conf;
+    run->index = index;
+
+    /*
+     * Our share of the concurrent connections. Any remainder
+     * is spread across the first workers.
+     */
+    run->max_concurrency = conf->concurrent_connections / count;
+    if (index < conf->concurrent_connections % count)
+        run->max_concurrency++;
+    run->target_concurrency = run->max_concurrency;
+
+    /* Each worker sends its share of the requests with --rate, and
+     * opens its share of the connections with --connect-rate */
+    run->rate = conf->rate / count;
+    run->connect_rate = conf->connect_rate / count;
+
+    /* The timeouts, and the timer wheel for them */
+    run->timeout_connect = (uint64_t)(conf->timeout_connect * 1000000000.0);
+    run->timeout_first_byte = (uint64_t)(conf->timeout_first_byte * 1000000000.0);
+    run->timeout_response = (uint64_t)(conf->timeout_response * 1000000000.0);
+    util_timers_init(&run->timers, util_time_ns() / 1000000);
+
+    /* Our share of the total number of requests (-n) */
+    if (conf->request_count) {
+        run->request_max = conf->request_count / count;
+        if (index < conf->request_count % count)
+            run->request_max++;
+    } else
+        run->request_max = ~0ULL;
+
+    /*
+     * Our share of the addresses.
+     */
+    _addresses_slice(conf->targets, conf->targets_count, index, count,
+        &run->targets, &run->targets_count);
+    _addresses_slice(conf->sources, conf->sources_count, index, count,
+        &run->sources, &run->sources_count);
+    if (!_addresses_is_usable(run)) {
+        run->targets = conf->targets;
+        run->targets_count = conf->targets_count;
+        run->sources = conf->sources;
+        run->sources_count = conf->sources_count;
+    }
+
+    /*
+     * Our share of the source ports. Unlike the addresses, these are
+     * never shared, so workers never try to bind the same port.
+     */
+    if (conf->source_port_count) {
+        unsigned share = conf->source_port_count / count;
+        unsigned extra = conf->source_port_count % count;
+
+        run->port_first = conf->source_port_first + index * share + ((index < extra) ? index : extra);
+        run->port_count = share + (index < extra);
+    }
+
+    /* Each (source, target) pair has the ports to itself, but if
+     * between them they don't have a port for every connection, we'd
+     * spend the run failing to open the rest */
+    if (run->port_count) {
+        size_t pairs = (run->sources_count ? run->sources_count : 1) * run->targets_count;
+
+        if (run->port_count * pairs < run->max_concurrency) {
+            tui_norm_screen();
+            fprintf(stderr, "[-] source-ports: worker %u has %u ports for %u connections to %u address pairs\n",
+                index, run->port_count, (unsigned)run->max_concurrency, (unsigned)pairs);
+            fprintf(stderr, "[-] source-ports: need at least as many ports as connections (-c), or more addresses\n");
+            return NULL;
+        }
+    }
+
+    /*
+     * Seed random number generator, either ChaCha20 or the faster
+     * xoshiro256** (--prng), from the --seed (or the clock) and the
+     * worker index, so each worker has a stream of its own, but the
+     * same seed gives every worker the same stream as last time. Both
+     * are written out least-significant byte first, so that's true
+     * across machines as well.
+     */
+    {
+        unsigned char seed[12];
+        size_t i;
+
+        for (i = 0; i < 8; i++)
+            seed[i] = (unsigned char)(conf->seed >> (i * 8));
+        for (i = 0; i < 4; i++)
+            seed[8 + i] = (unsigned char)(index >> (i * 8));
+        util_rand_seed_kind(&run->r, (enum util_rand_kind_t)conf->prng, seed, sizeof(seed));
+    }
+
+    /*
+     * Which CPU to pin the worker thread to, if any
+     */
+    if (conf->affinity_count)
+        run->cpu = (int)conf->affinity[index % conf->affinity_count];
+    else
+        run->cpu = -1;
+
+    /*
+     * This created the central epoll event.
+     */
+    run->epoll_fd = epoll_create1(0);
+    if (run->epoll_fd < 0) {
+        fprintf(stderr, "[-] epoll_create1: %s\n", sock_strerror(sockerrno));
+        return NULL;
+    }
+
+    return run;
+}
+
+/*
+ * Allocates the tables that the worker uses in its event loop. This is
+ * called from the worker thread after it's been pinned to its CPU.
+ * Linux allocates physical pages on the NUMA node of the CPU that first
+ * writes to them, so we explicitly zero the memory here, rather than
+ * relying upon calloc(), which skips that step for fresh pages.
+ */
+static void
+_worker_alloc(running_t *run) {
+    size_t i;
+
+    /*
+     * This creates a buffer that receives the list of incoming
+     * events for each call to epoll_wait()
+     */
+    run->events = malloc(run->max_concurrency * sizeof(*run->events));
+    run->recv_buffer = malloc(RECV_BUFFER_SIZE);
+    if (run->events == NULL || run->recv_buffer == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    memset(run->events, 0, run->max_concurrency * sizeof(*run->events));
+    memset(run->recv_buffer, 0, RECV_BUFFER_SIZE);
+
+    /*
+     * This creates a pool of allocated objects to contains the data
+     * we associate with each connection. We use this pool instead
+     * of malloc()/free() for each connection */
+    run->pool = malloc(run->max_concurrency * sizeof(*run->pool));
+    if (run->pool == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    memset(run->pool, 0, run->max_concurrency * sizeof(*run->pool));
+
+    /* The start times of the outstanding requests, --pipeline of them
+     * for each connection */
+    run->intended_times = malloc(run->max_concurrency * run->conf->pipeline * sizeof(uint64_t));
+    if (run->intended_times == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    memset(run->intended_times, 0, run->max_concurrency * run->conf->pipeline * sizeof(uint64_t));
+
+    /* Our share of the --replay log, and a buffer for building each
+     * connection's request from it */
+    if (run->conf->replay) {
+        replay_cursor_init(&run->replay, run->conf->replay, run->index, run->conf->thread_count);
+        run->replay_requests = calloc(run->max_concurrency, sizeof(*run->replay_requests));
+        if (run->replay_requests == NULL) {
+            fprintf(stderr, "[-] FATAL: out of memory\n");
+            exit(1);
+        }
+    }
+
+    /* Each connection's buffer for filling in {{placeholders}} */
+    if (run->conf->template_max_length) {
+        size_t size = run->max_concurrency * run->conf->pipeline * run->conf->template_max_length;
+
+        run->template_requests = malloc(size);
+        if (run->template_requests == NULL) {
+            fprintf(stderr, "[-] FATAL: out of memory\n");
+            exit(1);
+        }
+        memset(run->template_requests, 0, size);
+    }
+
+    /* Which of the --requests each of those was, and their counts */
+    if (run->conf->requests) {
+        run->request_ids = calloc(run->max_concurrency * run->conf->pipeline, sizeof(*run->request_ids));
+        run->request_stats = calloc(run->conf->requests->count, sizeof(*run->request_stats));
+        if (run->request_ids == NULL || run->request_stats == NULL) {
+            fprintf(stderr, "[-] FATAL: out of memory\n");
+            exit(1);
+        }
+    }
+
+    for (i=0; i<run->max_concurrency; i++) {
+        myinfo_t *info = &run->pool[i];
+        info->next = run->freed;
+        run->freed = info;
+    }
+
+    /* The source port allocators (--source-ports) */
+    if (run->port_count) {
+        size_t count = (run->sources_count ? run->sources_count : 1) * run->targets_count;
+        size_t words = util_ports_words(run->port_count);
+
+        run->ports = malloc(count * sizeof(*run->ports));
+        run->ports_bitmap = malloc(count * words * sizeof(*run->ports_bitmap));
+        if (run->ports == NULL || run->ports_bitmap == NULL) {
+            fprintf(stderr, "[-] FATAL: out of memory\n");
+            exit(1);
+        }
+        for (i=0; i<count; i++)
+            util_ports_init(&run->ports[i], run->port_first, run->port_count, run->ports_bitmap + i * words);
+    }
+}
+
+void
+worker_thread(void *v) {
+    running_t *run = (running_t *)v;
+
+    /*
+     * Pin ourselves to our CPU before allocating memory, so that the
+     * memory will be local to it.
+     */
+    if (run->cpu >= 0 && util_thread_setaffinity((unsigned)run->cpu) != 0) {
+        tui_norm_screen();
+        fprintf(stderr, "[-] worker %u: can't set affinity to CPU %d\n", run->index, run->cpu);
+    }
+    _worker_alloc(run);
+
+    if (run->conf->duration > 0.0)
+        run->time_end = util_time_ns() + (uint64_t)(run->conf->duration * 1000000000.0);
+
+    /*
+     * now run the job until we've sent the total number
+     * of requests we were supposed to
+     */
+    if (run->conf->engine == ENGINE_URING) {
+        if (uring_worker_init(run) != 0) {
+            tui_norm_screen();
+            fprintf(stderr, "[-] FATAL: io_uring engine failed, use '--engine epoll'\n");
+            exit(1);
+        }
+        while (uring_run_loop(run))
+            ;
+    } else {
+        while (run_loop(run->conf, run))
+            ;
+    }
+
+    run->time_done = util_time_ns();
+    run->is_done = 1;
+}
+
+/*
+ * Run a worker for a moment against a socket on the loopback address,
+ * either one that isn't listening, so every connect is refused, or one
+ * with a full backlog, so that most of them never complete.
+ */
+static int
+_selftest_run(main_conf_t *conf, int is_listening, int is_edge, statistics_t *stats) {
+    static const char request[] = "GET / HTTP/1.1\r\nHost: selftest\r\n\r\n";
+    struct sockaddr_storage target;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&target;
+    socklen_t len = sizeof(target);
+    running_t *run;
+    socket_t fd;
+
+    /* Keep the socket bound, so that nothing else takes the port */
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == (socket_t)-1)
+        return -1;
+    memset(&target, 0, sizeof(target));
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(0x7f000001);
+    if (bind(fd, (struct sockaddr *)&target, sizeof(*sin)) != 0
+        || getsockname(fd, (struct sockaddr *)&target, &len) != 0
+        || (is_listening && listen(fd, 0) != 0)) {
+        closesocket(fd);
+        return -1;
+    }
+
+    memset(conf, 0, sizeof(*conf));
+    conf->concurrent_connections = 4;
+    conf->thread_count = 1;
+    conf->duration = 0.02;
+    conf->drain_timeout = 0.05;
+    conf->timeout_connect = 0.005;
+    conf->timeout_first_byte = 0.005;
+    conf->pipeline = 1;
+    conf->request = (unsigned char *)request;
+    conf->request_length = sizeof(request) - 1;
+    conf->pipeline_request = conf->request;
+    conf->targets = &target;
+    conf->targets_count = 1;
+    conf->is_edge_triggered = is_edge;
+
+    run = worker_create(conf, 0, 1);
+    if (run == NULL) {
+        closesocket(fd);
+        return -1;
+    }
+    worker_thread(run);
+    *stats = run->stats;
+
+    /* The drain can leave connects outstanding */
+    while (run->active) {
+        closesocket(run->active->fd);
+        worker_info_free(run, run->active);
+    }
+#ifdef _WIN32
+    epoll_close(run->epoll_fd);
+#else
+    close(run->epoll_fd);
+#endif
+    closesocket(fd);
+    free(run->events);
+    free(run->recv_buffer);
+    free(run->pool);
+    free(run->intended_times);
+    free(run);
+    return 0;
+}
+
+int
+worker_selftest_network(void) {
+    main_conf_t conf;
+    statistics_t stats;
+    int is_edge;
+
+    for (is_edge = 0; is_edge < 2; is_edge++) {
+        /* Windows doesn't have --edge */
+        if (is_edge && EPOLLET == 0)
+            break;
+
+        /* A refused connect is a failure, not a connection, and
+         * doesn't have a connect time */
+        if (_selftest_run(&conf, 0, is_edge, &stats) != 0)
+            goto fail;
+        if (stats.con.attempted.total == 0 || stats.con.succeeded.total != 0)
+            goto fail;
+        if (stats.con.failed.total != stats.con.attempted.total)
+            goto fail;
+        if (stats.errors[stats_errno_index(WSA(ECONNREFUSED))].total != stats.con.failed.total)
+            goto fail;
+        if (stats.latency.connect.count != 0)
+            goto fail;
+
+        /* With the backlog full, the connects that don't complete
+         * time out, rather than hang around until the drain */
+        if (_selftest_run(&conf, 1, is_edge, &stats) != 0)
+            goto fail;
+        if (stats.con.timeout_connect.total == 0)
+            goto fail;
+        if (stats.con.succeeded.total + stats.con.timeout_connect.total > stats.con.attempted.total)
+            goto fail;
+    }
+    return 0;
+fail:
+    fprintf(stderr, "[-] worker: programming error\n");
+    return 1;
+}
+
+/*
+ * Three pipelined --requests, a HEAD, a GET, and another HEAD. The
+ * HEAD's response ends at its header, so the GET's follows it in the
+ * same buffer. The last one never comes, and when the connection times
+ * out, it's charged to the HEAD as a failure.
+ */
+int
+worker_selftest(void) {
+    static const char responses[] =
+        "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n"
+        "HTTP/1.1 404 Not Found\r\nContent-Length: 2\r\n\r\nno";
+    main_conf_t conf = {0};
+    request_entry_t entries[2];
+    request_set_t set = {0};
+    request_stats_t *rs;
+    running_t *run;
+    myinfo_t info = {0};
+    uint64_t intended_times[3] = {0};
+    unsigned request_ids[3] = {1, 0, 1};
+    int x;
+
+    memset(entries, 0, sizeof(entries));
+    entries[1].is_head = true;
+    set.entries = entries;
+    set.count = 2;
+    conf.requests = &set;
+    conf.pipeline = 3;
+
+    run = calloc(1, sizeof(*run));
+    rs = calloc(set.count, sizeof(*rs));
+    if (run == NULL || rs == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    run->conf = &conf;
+    run->request_stats = rs;
+    run->concurrency = 1;
+    run->now = 1000000;
+
+    info.is_connected = 1;
+    info.intended_times = intended_times;
+    info.request_ids = request_ids;
+    info.pending = 3;
+
+    x = worker_response(run, &info, (const unsigned char *)responses, sizeof(responses) - 1);
+    if (x != RESPONSE_FINISHED || info.pending != 1 || info.oldest != 2)
+        goto fail;
+    if (rs[1].responses != 1 || rs[1].failures != 0)
+        goto fail;
+    if (rs[0].responses != 1 || rs[0].failures != 1)
+        goto fail;
+
+    worker_closed(run, &info, REASON_TIMEOUT_RESPONSE, 0);
+    if (rs[1].failures != 1 || run->stats.con.timeout_response.total != 1)
+        goto fail;
+
+    free(rs);
+    free(run);
+    return 0;
+fail:
+    free(rs);
+    free(run);
+    fprintf(stderr, "[-] worker: programming error\n");
+    return 1;
+}
@@ -0,0 +1,476 @@
+/*
+    Worker threads
+
+ Each worker thread runs its own event loop, with its own epoll
+ instance, pool of connections, random number generator, and
+ statistics. Workers share nothing but the read-only configuration,
+ so they never need to synchronize with each other. The main
+ thread only reads their statistics in order to display them.
+ */
+#ifndef MAIN_WORKER_H
+#define MAIN_WORKER_H
+#include "main-stats.h"
+#include "util-rand.h"
+#include "util-timer.h"
+#include "util-ports.h"
+#include "main-requests.h"
+#include "main-replay.h"
+#include "http-response.h"
+#include <stdio.h>
+
+#ifdef _WIN32
+#include "win-sockets.h"
+#include "win-epoll.h"
+#else
+#include "unix-sockets.h"
+#endif
+struct main_conf_t;
+
+/* The size of the buffers we recv() responses into */
+#define RECV_BUFFER_SIZE 1024
+
+/* Why a connection was closed, see `worker_closed()`. REASON_DONE is
+ * when we close it ourselves at the end of the run. */
+enum {REASON_ERROR, REASON_HANGUP, REASON_HANGUP2, REASON_READEND, REASON_PIPELINE, REASON_UNKNOWNx, REASON_DONE,
+    REASON_TIMEOUT_CONNECT, REASON_TIMEOUT_FIRST_BYTE, REASON_TIMEOUT_RESPONSE};
+
+/* What `worker_response()` found in the received data */
+enum {RESPONSE_INCOMPLETE, RESPONSE_FINISHED, RESPONSE_EXTRA};
+
+typedef struct myinfo_t {
+    socket_t fd;
+    const char *request;
+    size_t request_sent;
+    size_t request_length;
+    struct myinfo_t *next;
+    int is_connected;
+    http_response_t http;
+
+    /* The number of requests in the current send buffer, which can
+     * be more than one with --pipeline */
+    unsigned request_batch;
+
+    /* The requests we're waiting for responses to (up to --pipeline),
+     * as a ring of when each was supposed to start (nanoseconds). With
+     * --rate, this is when it was scheduled, which may be earlier than
+     * when we actually sent it, so that latency includes the time
+     * spent waiting for a free connection. */
+    uint64_t *intended_times;
+    unsigned pending;
+    unsigned oldest;
+
+    /* With --requests, which one each of those was, in the same ring */
+    unsigned *request_ids;
+
+    /* With --replay, where there's only one at a time, whether it's
+     * a HEAD */
+    bool is_head;
+
+    /* Timestamps (nanoseconds) for the latency histograms: when we
+     * started connecting, when the connection completed, when the
+     * current request was fully sent, and when the first byte of
+     * its response arrived (or 0 if it hasn't yet) */
+    uint64_t time_connect;
+    uint64_t time_connected;
+    uint64_t time_sent;
+    uint64_t time_first_byte;
+
+    /* The next deadline for this connection (--connect-timeout, etc.),
+     * and the REASON_TIMEOUT_xxx for when it expires */
+    util_timer_t timer;
+    int timeout_reason;
+
+    /* The source port we chose (--source-ports), and the allocator
+     * to give it back to when the socket is closed, or NULL */
+    util_ports_t *ports;
+    unsigned source_port;
+
+    /* With --rate, connections waiting for their next request are kept
+     * on the worker's idle list */
+    struct myinfo_t *idle_prev;
+    struct myinfo_t *idle_next;
+    bool is_idle : 1;
+
+    /* Used in edge-triggered mode (--edge), where we don't get
+     * another EPOLLOUT until a send() fails with EAGAIN */
+    bool is_writable : 1;
+    bool is_request_done : 1;
+
+    /* Used by the io_uring engine, which can't reuse this record
+     * until all the operations submitted for it have completed */
+    unsigned uring_pending;
+    bool is_closing : 1;
+    bool is_send_pending : 1;
+    bool is_send_next : 1;
+} myinfo_t;
+
+typedef struct running_t {
+    const struct main_conf_t *conf;
+
+    /* Which worker this is [0..count) */
+    unsigned index;
+
+    /* The number of connections that are currently open, and
+     * the number this worker tries to keep open, which is this
+     * worker's share of the total '-c' concurrency. */
+    size_t concurrency;
+    size_t max_concurrency;
+
+    /* With --schedule, the number of connections we're aiming for
+     * right now, which is never more than the above */
+    size_t target_concurrency;
+
+    /* The subset of target/source addresses that this worker
+     * uses, or the entire list if there are more workers than
+     * addresses. */
+    const struct sockaddr_storage *targets;
+    size_t targets_count;
+    const struct sockaddr_storage *sources;
+    size_t sources_count;
+
+    /* With --source-ports, the source port allocators, one for each
+     * (source, target) pair, indexed by source*targets_count+target,
+     * all sharing this worker's share of the range. Without a source
+     * address, there's one for each target. */
+    util_ports_t *ports;
+    uint64_t *ports_bitmap;
+    unsigned port_first;
+    unsigned port_count;
+
+#ifdef _WIN32
+    HANDLE epoll_fd;
+#else
+    int epoll_fd;
+#endif
+    struct epoll_event *events;
+    myinfo_t *pool;
+    uint64_t *intended_times;
+    unsigned *request_ids;
+    myinfo_t *active;
+    myinfo_t *freed;
+
+    /* Where we recv() responses into */
+    unsigned char *recv_buffer;
+
+    /* The CPU this worker is pinned to (--affinity), or -1 if it
+     * can run anywhere */
+    int cpu;
+
+    /* The state of the io_uring engine (--engine uring) */
+    struct uring_t *uring;
+
+    /* The current time (nanoseconds), updated once per batch of events,
+     * and the time the run started, which is the same for all the
+     * workers, for following the --schedule */
+    uint64_t now;
+    uint64_t time_start;
+
+    /* For open-loop load (--rate): this worker's share of the rate,
+     * the time the next request is due, and the connections that
+     * are free to send it */
+    double rate;
+    uint64_t next_arrival;
+    myinfo_t *idle;
+
+    /* For --connect-rate: this worker's share of the rate, and the
+     * token bucket of connections we're allowed to open */
+    double connect_rate;
+    double connect_tokens;
+    uint64_t connect_last;
+
+    /* After a connection couldn't even be started, such as when we've
+     * run out of file descriptors, we don't try again until this time */
+    uint64_t connect_backoff;
+
+    /* The number of requests we've started, and our share of the
+     * total (-n), or ~0 if there's no limit */
+    uint64_t request_count;
+    uint64_t request_max;
+
+    /* When the run ends (--duration), or 0 if it doesn't. Once we
+     * are stopping, no new requests are started, and we wait until
+     * the drain deadline for the outstanding responses */
+    uint64_t time_end;
+    uint64_t drain_deadline;
+    bool is_stopping;
+
+    /* The timeouts (nanoseconds), or 0 if not used, and the
+     * connections waiting for them */
+    uint64_t timeout_connect;
+    uint64_t timeout_first_byte;
+    uint64_t timeout_response;
+    util_timers_t timers;
+
+    statistics_t stats;
+    util_rand_t r;
+
+    /* With --requests, the counts for each of them */
+    request_stats_t *request_stats;
+
+    /* With --replay, our place in the log, the next line to send (if
+     * 'is_replay_line'), and a buffer for each connection's request */
+    replay_cursor_t replay;
+    replay_line_t replay_line;
+    bool is_replay_line;
+    unsigned char **replay_requests;
+
+    /* With {{placeholders}}, a buffer for each connection's requests,
+     * with room for --pipeline of them, and the number of requests
+     * we've filled in, for {{seq}} */
+    unsigned char *template_requests;
+    uint64_t template_sequence;
+
+    /* Set by the worker thread when it's finished running, so
+     * that the main thread knows when to stop waiting, and when
+     * it finished */
+    volatile int is_done;
+    uint64_t time_done;
+
+    /* Set by the main thread with --find-max: the total load (for all
+     * the workers) to run at, and when the search is over */
+    volatile double control;
+    volatile int is_stop_requested;
+} running_t;
+
+/**
+ * Create the 'index' worker out of 'count' workers, giving it
+ * its share of the connections and addresses. The large per-connection
+ * tables aren't allocated here, but by the worker thread itself
+ * once it's been pinned to its CPU, so that they are local to that
+ * CPU's NUMA node.
+ */
+running_t *
+worker_create(const struct main_conf_t *conf, unsigned index, unsigned count);
+
+/*
+ * The following are used by the event loops (epoll and io_uring) to
+ * share the same per-connection state machine.
+ */
+
+/**
+ * Get a connection record from the pool.
+ */
+myinfo_t *
+worker_info_alloc(running_t *run);
+
+/**
+ * Return a connection record to the pool.
+ */
+void
+worker_info_free(running_t *run, myinfo_t *info);
+
+/**
+ * Create a socket for a new connection, choosing a random source and
+ * target address, and binding to the source. This doesn't connect
+ * the socket, but returns the target address to connect to. With
+ * --source-ports, it also returns the port it bound to, and its
+ * allocator, which the caller stores in the connection record so
+ * that `worker_info_free()` can give it back.
+ * @return
+ *      the new socket, or -1 on failure, which is counted as a failed
+ *      connection, and holds off new ones for a moment.
+ */
+socket_t
+worker_socket(running_t *run, const struct sockaddr **r_target, int *r_target_length,
+        util_ports_t **r_ports, unsigned *r_port);
+
+/**
+ * Follow the --schedule (or --find-max), if any, setting this worker's
+ * share of the connections or request rate for the current time.
+ */
+void
+worker_schedule(running_t *run);
+
+/**
+ * Whether we're holding back on opening connections on purpose
+ * (--connect-rate, --schedule, or --find-max), in which case having none open
+ * doesn't mean we can't.
+ */
+bool
+worker_is_paced(const running_t *run);
+
+/**
+ * Whether requests go out on a schedule of their own (--rate, or a
+ * timed --replay) rather than as soon as the last response is in, in
+ * which case connections wait on the idle list for their turn.
+ */
+bool
+worker_is_open_loop(const running_t *run);
+
+/**
+ * The number of new connections to open now, to bring us back up to
+ * our share of the concurrency, but no faster than --connect-rate.
+ */
+size_t
+worker_connect_budget(running_t *run);
+
+/**
+ * The number of milliseconds until we can open another connection,
+ * for the event loop's timeout, no more than 'max'.
+ */
+unsigned
+worker_connect_next(running_t *run, unsigned max);
+
+/**
+ * Whether the connection should be closed now that all its responses
+ * have been received, rather than reused (--new-conn-per-request).
+ */
+bool
+worker_is_finished(running_t *run, myinfo_t *info);
+
+/**
+ * Send as much of the remaining request as the socket will
+ * accept without blocking.
+ * @return
+ *      0 on success, -1 on failure.
+ */
+int
+worker_send(myinfo_t *info);
+
+/**
+ * Called when a connect completes, to count it and record how long
+ * it took, but only if the socket has no error, as a connect that
+ * failed also makes the socket writable.
+ * @return
+ *      0 if it connected, or else the error, which the caller closes
+ *      the connection with.
+ */
+int
+worker_connected(running_t *run, myinfo_t *info);
+
+/**
+ * Called when the request has been completely sent, to count it,
+ * and to remember the time.
+ */
+void
+worker_sent(running_t *run, myinfo_t *info);
+
+/**
+ * Called before starting each request, to count it against the
+ * limit (-n) and check the time (--duration).
+ * @return
+ *      true if the request can go ahead, or false if we've reached
+ *      the end of the run, in which case the caller should close the
+ *      connection (REASON_DONE) once nothing is outstanding on it
+ */
+bool
+worker_request_begin(running_t *run);
+
+/**
+ * Called at the start of each pass through an event loop, after
+ * updating `run->now`, to check whether the run has ended.
+ * @return
+ *      true if we should keep running, false if we've stopped and
+ *      either drained all the connections or reached the deadline
+ */
+bool
+worker_is_running(running_t *run);
+
+/**
+ * Set up the connection to send one request, which was supposed
+ * to start at 'intended_time'. The caller has already checked
+ * `worker_request_begin()`.
+ */
+void
+worker_request_init(running_t *run, myinfo_t *info, uint64_t intended_time);
+
+/**
+ * Set up the connection to send as many requests as it takes to have
+ * --pipeline of them outstanding, each checked with
+ * `worker_request_begin()`.
+ * @return
+ *      the number of requests to send, or 0 if there are none, because
+ *      the pipeline is full, or because we've reached the end of
+ *      the run
+ */
+unsigned
+worker_request_next(running_t *run, myinfo_t *info);
+
+/**
+ * With --rate, put a connection that has nothing to do on the idle
+ * list, to wait for the next scheduled request.
+ */
+void
+worker_idle(running_t *run, myinfo_t *info);
+
+/**
+ * With --rate, start all the requests that are due, by calling 'start()'
+ * for each one with an idle connection. Requests are due at fixed or
+ * random (Poisson) intervals, regardless of how fast the server is
+ * responding. If there aren't enough idle connections, then the requests
+ * are delayed, but still scheduled for their original time.
+ * @return
+ *      the number of milliseconds until the next request is due,
+ *      for the event loop's timeout
+ */
+unsigned
+worker_arrivals(running_t *run, void (*start)(running_t *run, myinfo_t *info));
+
+/**
+ * Re-arm the connection's timer for whichever of its deadlines is
+ * next, given how far along it is: connecting, waiting for the first
+ * byte of the response, or waiting for the whole response. Called
+ * whenever it moves from one to the next.
+ */
+void
+worker_timeout_update(running_t *run, myinfo_t *info);
+
+/**
+ * Find a connection whose deadline has passed. The caller closes it
+ * with `info->timeout_reason`, and calls this again until it
+ * returns NULL.
+ */
+myinfo_t *
+worker_timeout_next(running_t *run);
+
+/**
+ * Parse received data as part of the response. When the response
+ * is finished, the parser is reset for the next response. With
+ * --pipeline, the data can hold several responses back-to-back.
+ * @return
+ *      one of RESPONSE_INCOMPLETE, RESPONSE_FINISHED if at least one
+ *      response finished, or RESPONSE_EXTRA if there's data beyond the
+ *      end of the last response we were waiting for.
+ */
+int
+worker_response(running_t *run, myinfo_t *info, const unsigned char *buf, size_t length);
+
+/**
+ * Count a socket error, such as from socket(), bind(), or connect(),
+ * or the reason a connection was closed.
+ */
+void
+worker_error(running_t *run, int error);
+
+/**
+ * Record the statistics for a connection that's being closed, for
+ * the given REASON_xxx. The caller still owns the socket and the
+ * record, and must close/free them afterwards.
+ * @param error
+ *      For REASON_ERROR, the socket error if the caller knows it,
+ *      or 0 to read it from the socket.
+ */
+void
+worker_closed(running_t *run, myinfo_t *info, int reason, int error);
+
+/**
+ * The thread function, which runs the event loop until
+ * there's nothing left to do.
+ */
+void
+worker_thread(void *v);
+
+/**
+ * Checks that need no network, run every time nxbench starts
+ */
+int
+worker_selftest(void);
+
+/**
+ * Checks that run workers against sockets on the loopback address,
+ * which take a moment, and so are only run with --selftest
+ */
+int
+worker_selftest_network(void);
+
+#endif
@@ -1,6 +1,23 @@
 #include "main-conf.h"
+#include "main-worker.h"
+#include "main-stats.h"
+#include "main-schedule.h"
+#include "main-findmax.h"
+#include "main-output.h"
+#include "main-manifest.h"
+#include "main-metrics.h"
+#include "main-requests.h"
+#include "main-replay.h"
+#include "main-template.h"
+#include "main-uring.h"
 #include "util-tui.h"
-#include "util-rand.h" /* truely random numbers */
+#include "util-thread.h"
+#include "util-hdr.h"
+#include "util-timer.h"
+#include "util-ports.h"
+#include "util-dist.h"
+#include "util-rand.h"
+#include "util-time.h"
 #include "main-pretest.h"
 #include "http-response.h"
 #include <stdio.h>
@@ -12,110 +29,11 @@
 
 #ifdef _WIN32
 #include "win-sockets.h"
-#include "win-epoll.h"
 #else
 #include <unistd.h>
 #include "unix-sockets.h"
 #endif
 
-#define BUFFER_SIZE 1024
-
-#undef EPOLLRDHUP
-#define EPOLLRDHUP 0
-
-enum {REASON_ERROR, REASON_HANGUP, REASON_HANGUP2, REASON_READEND, REASON_PIPELINE, REASON_UNKNOWNx};
-
-typedef struct counter_t {
-    uint64_t total;
-    uint64_t last;
-    uint64_t rate;
-} counter_t;
-
-typedef struct statistics_t {
-    counter_t first;
-    struct {
-        counter_t attempted;
-        counter_t failed;
-        counter_t succeeded;
-        counter_t error;
-        counter_t read;
-        counter_t hangup;
-        counter_t hangup2;
-        counter_t pipeline;
-        counter_t unknown;
-    } con;
-    struct {
-        counter_t sent;
-        counter_t recved;
-        counter_t n100;
-        counter_t n200;
-        counter_t n300;
-        counter_t n400;
-        counter_t n500;
-    } http;
-
-    counter_t last;
-} statistics_t;
-
-typedef struct myinfo_t {
-    socket_t fd;
-    const char *request;
-    size_t request_sent;
-    size_t request_length;
-    struct myinfo_t *next;
-    int is_connected;
-    http_response_t http;
-} myinfo_t;
-
-typedef struct running_t {
-    size_t concurrency;
-#ifdef _WIN32
-    HANDLE epoll_fd;
-#else
-    int epoll_fd;
-#endif
-    struct epoll_event *events;
-    myinfo_t *active;
-    myinfo_t *freed;
-    size_t request_count;
-    statistics_t stats;
-    uint64_t last_time;
-    size_t last_cons;
-    util_rand_t r;
-} running_t;
-
-
-
-static myinfo_t *
-_info_alloc(const main_conf_t *conf, running_t *run) {
-    myinfo_t *info;
-
-    info = run->freed;
-    if (info == NULL) {
-        fprintf(stderr, "[*] ran out of memory\n");
-        exit(1);
-    }
-
-    /* unlink from free list, add to active list */
-    run->freed = info->next;
-    memset(info, 0, sizeof(*info));
-    info->next = run->active;
-    run->active = info;
-
-    info->request = (char*)conf->request;
-    info->request_length = conf->request_length;
-    info->request_sent = 0;
-    info->is_connected = 0;
-
-    return info;
-}
-static void
-_info_free(running_t *run, myinfo_t *info) {
-    run->active = info->next;
-    info->next = run->freed;
-    run->freed = info;
-}
-
 static int
 get_addr_length(const struct sockaddr *target) {
         switch (target->sa_family) {
@@ -132,530 +50,514 @@ get_addr_length(const struct sockaddr *target) {
     }
 }
 
-static bool
-_connection_is_sent(myinfo_t* info) {
-    return info->request_sent >= info->request_length;
-}
-
+/*
+ * Print the percentiles of one latency histogram, in milliseconds
+ */
 static void
-_connection_send_init(myinfo_t* info) {
-    info->request_sent = 0;
-}
-static void
-_connection_recv_init(myinfo_t* info) {
-    memset(&info->http, 0, sizeof(info->http));
-}
-
-static int 
-_connection_create(const main_conf_t *conf, running_t *run) {
-    socket_t fd;
-    const struct sockaddr *target;
-    const struct sockaddr *source;
-    int err;
-    int addr_len;
-    struct epoll_event event;
-    myinfo_t *info;
-
-again:
-    /* Choose a random source and destination IP address */
-    target = (struct sockaddr *)&conf->targets[util_rand32_uniform(&run->r, (unsigned)conf->targets_count)];
-    if (conf->sources_count) {
-        source = (struct sockaddr *)&conf->sources[util_rand32_uniform(&run->r, (unsigned)conf->sources_count)];
-    } else
-        source = NULL;
-    if (source && (source->sa_family != target->sa_family))
-        goto again;
-
-    /* create socket for this connection */
-    fd = socket(target->sa_family, SOCK_STREAM, 0);
-    if (fd == -1) {
-        tui_norm_screen();
-        fprintf(stderr, "[-] socket(): %s\n", sock_strerror(sockerrno));
-        switch (sockerrno) {
-        case WSA(EMFILE):
-            fprintf(stderr, "[-] FATAL: use ulimit to increase available file descriptors\n");
-            break;
-        }
-        exit(1);
-    }
+_print_hdr(FILE *fp, const char *name, const util_hdr_t *hdr, const char *eol) {
+    static const double percentiles[] = {50.0, 90.0, 99.0, 99.9};
+    size_t i;
 
-    /* Bind to a source address */
-    if (source) {
-        addr_len = get_addr_length(source);
-        err = bind(fd, source, addr_len);
-        if (err) {
-            fprintf(stderr, "[-] bind(): %s\n", sock_strerror(sockerrno));
-            exit(1);
-        }
-    }
+    /* Nothing to show, such as the connect times when the connections
+     * were already open, so leave it out, as the JSON output does */
+    if (hdr->count == 0)
+        return;
 
-    /* set to non-blocking */
-    sock_nonblocking(fd);
-    addr_len = get_addr_length(target);
+    fprintf(fp, "%10s:", name);
+    for (i = 0; i < sizeof(percentiles)/sizeof(percentiles[0]); i++)
+        fprintf(fp, " %9.3f", util_hdr_percentile(hdr, percentiles[i]) / 1000000.0);
+    fprintf(fp, " %9.3f%s", hdr->max / 1000000.0, eol);
+}
 
-    /* initiate the connection to the target*/
-    err = connect(fd, target, addr_len);
-    if (err == -1 && sockerrno != WSA(EINPROGRESS) && sockerrno != WSA(EWOULDBLOCK)) {
-        fprintf(stderr, "[-] connect(): %s\n", sock_strerror(sockerrno));
-        closesocket(fd);
-        return -1;
-    }
+static void
+print_latency(FILE *fp, const statistics_t *stats, const char *eol) {
+    size_t i;
 
-    /* Get data specific to this connection */
-    info = _info_alloc(conf, run);
-    info->fd = fd;
+    fprintf(fp, "%10s  %9s %9s %9s %9s %9s%s", "(ms)", "p50", "p90", "p99", "p99.9", "max", eol);
+    _print_hdr(fp, "connect", &stats->latency.connect, eol);
+    _print_hdr(fp, "1st-byte", &stats->latency.first_byte, eol);
+    _print_hdr(fp, "response", &stats->latency.response, eol);
 
-    /* save the event data */
-    memset(&event, 0, sizeof(event));
-    event.data.ptr = info;
-    event.events = EPOLLOUT | EPOLLIN  | EPOLLRDHUP;
-    err = epoll_ctl(run->epoll_fd, EPOLL_CTL_ADD, fd, &event);
-    if (err) {
-        perror("epoll_ctl");
-        exit(1);
-    }
+    /* The response time by status class, unless they're all 2xx,
+     * when it would be the same as the above */
+    if (stats->latency.classes[2].count == stats->latency.response.count)
+        return;
+    for (i = 0; i < STATS_CLASS_MAX; i++)
+        _print_hdr(fp, stats_class_name((unsigned)i), &stats->latency.classes[i], eol);
+}
 
-    run->concurrency++;
-    run->request_count++;
-    run->stats.con.attempted.total++;
+/*
+ * The responses by status code, whichever codes we've seen
+ */
+static void
+print_status(FILE *fp, const statistics_t *stats, const char *eol) {
+    size_t i;
 
-    return 0;
-}
+    for (i = 0; i < STATS_STATUS_MAX; i++) {
+        const counter_t *c = &stats->status[i];
+        char name[16];
 
-static int
-_connection_send(myinfo_t *info) {
-    ssize_t bytes_sent;
-
-    bytes_sent = send(  info->fd,
-                        info->request + info->request_sent,
-                        (int)(info->request_length - info->request_sent),
-                        MSG_NOSIGNAL);
-    if (bytes_sent > 0) {
-        info->request_sent += bytes_sent;
-        return 0;
-    } else {
-        return -1;
+        if (c->total == 0)
+            continue;
+        if (i == 0)
+            snprintf(name, sizeof(name), "other");
+        else
+            snprintf(name, sizeof(name), "%u", (unsigned)i);
+        fprintf(fp, "%10s: %10llu   %6u/sec%s", name,
+            (unsigned long long)c->total, (unsigned)c->rate, eol);
     }
 }
 
-static void
-vLOGfd(socket_t fd, const char* fmt, va_list marker) {
-    struct sockaddr_storage local_addr, remote_addr;
-    socklen_t addr_len = sizeof(struct sockaddr_storage);
-    char localhost[NI_MAXHOST], localport[NI_MAXSERV];
-    char remotehost[NI_MAXHOST], remoteport[NI_MAXSERV];
+/*
+ * Called by the main thread once a second to display the combined
+ * statistics of all the workers.
+ */
+void print_stats(const main_conf_t *conf, running_t **workers, size_t count, statistics_t *stats) {
+    size_t i;
+    size_t concurrency = 0;
     int err;
 
-    err = getsockname(fd, (struct sockaddr*)&local_addr, &addr_len);
-    if (err == -1) {
-        perror("getsockname failed");
-        return;
-    }
+    for (i=0; i<count; i++)
+        concurrency += workers[i]->concurrency;
+    stats_calculate_rates(stats);
 
-    err = getpeername(fd, (struct sockaddr*)&remote_addr, &addr_len);
-    if (err == -1) {
-        perror("getpeername failed");
-        return;
-    }
+    tui_go_topleft();
+    fprintf(stderr, "[ https://github.com/robertdavidgraham/nxbench - v" NXBENCH_VERSION " ] " CEOL);
+    fprintf(stderr, "website: %s:%u" CEOL, conf->server_name, conf->server_port);
+    fprintf(stderr, "IP:");
 
-    err = getnameinfo((struct sockaddr*)&local_addr, addr_len, localhost, NI_MAXHOST, localport, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
-    if (err != 0) {
-        perror("getnameinfo failed for local address");
-        return;
+    for (i=0; i<conf->targets_count; i++) {
+        char hostname[64];
+        char portname[16];
+        const struct sockaddr *addr = (struct sockaddr*)&conf->targets[i];
+
+        err = getnameinfo(addr, get_addr_length(addr),
+            hostname, sizeof(hostname),
+            portname, sizeof(portname),
+            NI_NUMERICHOST |  NI_NUMERICSERV);
+        if (err) {
+            fprintf(stderr, "[-] getnameinfo(): %s\n", gai_strerror(err));
+        }
+        fprintf(stderr, " %s", hostname);
     }
+    fprintf(stderr, CEOL);
+    fprintf(stderr, CEOL);
+    fprintf(stderr, "concurrency: %10u" CEOL, (unsigned)concurrency);
+    fprintf(stderr, CEOL);
+#define PSTAT(name, attempted) \
+    fprintf(stderr, "%10s: %10llu   %6u/sec" CEOL, name, \
+        (unsigned long long)stats->con.attempted.total, \
+        (unsigned)stats->con.attempted.rate \
+        );
+    PSTAT("connect", attempted);
+    PSTAT("success", succeeded);
+    PSTAT("fail", failed);
+    PSTAT("error", error);
+    PSTAT("closed", read);
+    PSTAT("hangup", hangup);
+    PSTAT("hangup2", hangup2);
+    PSTAT("pipeline", pipeline);
+    PSTAT("unknown", unknown);
+    PSTAT("tmo-conn", timeout_connect);
+    PSTAT("tmo-byte", timeout_first_byte);
+    PSTAT("tmo-resp", timeout_response);
+    fprintf(stderr, CEOL);
 
-    err = getnameinfo((struct sockaddr*)&remote_addr, addr_len, remotehost, NI_MAXHOST, remoteport, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
-    if (err != 0) {
-        perror("getnameinfo failed for remote address");
+    /* Whichever errors have happened, by errno */
+    for (i=0; i<STATS_ERRNO_MAX; i++) {
+        const counter_t *c = &stats->errors[i];
+        if (c->total == 0)
+            continue;
+        fprintf(stderr, "%10s: %10llu   %6u/sec   %s" CEOL, "errno",
+            (unsigned long long)c->total,
+            (unsigned)c->rate,
+            sock_strerror(stats_errno_value((unsigned)i)));
     }
 
-    fprintf(stderr, "[ ] [%s]:%s -> [%s]:%s: ",
-        localhost, localport, remotehost, remoteport);
-    vfprintf(stderr, fmt, marker);
+#define PSTAH(name, attempted) \
+    fprintf(stderr, "%10s: %10llu   %6u/sec" CEOL, name, \
+        (unsigned long long)stats->http.attempted.total, \
+        (unsigned)stats->http.attempted.rate \
+        );
+    PSTAH("sent", sent);
+    PSTAH("recv", recved);
+    print_status(stderr, stats, CEOL);
+
+    fprintf(stderr, CEOL);
+    print_latency(stderr, stats, CEOL);
+
 }
+/*
+ * Sum the statistics from all the workers into a single set
+ */
 static void
-LOGfd(socket_t fd, const char* fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    vLOGfd(fd, fmt, args);
-    va_end(args);
+workers_sum(running_t **workers, size_t count, statistics_t *stats) {
+    size_t i;
+
+    stats_clear(stats);
+    for (i=0; i<count; i++)
+        stats_add(stats, &workers[i]->stats);
 }
 
-static int
-_connection_close(running_t *run, socket_t fd, struct epoll_event *event, int reason) {
-    myinfo_t *info = event->data.ptr;
-    int err;
+/*
+ * With --schedule, the results of each phase, from the difference
+ * between the totals at its start and at its end
+ */
+typedef struct phase_result_t {
+    double seconds;
+    uint64_t sent;
+    uint64_t recved;
+    uint64_t errors;
+    uint64_t response[5]; /* p50, p90, p99, p99.9, max */
+} phase_result_t;
+
+typedef struct phases_t {
+    /* The phase we're in, and when it started */
+    size_t current;
+    uint64_t time_begin;
+
+    /* The totals when it started, and their difference from
+     * the totals at the end */
+    statistics_t *begin;
+    statistics_t *diff;
+
+    /* One for each phase in the schedule */
+    phase_result_t *results;
+} phases_t;
 
-    /* Remove from our connection list */
-    err = epoll_ctl(run->epoll_fd, EPOLL_CTL_DEL, fd, event);
-    if (err) {
-        perror("epoll_ctl(EPOLL_CTL_DEL)");
+static void
+phases_init(phases_t *phases, const main_conf_t *conf, uint64_t time_start) {
+    memset(phases, 0, sizeof(*phases));
+    phases->time_begin = time_start;
+    phases->begin = calloc(1, sizeof(*phases->begin));
+    phases->diff = calloc(1, sizeof(*phases->diff));
+    phases->results = calloc(conf->schedule->count, sizeof(*phases->results));
+    if (phases->begin == NULL || phases->diff == NULL || phases->results == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
         exit(1);
     }
+}
 
-
-    /* Record statistics */
-    switch (reason) {
-        case REASON_ERROR:
-            run->stats.con.error.total++;
-            int error = 0;
-            socklen_t len = sizeof(error);
-            int err;
-
-            err = getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*)&error, &len);
-            if (err < 0) {
-                tui_norm_screen();
-                fprintf(stderr, "getsockopt(): %s\n", sock_strerror(sockerrno));
-                exit(1);
-            } else {
-                tui_norm_screen();
-                LOGfd(fd, "%s\n", sock_strerror(error));
-                exit(1);
-            }
-            break;
-        case REASON_READEND:
-            run->stats.con.read.total++;
-            break;
-        case REASON_HANGUP:
-            run->stats.con.hangup.total++;
-            break;
-        case REASON_HANGUP2:
-            run->stats.con.hangup2.total++;
-            break;
-        case REASON_PIPELINE:
-            run->stats.con.hangup2.total++;
-            break;
-        default:
-            run->stats.con.unknown.total++;
-            break;
+/*
+ * Once the schedule moves on to the next phase (or the run ends),
+ * record the results of the phase we were in.
+ */
+static void
+phases_update(phases_t *phases, const main_conf_t *conf, running_t **workers,
+        uint64_t time_start, uint64_t now, int is_final) {
+    static const double percentiles[] = {50.0, 90.0, 99.0, 99.9};
+    const schedule_t *schedule = conf->schedule;
+    size_t next;
+
+    if (is_final)
+        next = schedule->count;
+    else
+        next = schedule_phase(schedule, (now - time_start) / 1000000000.0);
+
+    while (phases->current < next && phases->current < schedule->count) {
+        phase_result_t *result = &phases->results[phases->current];
+        statistics_t *diff = phases->diff;
+        size_t i;
+
+        /* What was counted during this phase, and then the totals
+         * at the start of the next one */
+        workers_sum(workers, conf->thread_count, diff);
+        stats_subtract(diff, phases->begin);
+        stats_add(phases->begin, diff);
+
+        result->seconds = (now - phases->time_begin) / 1000000000.0;
+        result->sent = diff->http.sent.total;
+        result->recved = diff->http.recved.total;
+        for (i = 0; i < STATS_ERRNO_MAX; i++)
+            result->errors += diff->errors[i].total;
+        for (i = 0; i < 4; i++)
+            result->response[i] = util_hdr_percentile(&diff->latency.response, percentiles[i]);
+        result->response[4] = diff->latency.response.max;
+
+        phases->time_begin = now;
+        phases->current++;
     }
+}
 
-    /* close the connection */
-    closesocket(fd);
-
-    /* put the info structure back into the pool */
-    _info_free(run, info);
-
-    /* we have one fewer concurrent connections */
-    run->concurrency--;
-
-    return err;
+/*
+ * How long the main thread should sleep, so that it wakes up at the
+ * start of the next phase, but no more than 'max' milliseconds.
+ */
+static unsigned
+phases_sleep(const phases_t *phases, const main_conf_t *conf, uint64_t time_start, unsigned max) {
+    const schedule_phase_t *phase;
+    double wait;
+
+    if (conf->schedule == NULL || phases->current >= conf->schedule->count)
+        return max;
+    phase = &conf->schedule->phases[phases->current];
+    wait = (phase->start + phase->duration) * 1000.0 - (util_time_ns() - time_start) / 1000000.0;
+    if (wait < 1.0)
+        return 1;
+    if (wait > max)
+        return max;
+    return (unsigned)wait;
 }
 
-int run_loop(const main_conf_t *conf, running_t *run) {
-    size_t n;
+static void
+phases_print(const phases_t *phases, const main_conf_t *conf) {
+    const schedule_t *schedule = conf->schedule;
+    const char *unit = (schedule->kind == SCHEDULE_RATE) ? "/s" : "";
     size_t i;
 
-    /* If we don't have enough concurrent connections,
-     * then add some new ones. Don't add them all at once,
-     * but in batches. We care about the steady state running
-     * of this, not optimizing startup time. */
-    i=0;
-    while (i++ < 10 && run->concurrency < conf->concurrent_connections) {
-        _connection_create(conf, run);
+    printf("%-12s %14s %8s %10s %10s %8s %9s %9s %9s %9s %9s\n",
+        "phase", "target", "seconds", "received", "req/sec", "errors",
+        "p50(ms)", "p90", "p99", "p99.9", "max");
+    for (i = 0; i < schedule->count; i++) {
+        const schedule_phase_t *phase = &schedule->phases[i];
+        const phase_result_t *result = &phases->results[i];
+        char target[64];
+        char name[32];
+        size_t j;
+
+        snprintf(name, sizeof(name), "%2u %s", (unsigned)(i + 1), phase->name);
+        if (phase->from == phase->to)
+            snprintf(target, sizeof(target), "%g%s", phase->from, unit);
+        else
+            snprintf(target, sizeof(target), "%g-%g%s", phase->from, phase->to, unit);
+        printf("%-12s %14s %8.3f %10llu %10.1f %8llu", name, target, result->seconds,
+            (unsigned long long)result->recved,
+            result->seconds > 0.0 ? result->recved / result->seconds : 0.0,
+            (unsigned long long)result->errors);
+        for (j = 0; j < 5; j++)
+            printf(" %9.3f", result->response[j] / 1000000.0);
+        printf("\n");
     }
-    if (run->concurrency == 0)
-        return 0;
-
-    /*
-     * Now wait for incoming events
-     */
-    struct epoll_event *events = run->events;
-    n = epoll_wait( run->epoll_fd,
-                    events,
-                    conf->concurrent_connections,
-                    10);
-
-    /*
-     * process all the events that were returned
-     */
-    for (i = 0; i < n; i++) {
-        struct epoll_event *event = &events[i];
-        unsigned flags = event->events;
-        myinfo_t *info = (myinfo_t*)event->data.ptr;
-        socket_t fd = info->fd;
-
-        /*
-        * This is where we SEND requests.
-        * This is where we detect CONNECTIONS.
-        */
-        if (flags & EPOLLOUT) {
-            if (info->is_connected == 0) {
-                run->stats.con.succeeded.total++;
-                info->is_connected = true;
-            }
-            _connection_send(info);
-
-            /* If we've sent everything, then modify our record
-             * so that we no longer receive this event */
-            if (_connection_is_sent(info)) {
-                int err;
-                struct epoll_event eventmod = *event;
-                eventmod.events = EPOLLIN  | EPOLLRDHUP;
-                err = epoll_ctl(run->epoll_fd, EPOLL_CTL_MOD, fd, &eventmod);
-                if (err) {
-                    perror("EPOLL_CTL_MOD");
-                }
-                if (conf->is_shutdown)
-                    shutdown(fd, SHUT_WR);
-                run->stats.http.sent.total++;
-            }
-            continue;
-        }
-
-
-        if (flags & EPOLLERR) {
-            _connection_close(run, fd, event, REASON_ERROR);
-            continue;
-        }
-
-
-        /*
-         * This is where we RECEIVE responses.
-         * This is where we also will SEND requests (after
-         * receiving a complete response).
-         */
-        if (flags & EPOLLIN) {
-            unsigned char buffer[BUFFER_SIZE];
-            int bytes_read = recv(fd, buffer, sizeof(buffer) - 1, 0);
-            if (bytes_read > 0) {
-                int count;
-                int is_finished = false;
-                buffer[bytes_read] = '\0';
-                count = http_rsp_parse(&info->http, buffer, bytes_read, &is_finished);
-                if (count < (int)bytes_read) {
-                    _connection_close(run, fd, event, REASON_PIPELINE);
-                } else if (is_finished) {
-                    run->stats.http.recved.total++;
-
-                    if (flags & EPOLLHUP) {
-                        _connection_close(run, fd, event, REASON_HANGUP);
-                        continue;
-                    }
-                    if (flags & EPOLLRDHUP) {
-                        _connection_close(run, fd, event, REASON_HANGUP2);
-                        continue;
-                    }
-
-                    _connection_send_init(info);
-                    _connection_send(info);
-                    if (!_connection_is_sent(info)) {
-                        /* We haven't sent everything */
-                        int err;
-                        struct epoll_event eventmod = *event;
-                        eventmod.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
-                        err = epoll_ctl(run->epoll_fd, EPOLL_CTL_MOD, fd, &eventmod);
-                        if (err) {
-                            perror("EPOLL_CTL_MOD");
-                        }
-                    } else {
-                        run->stats.http.sent.total++;
-                        _connection_recv_init(info);
-                    }
-                } else if (!is_finished) {
-                    /* continue waiting for the response to be finished */
-                    if (flags & EPOLLHUP) {
-                        _connection_close(run, fd, event, REASON_UNKNOWNx);
-                        continue;
-                    }
-                    if (flags & EPOLLRDHUP) {
-                        _connection_close(run, fd, event, REASON_UNKNOWNx);
-                        continue;
-                    }
-                }
-
-            } else if (bytes_read == 0) {
-                if (flags & EPOLLHUP) {
-                    _connection_close(run, fd, event, REASON_HANGUP);
-                    continue;
-                }
-                if (flags & EPOLLRDHUP) {
-                    _connection_close(run, fd, event, REASON_HANGUP2);
-                    continue;
-                }
-                _connection_close(run, fd, event, REASON_READEND);
-                continue;
-            } else if (bytes_read < 0) {
-                _connection_close(run, fd, event, REASON_ERROR);
-            }
-            continue;
-        }
+}
 
-        if (flags & EPOLLHUP) {
-            _connection_close(run, fd, event, REASON_HANGUP);
-            continue;
-        }
+/*
+ * With --requests, the throughput and latency of each of them, summed
+ * across the workers, so that we can see which limit the rate
+ */
+static void
+requests_print(const main_conf_t *conf, running_t **workers, size_t count, double elapsed) {
+    const request_set_t *set = conf->requests;
+    request_stats_t *sum;
+    size_t i;
+    size_t j;
 
-        if (flags & EPOLLRDHUP) {
-            _connection_close(run, fd, event, REASON_HANGUP2);
-            continue;
+    sum = calloc(set->count, sizeof(*sum));
+    if (sum == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < set->count; j++) {
+            sum[j].responses += workers[i]->request_stats[j].responses;
+            sum[j].failures += workers[i]->request_stats[j].failures;
+            util_hdr_add(&sum[j].latency, &workers[i]->request_stats[j].latency);
         }
-
-        fprintf(stderr, "unknown\n");
     }
 
-
-    return 1;
-}
-
-#ifdef _WIN32
-#define CLOCK_REALTIME 1
-int
-clock_gettime(int clockid, struct timespec* tp) {
-    if (clockid != CLOCK_REALTIME) {
-        return -1; // Only CLOCK_REALTIME is supported in this implementation
+    printf("%-32s %6s %10s %10s %8s %9s %9s %9s %9s %9s\n",
+        "request", "weight", "received", "req/sec", "failed",
+        "p50(ms)", "p90", "p99", "p99.9", "max");
+    for (j = 0; j < set->count; j++) {
+        const util_hdr_t *hdr = &sum[j].latency;
+
+        printf("%-32.32s %5.1f%% %10llu %10.1f %8llu %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+            set->entries[j].name, 100.0 * set->entries[j].weight / set->total_weight,
+            (unsigned long long)sum[j].responses,
+            elapsed > 0.0 ? sum[j].responses / elapsed : 0.0,
+            (unsigned long long)sum[j].failures,
+            util_hdr_percentile(hdr, 50.0) / 1000000.0,
+            util_hdr_percentile(hdr, 90.0) / 1000000.0,
+            util_hdr_percentile(hdr, 99.0) / 1000000.0,
+            util_hdr_percentile(hdr, 99.9) / 1000000.0,
+            hdr->max / 1000000.0);
     }
+    free(sum);
+}
 
-    FILETIME ft;
-    ULARGE_INTEGER li;
-
-    GetSystemTimeAsFileTime(&ft);
-    li.LowPart = ft.dwLowDateTime;
-    li.HighPart = ft.dwHighDateTime;
+/*
+ * With --find-max, the main thread runs one probe after another, at
+ * the loads chosen by the search, and keeps the results of each
+ */
+typedef struct probe_result_t {
+    double load;
+    double rate;
+    int is_passed;
+    char why[64];
+    uint64_t response[5]; /* p50, p90, p99, p99.9, max */
+} probe_result_t;
+
+typedef struct probes_t {
+    findmax_t search;
+
+    /* When the current probe started, and when it settled down,
+     * from which point we count it, or 0 if it hasn't yet */
+    uint64_t time_begin;
+    uint64_t time_settled;
+
+    /* The totals when it settled, and their difference from the
+     * totals at the end, and that difference for the best probe */
+    statistics_t *begin;
+    statistics_t *diff;
+    statistics_t *best;
+    int best_index;
+
+    probe_result_t results[FINDMAX_MAX_PROBES];
+    size_t count;
+} probes_t;
 
-    // Convert FILETIME to UNIX epoch (January 1, 1970)
-    li.QuadPart -= 116444736000000000LL;
+static void
+probes_control(running_t **workers, size_t count, double load) {
+    size_t i;
 
-    // Convert to seconds and nanoseconds
-    tp->tv_sec = (time_t)(li.QuadPart / 10000000);
-    tp->tv_nsec = (long)((li.QuadPart % 10000000) * 100);
+    for (i=0; i<count; i++)
+        workers[i]->control = load;
+}
 
-    return 0;
+static void
+probes_init(probes_t *probes, const main_conf_t *conf, running_t **workers, uint64_t time_start) {
+    double load;
+
+    memset(probes, 0, sizeof(*probes));
+    probes->begin = calloc(1, sizeof(*probes->begin));
+    probes->diff = calloc(1, sizeof(*probes->diff));
+    probes->best = calloc(1, sizeof(*probes->best));
+    if (probes->begin == NULL || probes->diff == NULL || probes->best == NULL) {
+        fprintf(stderr, "[-] FATAL: out of memory\n");
+        exit(1);
+    }
+    probes->best_index = -1;
+
+    if (conf->rate > 0.0)
+        load = findmax_init(&probes->search, conf->rate, 0);
+    else
+        load = findmax_init(&probes->search, conf->concurrent_connections, 1);
+    probes_control(workers, conf->thread_count, load);
+    probes->time_begin = time_start;
 }
-#endif
 
-static running_t *
-worker_start(const main_conf_t *conf) {
+/*
+ * Once the probe has settled, take a snapshot of the totals, and once
+ * it's finished, see how it did, and start the next one.
+ */
+static void
+probes_update(probes_t *probes, const main_conf_t *conf, running_t **workers, uint64_t now) {
+    uint64_t settle = (uint64_t)(conf->probe_time * 1000000000.0 / 5.0);
+    uint64_t length = (uint64_t)(conf->probe_time * 1000000000.0);
+    static const double percentiles[] = {50.0, 90.0, 99.0, 99.9};
+    probe_result_t *result;
+    double load;
     size_t i;
-    running_t *run;
-
-    /*
-     * This sets up the running job. This contains everything
-     * that changes during each run through the loop.
-     */
-    run = calloc(1, sizeof(*run));
 
-    /*
-     * Seed random number generator.
-     */
-    {
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        util_rand_seed(&run->r, &ts.tv_nsec, sizeof(ts.tv_nsec));
+    if (probes->search.is_done)
+        return;
+    if (probes->time_settled == 0) {
+        if (now < probes->time_begin + settle)
+            return;
+        workers_sum(workers, conf->thread_count, probes->begin);
+        probes->time_settled = now;
+        return;
     }
+    if (now < probes->time_begin + length)
+        return;
 
-    /*
-     * This created the central epoll event.
-     */
-    run->epoll_fd = epoll_create1(0);
-    if (run->epoll_fd < 0) {
-        fprintf(stderr, "[-] epoll_create1: %s\n", sock_strerror(sockerrno));
-        return NULL;
+    /* What was counted since it settled */
+    workers_sum(workers, conf->thread_count, probes->diff);
+    stats_subtract(probes->diff, probes->begin);
+
+    result = &probes->results[probes->count];
+    result->load = probes->search.current;
+    result->rate = probes->diff->http.recved.total / ((now - probes->time_settled) / 1000000000.0);
+    result->is_passed = slo_check(conf->slo, probes->diff, result->why, sizeof(result->why));
+    for (i = 0; i < 4; i++)
+        result->response[i] = util_hdr_percentile(&probes->diff->latency.response, percentiles[i]);
+    result->response[4] = probes->diff->latency.response.max;
+
+    if (result->is_passed
+        && (probes->best_index < 0 || probes->results[probes->best_index].rate < result->rate)) {
+        statistics_t *tmp = probes->best;
+        probes->best = probes->diff;
+        probes->diff = tmp;
+        probes->best_index = (int)probes->count;
     }
+    probes->count++;
 
-    /*
-     * This creates a buffer that receives the list of incoming
-     * events for each call to epoll_wait()
-     */
-    run->events = calloc(conf->concurrent_connections, sizeof(*run->events));
-
-    /*
-     * This creates a pool of allocated objects to contains the data
-     * we associate with each connection. We use this pool instead
-     * of malloc()/free() for each connection */
-    for (i=0; i<conf->concurrent_connections; i++) {
-        myinfo_t *info = calloc(1, sizeof(*info));
-        info->next = run->freed;
-        run->freed = info;
+    /* On to the next one, or we're done */
+    load = findmax_next(&probes->search, result->is_passed);
+    if (load == 0.0) {
+        for (i=0; i<conf->thread_count; i++)
+            workers[i]->is_stop_requested = 1;
+        return;
     }
-
-    return run;
+    probes_control(workers, conf->thread_count, load);
+    probes->time_begin = now;
+    probes->time_settled = 0;
 }
 
-void stats_calculate_rates(running_t *run) {
-    uint64_t now;
-    uint64_t elapsed;
-    struct timespec ts;
-    statistics_t *stats = &run->stats;
-    counter_t *c;
-
-    /* get the current time in nanoseconds, plus the elapsed
-     *time */
-    clock_gettime(CLOCK_REALTIME, &ts);
-    now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
-    elapsed = now - run->last_time;
-    run->last_time = now;
+static void
+probes_print(const probes_t *probes, const main_conf_t *conf) {
+    const char *unit = (conf->rate > 0.0) ? "/s" : "";
+    size_t i;
 
-    /* Do the tate calculation for all the counters */
+    printf("%-6s %12s %10s %9s %9s %9s %9s %9s  %s\n",
+        "probe", "load", "req/sec", "p50(ms)", "p90", "p99", "p99.9", "max", "slo");
+    for (i = 0; i < probes->count; i++) {
+        const probe_result_t *result = &probes->results[i];
+        char load[64];
+        size_t j;
+
+        snprintf(load, sizeof(load), "%g%s", result->load, unit);
+        printf("%-6u %12s %10.1f", (unsigned)(i + 1), load, result->rate);
+        for (j = 0; j < 5; j++)
+            printf(" %9.3f", result->response[j] / 1000000.0);
+        printf("  %s\n", result->is_passed ? "ok" : result->why);
+    }
 
-    for (c = &stats->first; c < &stats->last; c++) {
-        uint64_t diff = c->total - c->last;
-        uint64_t rate = diff * 1000000000ULL / elapsed;
-        c->rate = (uint64_t)floor(c->rate * 0.9 + rate * 0.1);
-        c->last = c->total;
+    if (probes->best_index < 0) {
+        printf("max: none of the loads were within the SLO\n");
+        return;
     }
+    printf("max: %.1f requests/sec at %g%s %s\n",
+        probes->results[probes->best_index].rate,
+        probes->results[probes->best_index].load, unit,
+        (conf->rate > 0.0) ? "offered" : "connections");
+    print_latency(stdout, probes->best, "\n");
 }
 
-void print_stats(const main_conf_t *conf, running_t *run) {
+static size_t
+workers_concurrency(running_t **workers, size_t count) {
+    size_t concurrency = 0;
     size_t i;
-    int err;
-
-    stats_calculate_rates(run);
 
-    tui_go_topleft();
-    fprintf(stderr, "[ https://github.com/robertdavidgraham/nxbench - v0.1 ] " CEOL);
-    fprintf(stderr, "website: %s:%u" CEOL, conf->server_name, conf->server_port);
-    fprintf(stderr, "IP:");
+    for (i=0; i<count; i++)
+        concurrency += workers[i]->concurrency;
+    return concurrency;
+}
 
-    for (i=0; i<conf->targets_count; i++) {
-        char hostname[64];
-        char portname[16];
-        const struct sockaddr *addr = (struct sockaddr*)&conf->targets[i];
+static int
+workers_is_done(running_t **workers, size_t count) {
+    size_t i;
 
-        err = getnameinfo(addr, get_addr_length(addr),
-            hostname, sizeof(hostname),
-            portname, sizeof(portname),
-            NI_NUMERICHOST |  NI_NUMERICSERV);
-        if (err) {
-            fprintf(stderr, "[-] getnameinfo(): %s\n", gai_strerror(err));
-        }
-        fprintf(stderr, " %s", hostname);
+    for (i=0; i<count; i++) {
+        if (!workers[i]->is_done)
+            return 0;
     }
-    fprintf(stderr, CEOL);
-    fprintf(stderr, CEOL);
-    fprintf(stderr, "concurrency: %10u" CEOL, (unsigned)run->concurrency);
-    fprintf(stderr, CEOL);
-#define PSTAT(name, attempted) \
-    fprintf(stderr, "%10s: %10llu   %6u/sec" CEOL, name, \
-        (unsigned long long)run->stats.con.attempted.total, \
-        (unsigned)run->stats.con.attempted.rate \
-        );
-    PSTAT("connect", attempted);
-    PSTAT("success", succeeded);
-    PSTAT("fail", failed);
-    PSTAT("error", error);
-    PSTAT("closed", read);
-    PSTAT("hangup", hangup);
-    PSTAT("hangup2", hangup2);
-    PSTAT("unknown", unknown);
-    fprintf(stderr, CEOL);
-
-#define PSTAH(name, attempted) \
-    fprintf(stderr, "%10s: %10llu   %6u/sec" CEOL, name, \
-        (unsigned long long)run->stats.http.attempted.total, \
-        (unsigned)run->stats.http.attempted.rate \
-        );
-    PSTAH("sent", sent);
-    PSTAH("recv", recved);
-
-    fprintf(stderr, CEOL);
-
-
+    return 1;
 }
+
 int main(int argc, char *argv[]) {
     main_conf_t *conf;
-    running_t *run;
+    running_t **workers;
+    util_thread_t *threads;
+    statistics_t stats = {0};
+    phases_t phases = {0};
+    probes_t probes;
+    output_t *output;
+    size_t i;
     time_t now = 0;
+    uint64_t time_start;
+    uint64_t time_end = 0;
+    uint64_t unfinished = 0;
+    double elapsed;
     int err;
 
 #ifdef _WIN32
@@ -667,10 +569,59 @@ int main(int argc, char *argv[]) {
 #endif
 
     http_rsp_init();
+    util_rand_init();
     if (http_rsp_selftest() != 0) {
         fprintf(stderr, "[-] FATAL: programing error in http response\n");
         exit(1);
     }
+    if (util_hdr_selftest() != 0) {
+        fprintf(stderr, "[-] FATAL: programing error in histograms\n");
+        exit(1);
+    }
+    if (util_timer_selftest() != 0) {
+        fprintf(stderr, "[-] FATAL: programing error in timers\n");
+        exit(1);
+    }
+    if (util_ports_selftest() != 0) {
+        fprintf(stderr, "[-] FATAL: programing error in source ports\n");
+        exit(1);
+    }
+    if (util_rand_selftest() != 0) {
+        fprintf(stderr, "[-] FATAL: programing error in random numbers\n");
+        exit(1);
+    }
+    if (util_dist_selftest() != 0) {
+        fprintf(stderr, "[-] FATAL: programing error in key distributions\n");
+        exit(1);
+    }
+    if (schedule_selftest() != 0) {
+        fprintf(stderr, "[-] FATAL: programing error in schedules\n");
+        exit(1);
+    }
+    if (findmax_selftest() != 0) {
+        fprintf(stderr, "[-] FATAL: programing error in find-max\n");
+        exit(1);
+    }
+    if (requests_selftest() != 0) {
+        fprintf(stderr, "[-] FATAL: programing error in request sets\n");
+        exit(1);
+    }
+    if (replay_selftest() != 0) {
+        fprintf(stderr, "[-] FATAL: programing error in log replay\n");
+        exit(1);
+    }
+    if (template_selftest() != 0) {
+        fprintf(stderr, "[-] FATAL: programing error in request templates\n");
+        exit(1);
+    }
+    if (worker_selftest() != 0) {
+        fprintf(stderr, "[-] FATAL: programing error in workers\n");
+        exit(1);
+    }
+    if (manifest_selftest() != 0) {
+        fprintf(stderr, "[-] FATAL: programing error in manifest\n");
+        exit(1);
+    }
 
     /*
      * this parses the configuration parameters from
@@ -683,6 +634,15 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "-] FATAL: error reading configuration\n");
         return 1;
     }
+    if (conf->is_selftest) {
+        if (worker_selftest_network() != 0) {
+            fprintf(stderr, "[-] FATAL: programing error in workers\n");
+            exit(1);
+        }
+        fprintf(stderr, "[+] selftest: passed\n");
+        free(conf);
+        return 0;
+    }
 
 
     /*
@@ -695,28 +655,140 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    /*
+     * Make sure the kernel can run --engine uring, or else fall back
+     * to epoll, rather than have every worker fail once it's started
+     */
+    if (conf->engine == ENGINE_URING && uring_probe() != 0) {
+        fprintf(stderr, "[-] io_uring: using '--engine epoll' instead\n");
+        conf->engine = ENGINE_EPOLL;
+    }
+
+
+    output = output_create(conf);
+    manifest_write(conf, argc, argv);
 
     tui_init(1);
 
     /*
-     * create a running job object that will contain
+     * create a running job object for each worker that will contain
      * all the chaning information during a run
      */
-    run = worker_start(conf);
-    if (run == NULL)
-        return 1;
+    workers = calloc(conf->thread_count, sizeof(*workers));
+    threads = calloc(conf->thread_count, sizeof(*threads));
+    for (i=0; i<conf->thread_count; i++) {
+        workers[i] = worker_create(conf, (unsigned)i, conf->thread_count);
+        if (workers[i] == NULL)
+            return 1;
+    }
+    metrics_start(conf, workers, conf->thread_count);
+
+    /*
+     * now start the workers, each running on its own thread, from
+     * the same start time, for following the --schedule
+     */
+    time_start = util_time_ns();
+    if (conf->schedule)
+        phases_init(&phases, conf, time_start);
+    if (conf->is_find_max)
+        probes_init(&probes, conf, workers, time_start);
+    for (i=0; i<conf->thread_count; i++)
+        workers[i]->time_start = time_start;
+    for (i=0; i<conf->thread_count; i++) {
+        threads[i] = util_thread_begin(worker_thread, workers[i]);
+        if (threads[i] == 0) {
+            tui_norm_screen();
+            fprintf(stderr, "[-] FATAL: couldn't start worker thread\n");
+            exit(1);
+        }
+    }
 
     /*
-     * now run the job until we've sent the total number
-     * of requests we were supposed to
+     * The main thread doesn't do any of the work, it just displays
+     * the statistics, until all the workers are done.
      */
-    while (run_loop(conf, run)) {
+    while (!workers_is_done(workers, conf->thread_count)) {
+        util_thread_sleep_ms(phases_sleep(&phases, conf, time_start, 100));
+        if (conf->schedule)
+            phases_update(&phases, conf, workers, time_start, util_time_ns(), 0);
+        if (conf->is_find_max)
+            probes_update(&probes, conf, workers, util_time_ns());
         if (now != time(0)) {
             now = time(0);
-            print_stats(conf, run);
+            workers_sum(workers, conf->thread_count, &stats);
+            print_stats(conf, workers, conf->thread_count, &stats);
+            if (output)
+                output_interval(output, &stats, (util_time_ns() - time_start) / 1000000000.0,
+                    workers_concurrency(workers, conf->thread_count));
         }
     }
 
+    for (i=0; i<conf->thread_count; i++)
+        util_thread_join(threads[i]);
+
+    /*
+     * Print the final report
+     */
+    workers_sum(workers, conf->thread_count, &stats);
+    for (i=0; i<conf->thread_count; i++) {
+        unfinished += workers[i]->concurrency;
+        if (time_end < workers[i]->time_done)
+            time_end = workers[i]->time_done;
+    }
+    elapsed = (time_end - time_start) / 1000000000.0;
+    if (conf->schedule)
+        phases_update(&phases, conf, workers, time_start, time_end, 1);
+    tui_norm_screen();
+    printf("duration: %.3f seconds\n", elapsed);
+    printf("seed: %llu\n", (unsigned long long)conf->seed);
+    printf("requests: %llu sent, %llu received, %.1f/sec\n",
+        (unsigned long long)stats.http.sent.total,
+        (unsigned long long)stats.http.recved.total,
+        elapsed > 0.0 ? stats.http.recved.total / elapsed : 0.0);
+    for (i=0; i<STATS_STATUS_MAX; i++) {
+        if (stats.status[i].total == 0)
+            continue;
+        if (i == 0)
+            printf("status other: ");
+        else
+            printf("status %u: ", (unsigned)i);
+        printf("%llu (%.2f%%)\n", (unsigned long long)stats.status[i].total,
+            100.0 * stats.status[i].total / stats.http.recved.total);
+    }
+    printf("connections: %llu attempted, %llu succeeded, %.1f/sec\n",
+        (unsigned long long)stats.con.attempted.total,
+        (unsigned long long)stats.con.succeeded.total,
+        elapsed > 0.0 ? stats.con.succeeded.total / elapsed : 0.0);
+    if (stats.con.timeout_connect.total || stats.con.timeout_first_byte.total
+        || stats.con.timeout_response.total)
+        printf("timeouts: %llu connect, %llu first byte, %llu response\n",
+            (unsigned long long)stats.con.timeout_connect.total,
+            (unsigned long long)stats.con.timeout_first_byte.total,
+            (unsigned long long)stats.con.timeout_response.total);
+    for (i=0; i<STATS_ERRNO_MAX; i++) {
+        if (stats.errors[i].total)
+            printf("errors: %llu %s\n", (unsigned long long)stats.errors[i].total,
+                sock_strerror(stats_errno_value((unsigned)i)));
+    }
+    if (conf->replay) {
+        uint64_t skipped = 0;
+        for (i=0; i<conf->thread_count; i++)
+            skipped += workers[i]->replay.skipped;
+        if (skipped)
+            printf("replay: %llu lines of the log couldn't be parsed\n", (unsigned long long)skipped);
+    }
+    if (unfinished)
+        printf("unfinished: %llu connections still waiting at the drain deadline\n",
+            (unsigned long long)unfinished);
+    print_latency(stdout, &stats, "\n");
+    if (output)
+        output_summary(output, &stats, elapsed, unfinished);
+    if (conf->requests)
+        requests_print(conf, workers, conf->thread_count, elapsed);
+    if (conf->schedule)
+        phases_print(&phases, conf);
+    if (conf->is_find_max)
+        probes_print(&probes, conf);
 
     return 0;
 }
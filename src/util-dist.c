@@ -0,0 +1,301 @@
+#include "util-dist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*
+ * Build the alias table from the weights in 'scaled', which this
+ * overwrites, using Vose's method: scale the weights so that they
+ * average 1, then repeatedly take a column that's under 1, and fill
+ * it up to 1 with its alias, one that's over 1, which then has that
+ * much less.
+ */
+static int
+_alias_build(util_dist_t *d, double *scaled, size_t columns) {
+    uint32_t *stack;
+    size_t small_count = 0;
+    size_t large_count = 0;
+    double total = 0.0;
+    size_t i;
+
+    if (columns == 0 || columns > UINT32_MAX)
+        return -1;
+    for (i = 0; i < columns; i++) {
+        if (!(scaled[i] >= 0.0))
+            return -1;
+        total += scaled[i];
+    }
+    if (!(total > 0.0) || isinf(total))
+        return -1;
+
+    d->kind = DIST_ALIAS;
+    d->columns = columns;
+    d->table = malloc(columns * sizeof(*d->table));
+    stack = malloc(columns * sizeof(*stack));
+    if (d->table == NULL || stack == NULL) {
+        free(stack);
+        util_dist_free(d);
+        return -1;
+    }
+
+    /* The columns under 1 are stacked from the front, and the others
+     * from the back, and there are never more than 'columns' of them */
+    for (i = 0; i < columns; i++) {
+        scaled[i] = scaled[i] * columns / total;
+        if (scaled[i] < 1.0)
+            stack[small_count++] = (uint32_t)i;
+        else
+            stack[columns - ++large_count] = (uint32_t)i;
+    }
+
+    while (small_count && large_count) {
+        uint32_t small = stack[--small_count];
+        uint32_t large = stack[columns - large_count--];
+
+        d->table[small].keep = (uint32_t)(scaled[small] * 4294967296.0);
+        d->table[small].alias = large;
+
+        scaled[large] = (scaled[large] + scaled[small]) - 1.0;
+        if (scaled[large] < 1.0)
+            stack[small_count++] = large;
+        else
+            stack[columns - ++large_count] = large;
+    }
+
+    /* What's left are full, give or take rounding, so they always
+     * keep their own value */
+    while (small_count) {
+        uint32_t column = stack[--small_count];
+        d->table[column].keep = UINT32_MAX;
+        d->table[column].alias = column;
+    }
+    while (large_count) {
+        uint32_t column = stack[columns - large_count--];
+        d->table[column].keep = UINT32_MAX;
+        d->table[column].alias = column;
+    }
+
+    free(stack);
+    return 0;
+}
+
+void
+util_dist_uniform(util_dist_t *d, uint64_t count) {
+    memset(d, 0, sizeof(*d));
+    d->kind = DIST_UNIFORM;
+    d->count = count;
+}
+
+void
+util_dist_scan(util_dist_t *d, uint64_t count) {
+    memset(d, 0, sizeof(*d));
+    d->kind = DIST_SCAN;
+    d->count = count;
+}
+
+int
+util_dist_zipf(util_dist_t *d, uint64_t count, double s) {
+    double *scaled;
+    uint64_t i;
+    int err;
+
+    memset(d, 0, sizeof(*d));
+    if (count == 0 || count > UINT32_MAX || !(s > 0.0))
+        return -1;
+    d->count = count;
+
+    scaled = malloc(count * sizeof(*scaled));
+    if (scaled == NULL)
+        return -1;
+    for (i = 0; i < count; i++)
+        scaled[i] = 1.0 / pow((double)(i + 1), s);
+    err = _alias_build(d, scaled, count);
+    free(scaled);
+    return err;
+}
+
+int
+util_dist_hotspot(util_dist_t *d, uint64_t count, double traffic, double keys) {
+    double scaled[2];
+    uint64_t hot;
+
+    memset(d, 0, sizeof(*d));
+    if (count == 0 || !(traffic >= 0.0 && traffic <= 1.0) || !(keys >= 0.0 && keys <= 1.0))
+        return -1;
+
+    /* With all the keys hot, or none, it's just uniform */
+    hot = (uint64_t)(keys * count + 0.5);
+    if (hot == 0 || hot >= count) {
+        util_dist_uniform(d, count);
+        return 0;
+    }
+    d->count = count;
+
+    d->range_first = malloc(2 * sizeof(*d->range_first));
+    d->range_count = malloc(2 * sizeof(*d->range_count));
+    if (d->range_first == NULL || d->range_count == NULL) {
+        util_dist_free(d);
+        return -1;
+    }
+    d->range_first[0] = 0;
+    d->range_count[0] = hot;
+    d->range_first[1] = hot;
+    d->range_count[1] = count - hot;
+
+    scaled[0] = traffic;
+    scaled[1] = 1.0 - traffic;
+    return _alias_build(d, scaled, 2);
+}
+
+int
+util_dist_weights(util_dist_t *d, const double *weights, size_t count) {
+    double *scaled;
+    int err;
+
+    memset(d, 0, sizeof(*d));
+    d->count = count;
+    if (count == 0)
+        return -1;
+
+    scaled = malloc(count * sizeof(*scaled));
+    if (scaled == NULL)
+        return -1;
+    memcpy(scaled, weights, count * sizeof(*scaled));
+    err = _alias_build(d, scaled, count);
+    free(scaled);
+    return err;
+}
+
+uint64_t
+util_dist_next(const util_dist_t *d, util_rand_t *r, uint64_t sequence) {
+    uint32_t columns = (uint32_t)d->columns;
+    uint64_t column;
+
+    switch (d->kind) {
+    case DIST_UNIFORM:
+        return (d->count > 1) ? util_rand_uniform(r, d->count) : 0;
+    case DIST_SCAN:
+        return sequence % d->count;
+    case DIST_ALIAS:
+        break;
+    }
+
+    /* The top half of the random number chooses the column, by
+     * multiplying rather than dividing, throwing out the few that
+     * would make some columns more likely than others (Lemire), and
+     * the bottom half is the coin toss for keeping it */
+    for (;;) {
+        uint64_t x = util_rand(r);
+        uint64_t product = (x >> 32) * columns;
+        uint32_t low = (uint32_t)product;
+
+        if (low < columns && low < (0U - columns) % columns)
+            continue;
+        column = product >> 32;
+        if ((uint32_t)x >= d->table[column].keep)
+            column = d->table[column].alias;
+        break;
+    }
+
+    if (d->range_first) {
+        uint64_t range_count = d->range_count[column];
+        return d->range_first[column] + ((range_count > 1) ? util_rand_uniform(r, range_count) : 0);
+    }
+    return column;
+}
+
+void
+util_dist_free(util_dist_t *d) {
+    free(d->table);
+    free(d->range_first);
+    free(d->range_count);
+    d->table = NULL;
+    d->range_first = NULL;
+    d->range_count = NULL;
+}
+
+/*
+ * Check that a value was chosen 'count' times out of 'n', about the
+ * fraction 'expected', within 5 standard deviations
+ */
+static int
+_near(uint64_t count, uint64_t n, double expected) {
+    double mean = expected * n;
+    double deviation = sqrt(mean * (1.0 - expected)) * 5.0 + 1.0;
+
+    return fabs((double)count - mean) <= deviation;
+}
+
+int
+util_dist_selftest(void) {
+    static const double weights[] = {0.0, 1.0, 3.0, 0.5, 0.5};
+    uint64_t counts[10];
+    util_dist_t d;
+    util_rand_t r;
+    double harmonic = 0.0;
+    size_t n = 100000;
+    size_t i;
+
+    util_rand_seed(&r, "dist", 4);
+
+    /* Zipf, s=1, over 10 values */
+    if (util_dist_zipf(&d, 10, 1.0) != 0)
+        goto fail;
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < n; i++) {
+        uint64_t value = util_dist_next(&d, &r, i);
+        if (value >= 10)
+            goto fail;
+        counts[value]++;
+    }
+    for (i = 0; i < 10; i++)
+        harmonic += 1.0 / (i + 1);
+    for (i = 0; i < 10; i++) {
+        if (!_near(counts[i], n, 1.0 / (i + 1) / harmonic))
+            goto fail;
+    }
+    util_dist_free(&d);
+
+    /* Weights, including one that's never chosen */
+    if (util_dist_weights(&d, weights, 5) != 0)
+        goto fail;
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < n; i++)
+        counts[util_dist_next(&d, &r, i)]++;
+    if (counts[0] != 0 || !_near(counts[1], n, 0.2) || !_near(counts[2], n, 0.6) || !_near(counts[4], n, 0.1))
+        goto fail;
+    util_dist_free(&d);
+
+    /* 90% of the traffic to 20% of the 10 values */
+    if (util_dist_hotspot(&d, 10, 0.9, 0.2) != 0)
+        goto fail;
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < n; i++)
+        counts[util_dist_next(&d, &r, i)]++;
+    if (!_near(counts[0], n, 0.45) || !_near(counts[1], n, 0.45) || !_near(counts[9], n, 0.1 / 8))
+        goto fail;
+    util_dist_free(&d);
+
+    /* Uniform, and scan */
+    util_dist_uniform(&d, 10);
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < n; i++)
+        counts[util_dist_next(&d, &r, i)]++;
+    if (!_near(counts[0], n, 0.1) || !_near(counts[9], n, 0.1))
+        goto fail;
+    util_dist_scan(&d, 3);
+    if (util_dist_next(&d, &r, 0) != 0 || util_dist_next(&d, &r, 4) != 1 || util_dist_next(&d, &r, 8) != 2)
+        goto fail;
+
+    /* These are all errors */
+    if (util_dist_zipf(&d, 0, 1.0) == 0 || util_dist_zipf(&d, 10, 0.0) == 0)
+        goto fail;
+    if (util_dist_hotspot(&d, 10, 1.5, 0.1) == 0 || util_dist_weights(&d, weights, 1) == 0)
+        goto fail;
+
+    return 0;
+fail:
+    fprintf(stderr, "[-] util-dist: programming error\n");
+    return 1;
+}
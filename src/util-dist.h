@@ -0,0 +1,120 @@
+/*
+    Key distributions
+
+ Samplers that choose a value from [0..count) according to some
+ distribution, for choosing which keys (URLs, requests) to ask for,
+ since how popular each key is decides how often a cache can answer:
+
+    uniform     each value as likely as any other
+    zipf        value k (from 0) with probability proportional to
+                1/(k+1)^s, the classic long tail of popularity
+    hotspot     a fraction of the traffic (like 90%) goes to a
+                fraction of the values (like the first 10%), the
+                rest to the others, uniform within each
+    scan        the values in order, 0, 1, 2, ..., wrapping around
+    weights     value i with probability proportional to weights[i]
+
+ Every sampler takes the same, constant, time. The ones that aren't
+ uniform are precomputed into Walker's alias table (using Vose's
+ method to build it), where each column has the chance of keeping its
+ own value, or else its alias. Sampling is then one random number,
+ split into the column and the coin toss, and one table lookup,
+ however many values there are. The table takes 8 bytes per value.
+ With hotspot, the columns are ranges of values, so it has only two.
+
+ The sampler is constant once it's built, so workers can share one.
+ That means it can't keep a place of its own for scan: instead, each
+ call is given a sequence number, which scan uses, and the others
+ ignore.
+ */
+#ifndef UTIL_DIST_H
+#define UTIL_DIST_H
+#include "util-rand.h"
+#include <stdint.h>
+#include <stddef.h>
+
+enum util_dist_kind_t {
+    DIST_UNIFORM,
+    DIST_ALIAS,
+    DIST_SCAN,
+};
+
+/* One column of the alias table: the chance (out of 2^32) of keeping
+ * its own value, rather than taking its alias. They're together so
+ * that choosing a value touches only one cache line. */
+typedef struct util_dist_column_t {
+    uint32_t keep;
+    uint32_t alias;
+} util_dist_column_t;
+
+typedef struct util_dist_t {
+    enum util_dist_kind_t kind;
+
+    /* The values are [0..count) */
+    uint64_t count;
+
+    util_dist_column_t *table;
+    size_t columns;
+
+    /* If not NULL, each column is this range of values, chosen from
+     * uniformly, rather than the one value */
+    uint64_t *range_first;
+    uint64_t *range_count;
+} util_dist_t;
+
+/**
+ * Each value in [0..count) as likely as any other.
+ */
+void
+util_dist_uniform(util_dist_t *d, uint64_t count);
+
+/**
+ * The values in order, using the sequence number given to
+ * `util_dist_next()`.
+ */
+void
+util_dist_scan(util_dist_t *d, uint64_t count);
+
+/**
+ * Value k in [0..count) with probability proportional to 1/(k+1)^s.
+ * @return
+ *      0 on success, or -1 if the count or exponent aren't valid,
+ *      or there isn't the memory for the table.
+ */
+int
+util_dist_zipf(util_dist_t *d, uint64_t count, double s);
+
+/**
+ * The fraction 'traffic' of the samples are uniform among the first
+ * 'keys' fraction of the values, and the rest among the others.
+ * @return
+ *      0 on success, or -1 if the fractions aren't between 0 and 1.
+ */
+int
+util_dist_hotspot(util_dist_t *d, uint64_t count, double traffic, double keys);
+
+/**
+ * Value i in [0..count) with probability proportional to weights[i].
+ * @return
+ *      0 on success, or -1 if the weights don't add up to more than
+ *      zero, or there isn't the memory for the table.
+ */
+int
+util_dist_weights(util_dist_t *d, const double *weights, size_t count);
+
+/**
+ * Choose the next value.
+ * @param sequence
+ *      The caller's count of the values it has chosen, used only by
+ *      scan.
+ */
+uint64_t
+util_dist_next(const util_dist_t *d, util_rand_t *r, uint64_t sequence);
+
+void
+util_dist_free(util_dist_t *d);
+
+int
+util_dist_selftest(void);
+
+#endif
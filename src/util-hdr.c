@@ -0,0 +1,209 @@
+#include "util-hdr.h"
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static unsigned
+_highest_bit(uint64_t value) {
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (unsigned)index;
+}
+#else
+static unsigned
+_highest_bit(uint64_t value) {
+    return 63 - (unsigned)__builtin_clzll(value);
+}
+#endif
+
+#define HDR_MAX_VALUE ((1ULL << HDR_MAX_BITS) - 1)
+
+/*
+ * Values less than 2^HDR_SUB_BITS are their own index. Above that,
+ * we shift the value down until it's in the top half of that range,
+ * and the number of shifts selects which group of 128 buckets.
+ */
+static unsigned
+_hdr_index(uint64_t value) {
+    unsigned shift;
+
+    if (value < (1ULL << HDR_SUB_BITS))
+        return (unsigned)value;
+    if (value > HDR_MAX_VALUE)
+        value = HDR_MAX_VALUE;
+
+    shift = _highest_bit(value) - HDR_SUB_BITS + 1;
+    return (shift << (HDR_SUB_BITS - 1)) + (unsigned)(value >> shift);
+}
+
+/*
+ * The reverse of the above, the highest value that would be
+ * counted in this bucket.
+ */
+static uint64_t
+_hdr_value(unsigned index) {
+    unsigned shift;
+    uint64_t sub;
+
+    if (index < (1U << HDR_SUB_BITS))
+        return index;
+
+    shift = (index >> (HDR_SUB_BITS - 1)) - 1;
+    sub = index - (shift << (HDR_SUB_BITS - 1));
+    return ((sub + 1) << shift) - 1;
+}
+
+void
+util_hdr_record(util_hdr_t *hdr, uint64_t value) {
+    hdr->buckets[_hdr_index(value)]++;
+    hdr->count++;
+    hdr->total += value;
+    if (hdr->max < value)
+        hdr->max = value;
+}
+
+void
+util_hdr_add(util_hdr_t *sum, const util_hdr_t *hdr) {
+    size_t i;
+
+    if (hdr->count == 0)
+        return;
+    for (i = 0; i < HDR_BUCKET_COUNT; i++)
+        sum->buckets[i] += hdr->buckets[i];
+    sum->count += hdr->count;
+    sum->total += hdr->total;
+    if (sum->max < hdr->max)
+        sum->max = hdr->max;
+}
+
+void
+util_hdr_subtract(util_hdr_t *hdr, const util_hdr_t *before) {
+    uint64_t max = 0;
+    size_t i;
+
+    for (i = 0; i < HDR_BUCKET_COUNT; i++) {
+        hdr->buckets[i] -= before->buckets[i];
+        if (hdr->buckets[i])
+            max = _hdr_value((unsigned)i);
+    }
+    hdr->count -= before->count;
+    hdr->total -= before->total;
+    if (hdr->max > max)
+        hdr->max = max;
+}
+
+void
+util_hdr_clear(util_hdr_t *hdr) {
+    memset(hdr, 0, sizeof(*hdr));
+}
+
+uint64_t
+util_hdr_percentile(const util_hdr_t *hdr, double percentile) {
+    uint64_t target;
+    uint64_t seen = 0;
+    unsigned i;
+
+    if (hdr->count == 0)
+        return 0;
+
+    /* The number of values at or below the one we want */
+    target = (uint64_t)(hdr->count * (percentile / 100.0) + 0.5);
+    if (target < 1)
+        target = 1;
+    if (target >= hdr->count)
+        return hdr->max;
+
+    for (i = 0; i < HDR_BUCKET_COUNT; i++) {
+        seen += hdr->buckets[i];
+        if (seen >= target) {
+            uint64_t value = _hdr_value(i);
+            return (value < hdr->max) ? value : hdr->max;
+        }
+    }
+    return hdr->max;
+}
+
+uint64_t
+util_hdr_mean(const util_hdr_t *hdr) {
+    if (hdr->count == 0)
+        return 0;
+    return hdr->total / hdr->count;
+}
+
+uint64_t
+util_hdr_count_below(const util_hdr_t *hdr, uint64_t value) {
+    uint64_t count = 0;
+    unsigned i;
+
+    for (i = 0; i < HDR_BUCKET_COUNT && _hdr_value(i) <= value; i++)
+        count += hdr->buckets[i];
+    return count;
+}
+
+int
+util_hdr_selftest(void) {
+    static util_hdr_t a;
+    static util_hdr_t b;
+    uint64_t value;
+    unsigned i;
+
+    /* Every value must map to a bucket whose range includes it,
+     * and the bucket must be narrow enough */
+    for (value = 1; value < HDR_MAX_VALUE; value = value * 3 / 2 + 1) {
+        unsigned index = _hdr_index(value);
+        uint64_t high = _hdr_value(index);
+        uint64_t low = index ? _hdr_value(index - 1) + 1 : 0;
+
+        if (index >= HDR_BUCKET_COUNT || value < low || value > high
+            || (high - low) > value / 128) {
+            fprintf(stderr, "[-] util.hdr: programming error: value=%llu\n",
+                (unsigned long long)value);
+            return 1;
+        }
+    }
+    if (_hdr_index(~0ULL) != HDR_BUCKET_COUNT - 1)
+        goto fail;
+
+    /* Record 1..100000 split between two histograms, then add
+     * them together */
+    util_hdr_clear(&a);
+    util_hdr_clear(&b);
+    for (i = 1; i <= 100000; i++)
+        util_hdr_record((i & 1) ? &a : &b, i);
+    util_hdr_add(&a, &b);
+
+    if (a.count != 100000 || a.max != 100000 || util_hdr_mean(&a) != 50000)
+        goto fail;
+    value = util_hdr_percentile(&a, 50.0);
+    if (value < 50000 || value > 50000 + 50000/128)
+        goto fail;
+    value = util_hdr_percentile(&a, 99.9);
+    if (value < 99900 || value > 99900 + 99900/128)
+        goto fail;
+    if (util_hdr_percentile(&a, 100.0) != 100000)
+        goto fail;
+    if (util_hdr_percentile(&b, 0.0) != 2)
+        goto fail;
+
+    /* Only whole buckets are counted, so a bucket that straddles the
+     * value is left out */
+    if (util_hdr_count_below(&a, 255) != 255 || util_hdr_count_below(&a, ~0ULL) != 100000)
+        goto fail;
+    value = util_hdr_count_below(&a, 50000);
+    if (value > 50000 || value < 50000 - 50000/128)
+        goto fail;
+
+    /* Taking the odd ones back out leaves the even ones */
+    util_hdr_clear(&b);
+    for (i = 1; i <= 100000; i += 2)
+        util_hdr_record(&b, i);
+    util_hdr_subtract(&a, &b);
+    if (a.count != 50000 || util_hdr_mean(&a) != 50001 || a.max < 100000 || a.max > 100000 + 100000/128)
+        goto fail;
+
+    return 0;
+fail:
+    fprintf(stderr, "[-] util.hdr: programming error\n");
+    return 1;
+}
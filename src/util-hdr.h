@@ -0,0 +1,89 @@
+/*
+    Latency histograms
+
+ A log-linear histogram, in the style of HdrHistogram. Values are in
+ nanoseconds. Small values (under 256) each get their own bucket,
+ and above that, every power of two is split into 128 linear buckets,
+ so any recorded value is accurate to within 1%.
+
+ The histogram is a fixed size, with no memory allocation, so that
+ recording a value is just a couple shifts and an increment, cheap
+ enough to do for every request. Histograms from several workers
+ can be added together, then percentiles read from the sum.
+ */
+#ifndef UTIL_HDR_H
+#define UTIL_HDR_H
+#include <stdint.h>
+
+/* The number of bits of precision, a bucket's width is at most
+ * 1/128 of its value */
+#define HDR_SUB_BITS 8
+
+/* Values of 2^41 nanoseconds (about 36 minutes) or more are counted
+ * in the last bucket */
+#define HDR_MAX_BITS 41
+
+#define HDR_BUCKET_COUNT ((HDR_MAX_BITS - HDR_SUB_BITS + 2) << (HDR_SUB_BITS - 1))
+
+typedef struct util_hdr_t {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t buckets[HDR_BUCKET_COUNT];
+} util_hdr_t;
+
+/**
+ * Count one value (nanoseconds).
+ */
+void
+util_hdr_record(util_hdr_t *hdr, uint64_t value);
+
+/**
+ * Add all the values counted in 'hdr' into 'sum'.
+ */
+void
+util_hdr_add(util_hdr_t *sum, const util_hdr_t *hdr);
+
+/**
+ * Remove the values counted in 'before', an earlier snapshot of the
+ * same histogram, leaving only those counted since. The maximum can't
+ * be undone exactly, so it becomes the top of the highest bucket.
+ */
+void
+util_hdr_subtract(util_hdr_t *hdr, const util_hdr_t *before);
+
+/**
+ * Reset the histogram to nothing.
+ */
+void
+util_hdr_clear(util_hdr_t *hdr);
+
+/**
+ * Find the value below which the given percentage of the values fall,
+ * such as 99.9 for the 99.9th percentile.
+ * @return
+ *      the highest value that could be in the matching bucket, or
+ *      0 if nothing has been recorded
+ */
+uint64_t
+util_hdr_percentile(const util_hdr_t *hdr, double percentile);
+
+/**
+ * The average of all the values, or 0 if there are none.
+ */
+uint64_t
+util_hdr_mean(const util_hdr_t *hdr);
+
+/**
+ * The number of values that are at most 'value', counting only the
+ * buckets that lie entirely at or below it, so it may undercount by
+ * the one bucket that straddles it. This is what's needed for
+ * cumulative histograms such as Prometheus's.
+ */
+uint64_t
+util_hdr_count_below(const util_hdr_t *hdr, uint64_t value);
+
+int
+util_hdr_selftest(void);
+
+#endif
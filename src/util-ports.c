@@ -0,0 +1,137 @@
+#include "util-ports.h"
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static unsigned
+_lowest_bit(uint64_t value) {
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return (unsigned)index;
+}
+#else
+static unsigned
+_lowest_bit(uint64_t value) {
+    return (unsigned)__builtin_ctzll(value);
+}
+#endif
+
+size_t
+util_ports_words(unsigned count) {
+    return (count + 63) / 64;
+}
+
+void
+util_ports_init(util_ports_t *ports, unsigned first, unsigned count, uint64_t *bitmap) {
+    size_t words = util_ports_words(count);
+
+    ports->first = first;
+    ports->count = count;
+    ports->cursor = 0;
+    ports->in_use = 0;
+    ports->bitmap = bitmap;
+    memset(bitmap, 0, words * sizeof(*bitmap));
+
+    /* Mark the bits past the end of the range as used, so that
+     * we never have to check for them */
+    if (count % 64)
+        bitmap[words - 1] = ~0ULL << (count % 64);
+}
+
+unsigned
+util_ports_alloc(util_ports_t *ports) {
+    size_t words = util_ports_words(ports->count);
+    size_t word = ports->cursor / 64;
+    uint64_t free_bits;
+    size_t i;
+
+    if (ports->in_use >= ports->count)
+        return 0;
+
+    /* In the first word, only look at the bits from the cursor on */
+    free_bits = ~ports->bitmap[word] & (~0ULL << (ports->cursor % 64));
+
+    /* Then whole words at a time, wrapping around, and coming back
+     * to the start of the first word at the end */
+    for (i = 0; free_bits == 0 && i < words; i++) {
+        word = (word + 1) % words;
+        free_bits = ~ports->bitmap[word];
+    }
+    if (free_bits == 0)
+        return 0;
+
+    {
+        unsigned index = (unsigned)(word * 64 + _lowest_bit(free_bits));
+        ports->bitmap[word] |= 1ULL << (index % 64);
+        ports->in_use++;
+        ports->cursor = (index + 1) % ports->count;
+        return ports->first + index;
+    }
+}
+
+void
+util_ports_free(util_ports_t *ports, unsigned port) {
+    unsigned index = port - ports->first;
+
+    if (index >= ports->count)
+        return;
+    if (ports->bitmap[index / 64] & (1ULL << (index % 64))) {
+        ports->bitmap[index / 64] &= ~(1ULL << (index % 64));
+        ports->in_use--;
+    }
+}
+
+int
+util_ports_selftest(void) {
+    static uint64_t bitmap[3];
+    util_ports_t ports;
+    unsigned port;
+    unsigned i;
+
+    /* 130 ports, so the last word is only partly used */
+    util_ports_init(&ports, 1000, 130, bitmap);
+
+    /* They come out in order, then run out */
+    for (i = 0; i < 130; i++) {
+        if (util_ports_alloc(&ports) != 1000 + i)
+            goto fail;
+    }
+    if (util_ports_alloc(&ports) != 0)
+        goto fail;
+
+    /* Freed ports are reused oldest first, not most recent first */
+    util_ports_free(&ports, 1100);
+    util_ports_free(&ports, 1005);
+    util_ports_free(&ports, 1070);
+    if (util_ports_alloc(&ports) != 1005)
+        goto fail;
+    if (util_ports_alloc(&ports) != 1070)
+        goto fail;
+    util_ports_free(&ports, 1006);
+    if (util_ports_alloc(&ports) != 1100)
+        goto fail;
+    if (util_ports_alloc(&ports) != 1006)
+        goto fail;
+
+    /* Freeing twice, or out of range, changes nothing */
+    util_ports_free(&ports, 1001);
+    util_ports_free(&ports, 1001);
+    util_ports_free(&ports, 5000);
+    if (ports.in_use != 129)
+        goto fail;
+
+    /* A port isn't reused until the cursor gets all the way round */
+    for (i = 0; i < 130; i++)
+        util_ports_free(&ports, 1000 + i);
+    for (i = 0; i < 130; i++) {
+        port = util_ports_alloc(&ports);
+        if (port != 1000 + (7 + i) % 130)
+            goto fail;
+    }
+
+    return 0;
+fail:
+    fprintf(stderr, "[-] util.ports: programming error\n");
+    return 1;
+}
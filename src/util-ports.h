@@ -0,0 +1,56 @@
+/*
+    Source port allocator
+
+ With --source-ports, we choose the source port of each connection
+ ourselves, rather than letting the kernel search for a free one,
+ which gets slow (and eventually fails) as the ports run out.
+
+ There's one of these for each (source address, target address) pair.
+ It's a bitmap of the ports in use, and a cursor that goes round-robin
+ through the range, so that a port that was just closed (and is
+ likely in TIME_WAIT) is the last to be reused.
+ */
+#ifndef UTIL_PORTS_H
+#define UTIL_PORTS_H
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct util_ports_t {
+    unsigned first;
+    unsigned count;
+    unsigned cursor;
+    unsigned in_use;
+    uint64_t *bitmap;
+} util_ports_t;
+
+/**
+ * The number of 64-bit words of bitmap needed for 'count' ports.
+ */
+size_t
+util_ports_words(unsigned count);
+
+/**
+ * Initialize the allocator for the range [first..first+count), using
+ * 'bitmap', which has room for `util_ports_words(count)` words.
+ */
+void
+util_ports_init(util_ports_t *ports, unsigned first, unsigned count, uint64_t *bitmap);
+
+/**
+ * Allocate the next free port after the last one allocated.
+ * @return
+ *      the port, or 0 if they are all in use.
+ */
+unsigned
+util_ports_alloc(util_ports_t *ports);
+
+/**
+ * Give a port back.
+ */
+void
+util_ports_free(util_ports_t *ports, unsigned port);
+
+int
+util_ports_selftest(void);
+
+#endif
@@ -1,10 +1,20 @@
 #include "util-rand.h"
 #include <string.h>
+#include <stdio.h>
+
+/* The number of ChaCha20 blocks we make at a time, enough for the
+ * widest SIMD code to do them all at once */
+#define CHACHA20_BLOCKS 8
+#define CHACHA20_BUFFER_SIZE (64 * CHACHA20_BLOCKS)
 
 typedef struct  {
-    unsigned char buf[64];
+    unsigned char buf[CHACHA20_BUFFER_SIZE];
     uint32_t state[16];
     size_t partial;
+
+    /* Which generator this is, and if it's xoshiro256**, its state */
+    unsigned kind;
+    uint64_t s[4];
 } myrand_t;
 
 #ifndef MIN
@@ -49,6 +59,255 @@ chacha20_cryptomagic(unsigned char keystream[64], const uint32_t state[16])
     }
 }
 
+/*
+ * Several blocks at a time, starting from the block counter in
+ * 'state', with the same carry into the nonce as `util_rand_bytes()`.
+ */
+static void
+chacha20_blocks_scalar(unsigned char *keystream, const uint32_t state[16], size_t count)
+{
+    uint32_t x[16];
+    size_t i;
+
+    memcpy(x, state, sizeof(x));
+    for (i=0; i<count; i++) {
+        chacha20_cryptomagic(keystream + i * 64, x);
+        x[12]++;
+        if (x[12] == 0) {
+            x[13]++;
+            if (x[13] == 0)
+                x[14]++;
+        }
+    }
+}
+
+static void
+chacha20_fill_scalar(unsigned char keystream[CHACHA20_BUFFER_SIZE], const uint32_t state[16])
+{
+    chacha20_blocks_scalar(keystream, state, CHACHA20_BLOCKS);
+}
+
+/*
+ * On x86-64, we also do the blocks side-by-side in SIMD registers, where
+ * each register holds the same word of 4 (SSE2) or 8 (AVX2) blocks, so
+ * the quarter-rounds work on all of them at once. Only the block counter
+ * differs between them. At the end, the words are transposed back into
+ * the blocks' byte order, so the keystream is the same as from the
+ * scalar code. SSE2 is always there on x86-64, while AVX2 is only used
+ * if the CPU has it, which we check at runtime, so that the same binary
+ * runs everywhere. These never handle the block counter wrapping around,
+ * which is left to the scalar code.
+ */
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHACHA20_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#define ROTL128(x, n) _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+#define QUARTERROUND128(x, a, b, c, d) \
+  x[a] = _mm_add_epi32(x[a], x[b]); x[d] = ROTL128(_mm_xor_si128(x[d], x[a]), 16); \
+  x[c] = _mm_add_epi32(x[c], x[d]); x[b] = ROTL128(_mm_xor_si128(x[b], x[c]), 12); \
+  x[a] = _mm_add_epi32(x[a], x[b]); x[d] = ROTL128(_mm_xor_si128(x[d], x[a]),  8); \
+  x[c] = _mm_add_epi32(x[c], x[d]); x[b] = ROTL128(_mm_xor_si128(x[b], x[c]),  7)
+
+static void
+chacha20_blocks_sse2(unsigned char keystream[256], const uint32_t state[16])
+{
+    __m128i x[16];
+    __m128i in[16];
+    size_t i;
+
+    for (i=0; i<16; i++)
+        in[i] = _mm_set1_epi32((int)state[i]);
+    in[12] = _mm_add_epi32(in[12], _mm_set_epi32(3, 2, 1, 0));
+    memcpy(x, in, sizeof(x));
+
+    for (i=0; i<10; i++) {
+        QUARTERROUND128(x, 0, 4, 8,12);
+        QUARTERROUND128(x, 1, 5, 9,13);
+        QUARTERROUND128(x, 2, 6,10,14);
+        QUARTERROUND128(x, 3, 7,11,15);
+        QUARTERROUND128(x, 0, 5,10,15);
+        QUARTERROUND128(x, 1, 6,11,12);
+        QUARTERROUND128(x, 2, 7, 8,13);
+        QUARTERROUND128(x, 3, 4, 9,14);
+    }
+
+    /* Each group of 4 words, from each of the 4 blocks */
+    for (i=0; i<16; i += 4) {
+        __m128i a = _mm_add_epi32(x[i + 0], in[i + 0]);
+        __m128i b = _mm_add_epi32(x[i + 1], in[i + 1]);
+        __m128i c = _mm_add_epi32(x[i + 2], in[i + 2]);
+        __m128i d = _mm_add_epi32(x[i + 3], in[i + 3]);
+        __m128i ab_low = _mm_unpacklo_epi32(a, b);
+        __m128i cd_low = _mm_unpacklo_epi32(c, d);
+        __m128i ab_high = _mm_unpackhi_epi32(a, b);
+        __m128i cd_high = _mm_unpackhi_epi32(c, d);
+
+        _mm_storeu_si128((__m128i *)(keystream + 0 * 64 + i * 4), _mm_unpacklo_epi64(ab_low, cd_low));
+        _mm_storeu_si128((__m128i *)(keystream + 1 * 64 + i * 4), _mm_unpackhi_epi64(ab_low, cd_low));
+        _mm_storeu_si128((__m128i *)(keystream + 2 * 64 + i * 4), _mm_unpacklo_epi64(ab_high, cd_high));
+        _mm_storeu_si128((__m128i *)(keystream + 3 * 64 + i * 4), _mm_unpackhi_epi64(ab_high, cd_high));
+    }
+}
+
+static void
+chacha20_fill_sse2(unsigned char keystream[CHACHA20_BUFFER_SIZE], const uint32_t state[16])
+{
+    uint32_t x[16];
+    size_t i;
+
+    memcpy(x, state, sizeof(x));
+    for (i=0; i<CHACHA20_BLOCKS; i += 4) {
+        chacha20_blocks_sse2(keystream + i * 64, x);
+        x[12] += 4;
+    }
+}
+
+/* The rotates by 16 and 8 move whole bytes, so are a single shuffle */
+#define ROTL256(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define QUARTERROUND256(x, a, b, c, d) \
+  x[a] = _mm256_add_epi32(x[a], x[b]); x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot16); \
+  x[c] = _mm256_add_epi32(x[c], x[d]); x[b] = ROTL256(_mm256_xor_si256(x[b], x[c]), 12); \
+  x[a] = _mm256_add_epi32(x[a], x[b]); x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot8); \
+  x[c] = _mm256_add_epi32(x[c], x[d]); x[b] = ROTL256(_mm256_xor_si256(x[b], x[c]),  7)
+
+TARGET_AVX2 static void
+chacha20_blocks_avx2(unsigned char keystream[512], const uint32_t state[16])
+{
+    const __m256i rot16 = _mm256_set_epi8(
+        13,12,15,14, 9,8,11,10, 5,4,7,6, 1,0,3,2,
+        13,12,15,14, 9,8,11,10, 5,4,7,6, 1,0,3,2);
+    const __m256i rot8 = _mm256_set_epi8(
+        14,13,12,15, 10,9,8,11, 6,5,4,7, 2,1,0,3,
+        14,13,12,15, 10,9,8,11, 6,5,4,7, 2,1,0,3);
+    __m256i x[16];
+    __m256i in[16];
+    size_t i;
+
+    for (i=0; i<16; i++)
+        in[i] = _mm256_set1_epi32((int)state[i]);
+    in[12] = _mm256_add_epi32(in[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    memcpy(x, in, sizeof(x));
+
+    for (i=0; i<10; i++) {
+        QUARTERROUND256(x, 0, 4, 8,12);
+        QUARTERROUND256(x, 1, 5, 9,13);
+        QUARTERROUND256(x, 2, 6,10,14);
+        QUARTERROUND256(x, 3, 7,11,15);
+        QUARTERROUND256(x, 0, 5,10,15);
+        QUARTERROUND256(x, 1, 6,11,12);
+        QUARTERROUND256(x, 2, 7, 8,13);
+        QUARTERROUND256(x, 3, 4, 9,14);
+    }
+
+    /* The unpacks work within each 128-bit half, so the low half
+     * ends up with blocks 0-3, and the high half with blocks 4-7 */
+    for (i=0; i<16; i += 4) {
+        __m256i a = _mm256_add_epi32(x[i + 0], in[i + 0]);
+        __m256i b = _mm256_add_epi32(x[i + 1], in[i + 1]);
+        __m256i c = _mm256_add_epi32(x[i + 2], in[i + 2]);
+        __m256i d = _mm256_add_epi32(x[i + 3], in[i + 3]);
+        __m256i ab_low = _mm256_unpacklo_epi32(a, b);
+        __m256i cd_low = _mm256_unpacklo_epi32(c, d);
+        __m256i ab_high = _mm256_unpackhi_epi32(a, b);
+        __m256i cd_high = _mm256_unpackhi_epi32(c, d);
+        __m256i words[4];
+        size_t j;
+
+        words[0] = _mm256_unpacklo_epi64(ab_low, cd_low);
+        words[1] = _mm256_unpackhi_epi64(ab_low, cd_low);
+        words[2] = _mm256_unpacklo_epi64(ab_high, cd_high);
+        words[3] = _mm256_unpackhi_epi64(ab_high, cd_high);
+        for (j=0; j<4; j++) {
+            _mm_storeu_si128((__m128i *)(keystream + j * 64 + i * 4), _mm256_castsi256_si128(words[j]));
+            _mm_storeu_si128((__m128i *)(keystream + (j + 4) * 64 + i * 4), _mm256_extracti128_si256(words[j], 1));
+        }
+    }
+}
+
+TARGET_AVX2 static void
+chacha20_fill_avx2(unsigned char keystream[CHACHA20_BUFFER_SIZE], const uint32_t state[16])
+{
+    chacha20_blocks_avx2(keystream, state);
+}
+
+static int
+cpu_has_avx2(void)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+
+    /* The CPU has it, and the OS saves the YMM registers */
+    __cpuid(info, 1);
+    if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6)
+        return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] >> 5) & 1;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+typedef void (*chacha20_fill_t)(unsigned char keystream[CHACHA20_BUFFER_SIZE], const uint32_t state[16]);
+
+/* The fastest the CPU can do, chosen by util_rand_init() before any
+ * threads start, so it's only ever read after that. Until then, it's
+ * the scalar code, which makes the same blocks */
+static chacha20_fill_t chacha20_fill_best = chacha20_fill_scalar;
+
+static void
+chacha20_choose(void)
+{
+#ifdef CHACHA20_SIMD
+    if (cpu_has_avx2())
+        chacha20_fill_best = chacha20_fill_avx2;
+    else
+        chacha20_fill_best = chacha20_fill_sse2;
+#else
+    chacha20_fill_best = chacha20_fill_scalar;
+#endif
+}
+
+/*
+ * Fill the buffer with the blocks starting at the current counter
+ */
+static void
+chacha20_fill(myrand_t *ctx)
+{
+    if (ctx->state[12] > 0xFFFFFFFF - (CHACHA20_BLOCKS - 1))
+        chacha20_fill_scalar(ctx->buf, ctx->state);
+    else
+        chacha20_fill_best(ctx->buf, ctx->state);
+    ctx->partial = 0;
+}
+
+/*
+ * Move the counter past the blocks in the buffer, and fill it with
+ * the next ones. Once we've incremented past the 64-bit counter
+ * boundary, we start incrementing the nonce, giving us a 96-bit
+ * length instead of 64-bit length.
+ */
+static void
+chacha20_next(myrand_t *ctx)
+{
+    uint32_t before = ctx->state[12];
+
+    ctx->state[12] += CHACHA20_BLOCKS;
+    if (ctx->state[12] < before) {
+        ctx->state[13]++;
+        if (ctx->state[13] == 0)
+            ctx->state[14]++;
+    }
+    chacha20_fill(ctx);
+}
+
 static void 
 chacha20_init(myrand_t *ctx, const unsigned char key[32], const unsigned char nonce[8])
 {
@@ -439,15 +698,83 @@ util_sha512_selftest(void)
 
 
 
+#define READ64LE(p) (((uint64_t)READ32LE((p) + 4) << 32) | READ32LE(p))
+
+#define ROTL64(number, count) (((number) << (count)) | ((number) >> (64 - (count))))
+
+/*
+ * The xoshiro256** generator, by Blackman and Vigna: a few shifts,
+ * rotates, and XORs for each 64-bit number.
+ */
+static uint64_t
+xoshiro256_next(myrand_t *ctx)
+{
+    uint64_t *s = ctx->s;
+    uint64_t result = ROTL64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = ROTL64(s[3], 45);
+    return result;
+}
+
+/*
+ * XOR the hash into the xoshiro256** state, which must never be
+ * all zeroes, as it would then stay that way.
+ */
+static void
+xoshiro256_stir(myrand_t *ctx, const unsigned char digest[32])
+{
+    size_t i;
+
+    for (i = 0; i < 4; i++)
+        ctx->s[i] ^= READ64LE(digest + i * 8);
+    if ((ctx->s[0] | ctx->s[1] | ctx->s[2] | ctx->s[3]) == 0)
+        ctx->s[0] = 1;
+}
+
+void util_rand_init(void)
+{
+    chacha20_choose();
+}
+
 void util_rand_seed(util_rand_t *vctx, const void *vseed, size_t seed_length)
+{
+    util_rand_seed_kind(vctx, UTIL_RAND_CHACHA20, vseed, seed_length);
+}
+
+void util_rand_seed_kind(util_rand_t *vctx, enum util_rand_kind_t kind, const void *vseed, size_t seed_length)
 {
     unsigned char digest[64];
     myrand_t *ctx = (myrand_t *)vctx;
     const unsigned char *seed = (const unsigned char *)vseed;
 
     util_sha512(seed, seed_length, digest, sizeof(digest));
+    ctx->kind = kind;
+    if (kind == UTIL_RAND_XOSHIRO256) {
+        memset(ctx->s, 0, sizeof(ctx->s));
+        xoshiro256_stir(ctx, digest);
+        return;
+    }
     chacha20_init(ctx, digest, digest+32);
-    chacha20_cryptomagic(ctx->buf, ctx->state);
+    chacha20_fill(ctx);
+}
+
+const char *util_rand_name(enum util_rand_kind_t kind)
+{
+    if (kind == UTIL_RAND_XOSHIRO256)
+        return "xoshiro256**";
+#ifdef CHACHA20_SIMD
+    if (chacha20_fill_best == chacha20_fill_avx2)
+        return "chacha20-avx2";
+    if (chacha20_fill_best == chacha20_fill_sse2)
+        return "chacha20-sse2";
+#endif
+    return "chacha20";
 }
 
 void util_rand_stir(util_rand_t *vctx, const void *seed, size_t seed_length)
@@ -463,6 +790,10 @@ void util_rand_stir(util_rand_t *vctx, const void *seed, size_t seed_length)
      * a small buffer (like from clock_getttime()), or reduce a large
      * buffer down to 64-bytes in case it's very large. */
     util_sha512(seed, seed_length, digest, sizeof(digest));
+    if (ctx->kind == UTIL_RAND_XOSHIRO256) {
+        xoshiro256_stir(ctx, digest);
+        return;
+    }
 
     /* Now we XOR the new data with the old data, which is the
      * 'nonce' and 'key' in the ChaCha20 encryption algorithm.
@@ -489,128 +820,296 @@ void util_rand_bytes(util_rand_t *vctx, void *vbuf, size_t length)
     size_t i;
     unsigned char *buf = (unsigned char *)vbuf;
 
-    for (i=0; i<length; ) {
-        size_t j;
-        size_t jlen;
-        
-        /* Get as many bytes from the pre-calculated buffer as
-         * until we've exhausted those. */
-        jlen = MIN(64, ctx->partial + length - i);
-        for (j=ctx->partial; j<jlen; j++)
-            buf[i++] = ctx->buf[j];
-        ctx->partial = j;
-
-        /* Once we reach the end of the current pre-calculated numbers,
-         * grab the next buffer of numbers. */
-        if (ctx->partial >= 64) {
-            /* Increment the ChaCha20 block counter. In this code, however
-             * once we've incremented past the 64-bit counter boundary,
-             * we start incrementing the nonce, giving us a 96-bit length
-             * instead of 64-bit length. */
-            ctx->state[12]++;
-            if (ctx->state[12] == 0) {
-                ctx->state[13]++;
-                if (ctx->state[13] == 0)
-                    ctx->state[14]++;
-            }
-            chacha20_cryptomagic(ctx->buf, ctx->state);
-            ctx->partial = 0;
+    if (ctx->kind == UTIL_RAND_XOSHIRO256) {
+        for (i=0; i<length; i += 8) {
+            uint64_t x = xoshiro256_next(ctx);
+            memcpy(buf + i, &x, MIN(8, length - i));
         }
+        return;
+    }
+
+    /* Copy as much as we can from the buffer, and once it's used up,
+     * make the next blocks */
+    for (i=0; i<length; ) {
+        size_t n = MIN(CHACHA20_BUFFER_SIZE - ctx->partial, length - i);
+
+        memcpy(buf + i, ctx->buf + ctx->partial, n);
+        ctx->partial += n;
+        i += n;
+        if (ctx->partial >= CHACHA20_BUFFER_SIZE)
+            chacha20_next(ctx);
     }
 }
 
-uint64_t util_rand(util_rand_t *ctx)
+/*
+ * With ChaCha20, the smaller functions take their number straight from
+ * the buffer, unless it's about to run out. With xoshiro256**, they take
+ * the top bits, which are the best ones.
+ */
+uint64_t util_rand(util_rand_t *vctx)
 {
+    myrand_t *ctx = (myrand_t *)vctx;
     uint64_t result;
-    util_rand_bytes(ctx, &result, sizeof(result));
+
+    if (ctx->kind == UTIL_RAND_XOSHIRO256)
+        return xoshiro256_next(ctx);
+    if (ctx->partial + sizeof(result) < CHACHA20_BUFFER_SIZE) {
+        memcpy(&result, ctx->buf + ctx->partial, sizeof(result));
+        ctx->partial += sizeof(result);
+        return result;
+    }
+    util_rand_bytes(vctx, &result, sizeof(result));
     return result;
 }
 
-uint32_t util_rand32(util_rand_t *ctx)
+uint32_t util_rand32(util_rand_t *vctx)
 {
+    myrand_t *ctx = (myrand_t *)vctx;
     uint32_t result;
-    util_rand_bytes(ctx, &result, sizeof(result));
+
+    if (ctx->kind == UTIL_RAND_XOSHIRO256)
+        return (uint32_t)(xoshiro256_next(ctx) >> 32);
+    if (ctx->partial + sizeof(result) < CHACHA20_BUFFER_SIZE) {
+        memcpy(&result, ctx->buf + ctx->partial, sizeof(result));
+        ctx->partial += sizeof(result);
+        return result;
+    }
+    util_rand_bytes(vctx, &result, sizeof(result));
     return result;
 }
 
-uint16_t util_rand16(util_rand_t *ctx)
+uint16_t util_rand16(util_rand_t *vctx)
 {
+    myrand_t *ctx = (myrand_t *)vctx;
     uint16_t result;
-    util_rand_bytes(ctx, &result, sizeof(result));
+
+    if (ctx->kind == UTIL_RAND_XOSHIRO256)
+        return (uint16_t)(xoshiro256_next(ctx) >> 48);
+    if (ctx->partial + sizeof(result) < CHACHA20_BUFFER_SIZE) {
+        memcpy(&result, ctx->buf + ctx->partial, sizeof(result));
+        ctx->partial += sizeof(result);
+        return result;
+    }
+    util_rand_bytes(vctx, &result, sizeof(result));
     return result;
 }
 
-unsigned char util_rand8(util_rand_t *ctx)
+unsigned char util_rand8(util_rand_t *vctx)
 {
+    myrand_t *ctx = (myrand_t *)vctx;
     unsigned char result;
-    util_rand_bytes(ctx, &result, sizeof(result));
+
+    if (ctx->kind == UTIL_RAND_XOSHIRO256)
+        return (unsigned char)(xoshiro256_next(ctx) >> 56);
+    if (ctx->partial + sizeof(result) < CHACHA20_BUFFER_SIZE)
+        return ctx->buf[ctx->partial++];
+    util_rand_bytes(vctx, &result, sizeof(result));
     return result;
 }
 
 /*
- * This is a traditional way of making uniform non-binary numbers out
- * of binary numbers, by continuing to call the rand() function until
- * it delivers a value that'll give a uniform distribution.
+ * The 128-bit product of two 64-bit numbers, returning the high half
+ */
+static uint64_t
+mul128(uint64_t a, uint64_t b, uint64_t *r_low)
+{
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 product = (unsigned __int128)a * b;
+    *r_low = (uint64_t)product;
+    return (uint64_t)(product >> 64);
+#else
+    uint64_t a_low = (uint32_t)a, a_high = a >> 32;
+    uint64_t b_low = (uint32_t)b, b_high = b >> 32;
+    uint64_t low_low = a_low * b_low;
+    uint64_t high_low = a_high * b_low;
+    uint64_t low_high = a_low * b_high;
+    uint64_t middle = (low_low >> 32) + (uint32_t)high_low + (uint32_t)low_high;
+
+    *r_low = (middle << 32) | (uint32_t)low_low;
+    return a_high * b_high + (high_low >> 32) + (low_high >> 32) + (middle >> 32);
+#endif
+}
+
+/*
+ * This uses Lemire's method: multiplying the random number by the
+ * bound, the high half of the product is the result, and the low half
+ * is where it fell within that result's share of the random numbers.
+ * A few of those (fewer than 'upper_bound' of the 2^64) would make
+ * some results more likely than others, so we throw them out and try
+ * again. Only when the low half is small enough that it might be one
+ * of them do we pay for the division to find out.
  */
 uint64_t util_rand_uniform(util_rand_t *ctx, uint64_t upper_bound)
 {
-    uint64_t threshold;
+    uint64_t low;
+    uint64_t result;
 
     if (upper_bound <= 1)
         return 0;
-    
-    threshold =  -(int64_t)upper_bound % (int64_t)upper_bound;
-    for (;;) {
-        uint64_t result = util_rand(ctx);
-        if (result >= threshold)
-            return result % upper_bound;
+
+    result = mul128(util_rand(ctx), upper_bound, &low);
+    if (low < upper_bound) {
+        uint64_t threshold = (0 - upper_bound) % upper_bound;
+        while (low < threshold)
+            result = mul128(util_rand(ctx), upper_bound, &low);
     }
+    return result;
 }
 
 /* see `util_rand_uniform()` for more info */
 uint32_t util_rand32_uniform(util_rand_t *ctx, uint32_t upper_bound)
 {
-    uint32_t threshold;
+    uint64_t product;
 
     if (upper_bound <= 1)
         return 0;
-    
-    threshold = -(int)upper_bound % (int)upper_bound;
-    for (;;) {
-        uint32_t result = util_rand32(ctx);
-        if (result >= threshold)
-            return result % upper_bound;
+
+    product = (uint64_t)util_rand32(ctx) * upper_bound;
+    if ((uint32_t)product < upper_bound) {
+        uint32_t threshold = (0U - upper_bound) % upper_bound;
+        while ((uint32_t)product < threshold)
+            product = (uint64_t)util_rand32(ctx) * upper_bound;
     }
+    return (uint32_t)(product >> 32);
 }
 
 /* see `util_rand_uniform()` for more info */
 uint16_t util_rand16_uniform(util_rand_t *ctx, uint16_t upper_bound)
 {
-    uint32_t threshold;
-
-    if (upper_bound <= 1)
-        return 0;
-    
-    threshold = -(int)upper_bound % (int)upper_bound;
-    for (;;) {
-        uint32_t result = util_rand16(ctx);
-        if (result >= threshold)
-            return result % upper_bound;
-    }
+    return (uint16_t)util_rand32_uniform(ctx, upper_bound);
 }
 
 /* see `util_rand_uniform()` for more info */
 unsigned char util_rand8_uniform(util_rand_t *ctx, unsigned char upper_bound)
 {
-    uint32_t threshold;
+    return (unsigned char)util_rand32_uniform(ctx, upper_bound);
+}
 
-    if (upper_bound <= 1)
-        return 0;
-    
-    threshold = -upper_bound % upper_bound;
-    for (;;) {
-        uint32_t result = util_rand8(ctx);
-        if (result >= threshold)
-            return result % upper_bound;
+int util_rand_selftest(void)
+{
+    static const unsigned char zeroes[32] = {0};
+    static const unsigned char keystream[16] = {
+        0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90,
+        0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28};
+    enum util_rand_kind_t kind;
+    util_rand_t r;
+    myrand_t *ctx = (myrand_t *)&r;
+    unsigned counts[3];
+    uint64_t x;
+    uint64_t low;
+    size_t i;
+
+    if (sizeof(myrand_t) > sizeof(util_rand_t))
+        goto fail;
+    if (!util_sha512_selftest())
+        goto fail;
+
+    /* ChaCha20 with an all-zero key and nonce */
+    chacha20_init(ctx, zeroes, zeroes);
+    chacha20_cryptomagic(ctx->buf, ctx->state);
+    if (memcmp(ctx->buf, keystream, sizeof(keystream)) != 0)
+        goto fail;
+
+    /* The SIMD code makes the same blocks as the scalar code, from
+     * any counter */
+    {
+        static const uint32_t counters[] = {0, 1, 0x7FFFFFFF, 0xFFFFFFF0};
+        unsigned char expected[CHACHA20_BUFFER_SIZE];
+        unsigned char got[CHACHA20_BUFFER_SIZE];
+
+        chacha20_init(ctx, (const unsigned char *)"0123456789abcdefghijklmnopqrstuv", zeroes);
+        ctx->state[13] = 0x12345678;
+        for (i = 0; i < sizeof(counters)/sizeof(counters[0]); i++) {
+            ctx->state[12] = counters[i];
+            chacha20_fill_scalar(expected, ctx->state);
+            chacha20_fill_best(got, ctx->state);
+            if (memcmp(expected, got, sizeof(got)) != 0)
+                goto fail;
+#ifdef CHACHA20_SIMD
+            memset(got, 0, sizeof(got));
+            chacha20_fill_sse2(got, ctx->state);
+            if (memcmp(expected, got, sizeof(got)) != 0)
+                goto fail;
+#endif
+        }
+
+        /* When the counter wraps around, it carries into the next word */
+        ctx->state[12] = 0xFFFFFFFC;
+        chacha20_fill(ctx);
+        memcpy(got, ctx->buf, sizeof(got));
+        ctx->state[12] = 0;
+        ctx->state[13]++;
+        chacha20_blocks_scalar(expected, ctx->state, 4);
+        if (memcmp(got + 4 * 64, expected, 4 * 64) != 0)
+            goto fail;
+        ctx->state[12] = 0xFFFFFFF8;
+        ctx->state[13]--;
+        chacha20_next(ctx);
+        if (ctx->state[12] != 0 || ctx->state[13] != 0x12345679 || memcmp(ctx->buf, expected, 4 * 64) != 0)
+            goto fail;
+    }
+
+    /* The same numbers as before the buffer held more than one block,
+     * whichever way they're taken out of it */
+    {
+        unsigned char bytes[37];
+
+        util_rand_seed(&r, "stream", 6);
+        x = 0;
+        for (i = 0; i < 1000; i++) {
+            x = x * 31 + util_rand(&r);
+            x = x * 31 + util_rand32(&r);
+            util_rand_bytes(&r, bytes, i % 37);
+            x = x * 31 + ((i % 37) ? bytes[i % 37 - 1] : 0);
+            x = x * 31 + util_rand8(&r);
+        }
+        if (x != 0x14e0c7b2cb652afeULL)
+            goto fail;
     }
+
+    /* xoshiro256** from {1, 2, 3, 4} */
+    ctx->kind = UTIL_RAND_XOSHIRO256;
+    ctx->s[0] = 1;
+    ctx->s[1] = 2;
+    ctx->s[2] = 3;
+    ctx->s[3] = 4;
+    if (util_rand(&r) != 0x2d00 || util_rand(&r) != 0)
+        goto fail;
+    if (util_rand(&r) != 0x5a007080 || util_rand(&r) != 0x10e0000000009d80ULL)
+        goto fail;
+
+    /* The same seed, the same numbers */
+    util_rand_seed_kind(&r, UTIL_RAND_XOSHIRO256, "x", 1);
+    x = util_rand(&r);
+    util_rand_seed_kind(&r, UTIL_RAND_XOSHIRO256, "x", 1);
+    if (util_rand(&r) != x)
+        goto fail;
+
+    /* With either generator, a bound of 3 gives 0, 1, and 2 about
+     * equally, and a bound near 2^64 stays under it */
+    for (kind = UTIL_RAND_CHACHA20; kind <= UTIL_RAND_XOSHIRO256; kind++) {
+        util_rand_seed_kind(&r, kind, "uniform", 7);
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < 30000; i++) {
+            counts[util_rand_uniform(&r, 3)]++;
+            if (util_rand32_uniform(&r, 7) >= 7 || util_rand8_uniform(&r, 5) >= 5)
+                goto fail;
+            if (util_rand_uniform(&r, 0xFFFFFFFFFFFFFFF0ULL) >= 0xFFFFFFFFFFFFFFF0ULL)
+                goto fail;
+        }
+        for (i = 0; i < 3; i++) {
+            if (counts[i] < 9500 || counts[i] > 10500)
+                goto fail;
+        }
+    }
+
+    /* (2^64 - 1)^2 = 2^128 - 2^65 + 1 */
+    x = mul128(0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, &low);
+    if (x != 0xFFFFFFFFFFFFFFFEULL || low != 1)
+        goto fail;
+
+    return 0;
+fail:
+    fprintf(stderr, "[-] util-rand: programming error\n");
+    return 1;
 }
@@ -40,6 +40,21 @@
  will use up those bytes at a slower pace, meaning the function will be faster.
  Therefore, the programmer should use the appropraite function to grab the 
  smallest number of bytes at a time.
+
+ The blocks are made 8 at a time, into a 512-byte buffer, which the
+ integer functions read a whole word at a time. On x86-64, the 8 blocks
+ are done side-by-side with AVX2 if the CPU has it (checked at runtime),
+ or else 4 at a time with SSE2. Either way, the numbers are the same as
+ from the plain C code, so a given seed gives the same numbers on
+ every machine.
+
+ Where nobody is trying to predict the numbers, such as choosing which
+ address a benchmark connects from, the programmer can instead seed
+ with `util_rand_seed_kind(ctx, UTIL_RAND_XOSHIRO256, ...)`. This uses
+ the non-cryptographic xoshiro256** generator, which makes each 64-bit
+ number with a handful of shifts and XORs, several times faster than
+ ChaCha20. The same functions then get their numbers from it, so code
+ that uses them doesn't care which one it has.
  */
 #ifndef UTIL_RAND_H
 #define UTIL_RAND_H
@@ -47,9 +62,14 @@
 #include <stdio.h>
 
 typedef struct {
-    uint64_t opaque[64];
+    uint64_t opaque[128];
 } util_rand_t;
 
+enum util_rand_kind_t {
+    UTIL_RAND_CHACHA20,
+    UTIL_RAND_XOSHIRO256,
+};
+
 /**
  * Start generating a series of random numbers based upon the
  * given 'seed'. If unpredictable numbers are desired, then this
@@ -71,6 +91,19 @@ typedef struct {
  */
 void util_rand_seed(util_rand_t *ctx, const void *seed, size_t seed_length);
 
+/**
+ * Choose the fastest ChaCha20 code this CPU has. Call this once, from
+ * main(), before starting any threads.
+ */
+void util_rand_init(void);
+
+/**
+ * Same as "util_rand_seed()", but choosing which generator to use,
+ * either the cryptographic ChaCha20, or the much faster, but
+ * predictable, xoshiro256**. Either way, the seed is hashed first.
+ */
+void util_rand_seed_kind(util_rand_t *ctx, enum util_rand_kind_t kind, const void *seed, size_t seed_length);
+
 /**
  * Stir in some additional randomness. This will preserve whatever
  * randomness that already exists and simply add this randomness. In other
@@ -135,7 +168,10 @@ void util_rand_bytes(util_rand_t *ctx, void *buf, size_t length);
 /**
  * The other functions return evenly distributed binary numbers,
  * but these generate uneven distribution when the desired range
- * isn't a power of two. For example, 
+ * isn't a power of two. For example, `util_rand8() % 3` gives 0
+ * slightly more often than 1 or 2, since 256 isn't a multiple of 3.
+ * This returns a number in [0..upper_bound) with every one equally
+ * likely, usually for the cost of one multiplication.
  */
 uint64_t util_rand_uniform(util_rand_t *ctx, uint64_t upper_bound);
 
@@ -154,5 +190,14 @@ uint16_t util_rand16_uniform(util_rand_t *ctx, uint16_t upper_bound);
  */
 unsigned char util_rand8_uniform(util_rand_t *ctx, unsigned char upper_bound);
 
+/**
+ * The name of the generator, and for ChaCha20, which code this CPU
+ * makes its blocks with, such as "chacha20-avx2", for recording
+ * alongside the seed.
+ */
+const char *util_rand_name(enum util_rand_kind_t kind);
+
+int util_rand_selftest(void);
+
 
 #endif
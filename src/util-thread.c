@@ -0,0 +1,123 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+#endif
+#include "util-thread.h"
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include "win-sockets.h"
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#endif
+
+/* We pass the caller's function and parameter through this
+ * structure, as the native thread functions have different
+ * signatures on each platform */
+struct thread_start {
+    void (*worker_thread)(void *);
+    void *worker_data;
+};
+
+#ifdef _WIN32
+static unsigned __stdcall
+_thread_start(void *v) {
+    struct thread_start x = *(struct thread_start *)v;
+    free(v);
+    x.worker_thread(x.worker_data);
+    return 0;
+}
+#else
+static void *
+_thread_start(void *v) {
+    struct thread_start x = *(struct thread_start *)v;
+    free(v);
+    x.worker_thread(x.worker_data);
+    return 0;
+}
+#endif
+
+util_thread_t
+util_thread_begin(void (*worker_thread)(void *), void *worker_data) {
+    struct thread_start *x;
+
+    x = malloc(sizeof(*x));
+    if (x == NULL)
+        return 0;
+    x->worker_thread = worker_thread;
+    x->worker_data = worker_data;
+
+#ifdef _WIN32
+    {
+        uintptr_t handle;
+        handle = _beginthreadex(0, 0, _thread_start, x, 0, 0);
+        if (handle == 0) {
+            free(x);
+            return 0;
+        }
+        return (util_thread_t)handle;
+    }
+#else
+    {
+        pthread_t thread;
+        int err;
+        err = pthread_create(&thread, 0, _thread_start, x);
+        if (err) {
+            free(x);
+            return 0;
+        }
+        return (util_thread_t)thread;
+    }
+#endif
+}
+
+void
+util_thread_join(util_thread_t thread) {
+#ifdef _WIN32
+    WaitForSingleObject((HANDLE)thread, INFINITE);
+    CloseHandle((HANDLE)thread);
+#else
+    pthread_join((pthread_t)thread, 0);
+#endif
+}
+
+int
+util_thread_setaffinity(unsigned cpu) {
+#if defined(_WIN32)
+    DWORD_PTR mask;
+    if (cpu >= sizeof(mask) * 8)
+        return -1;
+    mask = ((DWORD_PTR)1) << cpu;
+    if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0)
+        return -1;
+    return 0;
+#elif defined(__linux__)
+    cpu_set_t cpuset;
+    if (cpu >= CPU_SETSIZE)
+        return -1;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0)
+        return -1;
+    return 0;
+#else
+    /* macOS and the BSDs don't have a portable way of doing this */
+    (void)cpu;
+    return -1;
+#endif
+}
+
+void
+util_thread_sleep_ms(unsigned milliseconds) {
+#ifdef _WIN32
+    Sleep(milliseconds);
+#else
+    struct timespec ts;
+    ts.tv_sec = milliseconds / 1000;
+    ts.tv_nsec = (milliseconds % 1000) * 1000000;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+#endif
+}
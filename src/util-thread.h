@@ -0,0 +1,47 @@
+/*
+    Portable threads
+
+ A thin wrapper around pthreads on Unix and the native threads
+ on Windows. We only need the bare minimum: start a thread, wait
+ for it to finish, pin it to a CPU, and sleep.
+ */
+#ifndef UTIL_THREAD_H
+#define UTIL_THREAD_H
+#include <stdio.h>
+
+/**
+ * The handle of a started thread, to be passed to `util_thread_join()`.
+ */
+typedef size_t util_thread_t;
+
+/**
+ * Start a new thread that will run 'worker_thread(worker_data)'.
+ * @return
+ *      the handle of the thread, or 0 on failure.
+ */
+util_thread_t
+util_thread_begin(void (*worker_thread)(void *), void *worker_data);
+
+/**
+ * Wait for the thread to exit.
+ */
+void
+util_thread_join(util_thread_t thread);
+
+/**
+ * Pin the current thread so that it runs only on the given CPU.
+ * Memory the thread touches after this point will (on NUMA systems
+ * with the default first-touch policy) come from that CPU's node.
+ * @return
+ *      0 on success, -1 on failure.
+ */
+int
+util_thread_setaffinity(unsigned cpu);
+
+/**
+ * Put the current thread to sleep for the number of milliseconds.
+ */
+void
+util_thread_sleep_ms(unsigned milliseconds);
+
+#endif
@@ -0,0 +1,66 @@
+#include "util-time.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include "win-sockets.h"
+
+int
+clock_gettime(int clockid, struct timespec* tp) {
+    if (clockid != CLOCK_REALTIME) {
+        return -1; // Only CLOCK_REALTIME is supported in this implementation
+    }
+
+    FILETIME ft;
+    ULARGE_INTEGER li;
+
+    GetSystemTimeAsFileTime(&ft);
+    li.LowPart = ft.dwLowDateTime;
+    li.HighPart = ft.dwHighDateTime;
+
+    // Convert FILETIME to UNIX epoch (January 1, 1970)
+    li.QuadPart -= 116444736000000000LL;
+
+    // Convert to seconds and nanoseconds
+    tp->tv_sec = (time_t)(li.QuadPart / 10000000);
+    tp->tv_nsec = (long)((li.QuadPart % 10000000) * 100);
+
+    return 0;
+}
+#endif
+
+uint64_t
+util_time_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ULL
+        + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ULL / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+double
+util_parse_seconds(const char *str) {
+    char *end = NULL;
+    double result = strtod(str, &end);
+
+    if (end == str)
+        return -1.0;
+    if (strcmp(end, "") == 0 || strcmp(end, "s") == 0)
+        return result;
+    if (strcmp(end, "ms") == 0)
+        return result / 1000.0;
+    if (strcmp(end, "m") == 0)
+        return result * 60.0;
+    if (strcmp(end, "h") == 0)
+        return result * 3600.0;
+    return -1.0;
+}
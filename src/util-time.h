@@ -0,0 +1,33 @@
+/*
+    Portable time functions
+*/
+#ifndef UTIL_TIME_H
+#define UTIL_TIME_H
+#include <time.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#define CLOCK_REALTIME 1
+
+/**
+ * Windows doesn't have this POSIX function, so we emulate it. Only
+ * CLOCK_REALTIME is supported.
+ */
+int clock_gettime(int clockid, struct timespec* tp);
+#endif
+
+/**
+ * A monotonic timestamp in nanoseconds, for measuring intervals. This
+ * isn't related to the wall-clock time, and can't go backwards.
+ */
+uint64_t
+util_time_ns(void);
+
+/**
+ * Parse a time such as "30", "30s", "500ms", "5m", or "1h", returning
+ * the number of seconds, or -1 if it's not a valid time.
+ */
+double
+util_parse_seconds(const char *str);
+
+#endif
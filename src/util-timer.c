@@ -0,0 +1,218 @@
+#include "util-timer.h"
+#include <stdio.h>
+#include <string.h>
+
+#define TIMER_BITS 6
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_MAX_DELTA ((1ULL << (TIMER_BITS * TIMER_LEVELS)) - 1)
+
+static void
+_timer_link(util_timer_t *head, util_timer_t *timer) {
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void
+_timer_unlink(util_timer_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/*
+ * Put the timer in the slot for its time. The further away it
+ * is, the higher the level, and the coarser the slot.
+ */
+static void
+_timer_place(util_timers_t *timers, util_timer_t *timer) {
+    uint64_t expires = timer->expires;
+    uint64_t delta;
+    unsigned level;
+
+    /* Already expired, so process it on the next tick */
+    if (expires < timers->current)
+        expires = timers->current;
+    delta = expires - timers->current;
+
+    for (level = 0; level < TIMER_LEVELS - 1; level++) {
+        if (delta < (1ULL << (TIMER_BITS * (level + 1))))
+            break;
+    }
+    _timer_link(&timers->slots[level][(expires >> (TIMER_BITS * level)) & TIMER_MASK], timer);
+}
+
+void
+util_timers_init(util_timers_t *timers, uint64_t now) {
+    unsigned level;
+    unsigned i;
+
+    timers->current = now;
+    timers->count = 0;
+    for (level = 0; level < TIMER_LEVELS; level++) {
+        for (i = 0; i < TIMER_SLOTS; i++) {
+            util_timer_t *head = &timers->slots[level][i];
+            head->next = head;
+            head->prev = head;
+        }
+    }
+}
+
+void
+util_timer_add(util_timers_t *timers, util_timer_t *timer, uint64_t expires) {
+    if (timer->next)
+        _timer_unlink(timer);
+    else
+        timers->count++;
+
+    /* Anything too far in the future goes in the last slot */
+    if (expires > timers->current + TIMER_MAX_DELTA)
+        expires = timers->current + TIMER_MAX_DELTA;
+    timer->expires = expires;
+    _timer_place(timers, timer);
+}
+
+void
+util_timer_remove(util_timers_t *timers, util_timer_t *timer) {
+    if (timer->next == NULL)
+        return;
+    _timer_unlink(timer);
+    timers->count--;
+}
+
+/*
+ * When the lower level wraps around, move the timers from the next
+ * slot of the level above down into the lower levels.
+ */
+static void
+_timers_cascade(util_timers_t *timers) {
+    unsigned level;
+
+    for (level = 1; level < TIMER_LEVELS; level++) {
+        unsigned slot = (timers->current >> (TIMER_BITS * level)) & TIMER_MASK;
+        util_timer_t *head = &timers->slots[level][slot];
+
+        while (head->next != head) {
+            util_timer_t *timer = head->next;
+            _timer_unlink(timer);
+            _timer_place(timers, timer);
+        }
+
+        /* Only continue up if this level also wrapped */
+        if (slot != 0)
+            break;
+    }
+}
+
+util_timer_t *
+util_timers_expire(util_timers_t *timers, uint64_t now) {
+    /* Nothing armed, so just catch up */
+    if (timers->count == 0) {
+        if (timers->current <= now)
+            timers->current = now + 1;
+        return NULL;
+    }
+
+    while (timers->current <= now) {
+        util_timer_t *head = &timers->slots[0][timers->current & TIMER_MASK];
+
+        if (head->next != head) {
+            util_timer_t *timer = head->next;
+            _timer_unlink(timer);
+            timers->count--;
+            return timer;
+        }
+
+        timers->current++;
+        if ((timers->current & TIMER_MASK) == 0)
+            _timers_cascade(timers);
+    }
+    return NULL;
+}
+
+unsigned
+util_timers_next(const util_timers_t *timers, uint64_t now, unsigned max) {
+    uint64_t tick;
+    uint64_t end;
+
+    if (timers->count == 0)
+        return max;
+    if (timers->current <= now)
+        return 0;
+
+    /* Look through the first level until the next cascade, after
+     * which we can't tell without cascading */
+    end = (timers->current | TIMER_MASK) + 1;
+    if (end > now + max)
+        end = now + max;
+    for (tick = timers->current; tick < end; tick++) {
+        const util_timer_t *head = &timers->slots[0][tick & TIMER_MASK];
+        if (head->next != head)
+            break;
+    }
+    return (unsigned)(tick - now);
+}
+
+int
+util_timer_selftest(void) {
+    static util_timers_t timers;
+    static util_timer_t t[4];
+    static const uint64_t when[4] = {1005, 1070, 5000, 300000};
+    util_timer_t *timer;
+    uint64_t now;
+    size_t found = 0;
+    unsigned i;
+
+    memset(t, 0, sizeof(t));
+    util_timers_init(&timers, 1000);
+    for (i = 0; i < 4; i++)
+        util_timer_add(&timers, &t[i], when[i]);
+
+    /* Cancel one, and move another */
+    util_timer_remove(&timers, &t[1]);
+    util_timer_add(&timers, &t[2], 4000);
+    if (util_timer_is_armed(&t[1]) || timers.count != 3)
+        goto fail;
+    if (util_timers_expire(&timers, 1000) != NULL)
+        goto fail;
+    if (util_timers_next(&timers, 1000, 10) != 5)
+        goto fail;
+
+    /* Step through time, checking each expires exactly on time */
+    for (now = 1000; now <= 400000; now++) {
+        while ((timer = util_timers_expire(&timers, now)) != NULL) {
+            uint64_t expected = (timer == &t[0]) ? 1005 : (timer == &t[2]) ? 4000 : 300000;
+            if (now != expected || timer == &t[1])
+                goto fail;
+            found++;
+        }
+    }
+    if (found != 3 || timers.count != 0)
+        goto fail;
+
+    /* The same, but skipping ahead like the event loop does, where
+     * they expire late, but never early */
+    for (i = 0; i < 4; i++)
+        util_timer_add(&timers, &t[i], now + when[i]);
+    for (found = 0; found < 4 && now < 1000000; now += 37) {
+        while ((timer = util_timers_expire(&timers, now)) != NULL) {
+            if (now < timer->expires || now >= timer->expires + 37)
+                goto fail;
+            found++;
+        }
+    }
+    if (found != 4)
+        goto fail;
+
+    /* A timer in the past expires right away */
+    util_timer_add(&timers, &t[3], 5);
+    if (util_timers_expire(&timers, now) != &t[3])
+        goto fail;
+
+    return 0;
+fail:
+    fprintf(stderr, "[-] util.timer: programming error\n");
+    return 1;
+}
@@ -0,0 +1,82 @@
+/*
+    Timer wheel
+
+ A hierarchical timer wheel, for timing out connections. Each level
+ has 64 slots, the first with one millisecond per slot, the next
+ with 64 milliseconds per slot, and so on, for four levels covering
+ about 4.6 hours. Timers in the higher levels are moved down
+ ("cascaded") as their time gets closer.
+
+ The timers are intrusive: the caller embeds a `util_timer_t` in its
+ own structure, so arming and cancelling is O(1), with no memory
+ allocation. Timers are only accurate to the millisecond.
+ */
+#ifndef UTIL_TIMER_H
+#define UTIL_TIMER_H
+#include <stdint.h>
+#include <stddef.h>
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOTS 64
+
+typedef struct util_timer_t {
+    struct util_timer_t *next;
+    struct util_timer_t *prev;
+    uint64_t expires;
+} util_timer_t;
+
+typedef struct util_timers_t {
+    /* The next tick (millisecond) to be processed */
+    uint64_t current;
+
+    /* The number of timers that are armed */
+    size_t count;
+
+    util_timer_t slots[TIMER_LEVELS][TIMER_SLOTS];
+} util_timers_t;
+
+/**
+ * Initialize the wheel, starting at the given time (milliseconds).
+ */
+void
+util_timers_init(util_timers_t *timers, uint64_t now);
+
+/**
+ * Arm the timer to expire at the given time (milliseconds). If it's
+ * already armed, it's moved.
+ */
+void
+util_timer_add(util_timers_t *timers, util_timer_t *timer, uint64_t expires);
+
+/**
+ * Cancel the timer, if it's armed.
+ */
+void
+util_timer_remove(util_timers_t *timers, util_timer_t *timer);
+
+/**
+ * Whether the timer is armed.
+ */
+static inline int
+util_timer_is_armed(const util_timer_t *timer) {
+    return timer->next != NULL;
+}
+
+/**
+ * Remove and return one timer that has expired by 'now'. Call this
+ * repeatedly until it returns NULL.
+ */
+util_timer_t *
+util_timers_expire(util_timers_t *timers, uint64_t now);
+
+/**
+ * The number of milliseconds until the next timer might expire, for
+ * the event loop's timeout, no more than 'max'.
+ */
+unsigned
+util_timers_next(const util_timers_t *timers, uint64_t now, unsigned max);
+
+int
+util_timer_selftest(void);
+
+#endif